@@ -1,315 +1,102 @@
 #include "LC3VM.h"
+#include "ops.h"
 
-// Provide definition of the extern global variables defined in header
-const int LC3VM::MEMORY_MAX = 65536; 
-int LC3VM::running = 0;
-uint16_t LC3VM::memory[65536];
-uint16_t LC3VM::reg[LC3VM::R_COUNT];
+#include <string.h>
+#include <chrono>
 
-uint16_t LC3VM::swap16(uint16_t x) {
-	return (x << 8) | (x >> 8);
-}
-
-void LC3VM::read_image_file(FILE* file) {
-	uint16_t origin; // Where in memory to place the image
-	fread(&origin, sizeof(origin), 1, file);
-	origin = swap16(origin);
+using namespace LC3VM;
 
-	uint16_t max_read = LC3VM::MEMORY_MAX - origin;
-	uint16_t* p = LC3VM::memory + origin;
-	size_t read = fread(p, sizeof(uint16_t), max_read, file);
-
-	// Switch to little endian
-	while (read-- > 0) {
-		*p = swap16(*p);
-		p++;
-	}
+namespace {
+	// Instructions that can write registers other than the one in bits 9-11, the tracer copies all of them
+	const unsigned ANY_REGISTER_OPS = (1 << OP_JSR) | (1 << OP_RTI) | (1 << OP_RES) | (1 << OP_TRAP);
 }
 
-int LC3VM::read_image(const char* image_path) {
-	FILE* file = fopen(image_path, "rb");
-	if (!file) { return 0; };
-	read_image_file(file);
-	fclose(file);
-	return 1;
+Machine::Machine() : running(0), memory(), reg(), flag_value(0), psr(PSR_USER), saved_ssp(SSP_START), saved_usp(0), interrupt_pending(0), engine(DEFAULT_ENGINE), instructions(0), stop_requested(false), suspend_on_input(false), waiting_input(false), idle_period(0), intrinsics(nullptr), metrics(nullptr), debugger(nullptr), dirty_pages(), keyboard(&Keyboard::console()) {
+	map_keyboard(*this);
+	map_psr(*this);
 }
 
-void LC3VM::mem_write(uint16_t address, uint16_t val) {
-	LC3VM::memory[address] = val;
+uint16_t LC3VM::swap16(uint16_t x) {
+	return (x << 8) | (x >> 8);
 }
 
-uint16_t LC3VM::mem_read(uint16_t address) {
-	// A special case is needed for the memory mapped registers
-	if (address == LC3VM::MR_KBSR) {
-		if (check_key()) {
-			LC3VM::memory[LC3VM::MR_KBSR] = (1 << 15);
-			LC3VM::memory[LC3VM::MR_KBDR] = getchar();
-		}
-		else {
-			LC3VM::memory[LC3VM::MR_KBSR] = 0;
-		}
+void Machine::read_image_file(FILE* file) {
+	uint16_t origin; // Where in memory to place the image
+	if (fread(&origin, sizeof(origin), 1, file) != 1) {
+		return;
 	}
-	return LC3VM::memory[address];
-}
+	origin = swap16(origin);
 
-uint16_t LC3VM::sign_extend(uint16_t x, int bit_count) {
-	if ((x >> (bit_count - 1)) & 1) {
-		x |= (0xFFFF << bit_count);
-	}
-	return x;
-}
+	uint16_t max_read = MEMORY_MAX - origin;
+	uint16_t* p = memory + origin;
+	size_t read = fread(p, sizeof(uint16_t), max_read, file);
 
-void LC3VM::update_flags(uint16_t r) {
-	if (LC3VM::reg[r] == 0) {
-		LC3VM::reg[LC3VM::R_COND] = LC3VM::FL_ZRO;
-	}
-	else if (LC3VM::reg[r] >> 15) {	// A 1 in the leftmost bit indicates that it is negative
-		LC3VM::reg[LC3VM::R_COND] = LC3VM::FL_NEG;
-	}
-	else {
-		LC3VM::reg[LC3VM::R_COND] = LC3VM::FL_POS;
-	}
-}
+	// Switch to little endian
+	swap16_buffer(p, p, read);
 
-void LC3VM::op_add(uint16_t instr) {
-	uint16_t r0 = (instr >> 9) & 0x7;					
-	uint16_t r1 = (instr >> 6) & 0x7;				
-	uint16_t imm_flag = (instr >> 5) & 0x1;			
-	if (imm_flag) {
-		uint16_t imm5 = sign_extend(instr & 0x1F, 5);
-		reg[r0] = reg[r1] + imm5;							
-	}
-	else {
-		uint16_t r2 = instr & 0x7;
-		reg[r0] = reg[r1] + reg[r2];					
-	}
-	update_flags(r0);										
+	after_load(origin, (uint32_t)read);
 }
 
-void LC3VM::op_and(uint16_t instr) {
-	/*
-	The binary encoding of AND is basically exactly the same as ADD
-	The implementation here is therefore essentially the same as the above, but now replace + by bitwise AND
-	*/
-	uint16_t r0 = (instr >> 9) & 0x7;					
-	uint16_t r1 = (instr >> 6) & 0x7;						
-	uint16_t imm_flag = (instr >> 5) & 0x1;				
-	if (imm_flag) {
-		uint16_t imm5 = sign_extend(instr & 0x1F, 5);
-		reg[r0] = reg[r1] & imm5;							
+void Machine::after_load(uint16_t begin, uint32_t count) {
+	if (count) {
+		memset(dirty_pages + begin / PAGE_WORDS, 1, (begin + count - 1) / PAGE_WORDS - begin / PAGE_WORDS + 1);
 	}
-	else {
-		uint16_t r2 = instr & 0x7;
-		reg[r0] = reg[r1] & reg[r2];					
+	// A different image may have a translation of its own
+	if (aot) {
+		aot.reset();
 	}
-	update_flags(r0);
-}
-
-void LC3VM::op_not(uint16_t instr) {
-	/*
-	The encoding of NOT is
-	15 12  11   9 8  6 5 4    0
-	1001      DR   SR  1  1111
-	Unlike ADD and AND this only has one source operand.
-	*/
-	uint16_t r0 = (instr >> 9) & 0x7;					
-	uint16_t r1 = (instr >> 6) & 0x7;						
-	reg[r0] = ~reg[r1];
-	update_flags(r0);
-}
-
-void LC3VM::op_br(uint16_t instr) {
-	/*
-	The encoding of BR is
-	15  12  11  10   9    8           0
-	0000     n   z   p      PCoffset9
-	n, z and p stand for each condition code (negative, zero, positive).
-	PCoffset9 is telling us to add to the program counter.
-	Branch instructions specify condition codes.
-	If specified condition codes are set, the branch is taken, by setting the PC to address specified in instruction.
-	Ekse, the next instruction is executed (+1 from current PC)
-	*/
-	uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);		
-	uint16_t cond_flag = (instr >> 9) & 0x7;			
-	if (cond_flag & reg[R_COND]) {						
-		reg[R_PC] += pc_offset;					
+	if (engine == ENGINE_PREDECODED || engine == ENGINE_JIT || engine == ENGINE_AOT || decoded) {
+		decode_range(begin, count);
 	}
 }
 
-void LC3VM::op_jmp(uint16_t instr) {
-	/*
-	The encoding of JMP is
-	15 12 11  9  8   6   5    0
-	1100   000   BaseR   000000
-
-	JMP is an unconditional branch ('jump')
-	It sets PC = BaseR
-	*/
-	uint16_t BaseR = (instr >> 6) & 0x7;				
-	reg[R_PC] = reg[BaseR];
-}
-
-void LC3VM::op_jsr(uint16_t instr) {
-	/*
-	The encoding of JSR is
-	15 12 11 10           0
-	0100   1    PCoffset11
-	The encoding of JSRR is
-	15 12 11 10  9 8    6   5      0
-	0100   0   00   BaseR    000000
-
-	JSR is jump to subroutine.
-	The bit 11 in the instruction tells is a flag to execute JSR or JSRR.
-	*/
-	uint16_t flag = (instr >> 11) & 1;				
-	reg[R_R7] = reg[R_PC];							
-	if (flag == 1) {									
-		uint16_t pc_offset = sign_extend(instr & 0x7FF, 11);
-		reg[R_PC] += pc_offset;
-	}
-	else {
-		uint16_t BaseR = (instr >> 6) & 0x7;
-		reg[R_PC] = reg[BaseR];
-	}
-}
-
-void LC3VM::op_ld(uint16_t instr) {
-	/*
-	The encoding of LD is
-	15 12 11 9  8         0
-	0010   DR    PCoffset9
-
-	LD is a load instruction.
-	*/
-	uint16_t dr = (instr >> 9) & 0x7;				
-	uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);		
-	reg[dr] = mem_read(reg[R_PC] + pc_offset);
-	update_flags(dr);
-}
-
-void LC3VM::op_ldi(uint16_t instr) {
-	/*
-	The encoding of LDI is
-	15 12  11 9  8         0
-	1010    DR    PCoffset9
-
-	The operation is similar to LD, but instead it addresses memory using an address stored somewhere in memory
-	LDI does the operation DR = mem[mem[PC^+ + SEXT(PCoffset9)]]
-	as opposed to LD which was DR = mem[PC^+ + SEXT(PCoffset9)]
-	*/
-	uint16_t r0 = (instr >> 9) & 0x7;						
-	uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);	
-	reg[r0] = mem_read(mem_read(reg[R_PC] + pc_offset));	
-	update_flags(r0);
-}
-
-void LC3VM::op_ldr(uint16_t instr) {
-	/*
-	The encoding of LDR is
-	15 12 11 9  8   6   5     0
-	0110   DR   BaseR   offset6
-
-	LDR stands for Load Base + offset.
-	This differs from the previous LD-type instructions by doing
-	DR = mem[BaseR + SEXT(offset6)]
-	*/
-	uint16_t dr = (instr >> 9) & 0x7;			
-	uint16_t r1 = (instr >> 6) & 0x7;					
-	uint16_t pc_offset = sign_extend(instr & 0x3F, 6);	
-	reg[dr] = mem_read(reg[r1] + pc_offset);
-	update_flags(dr);
-}
-
-void LC3VM::op_lea(uint16_t instr) {
-	/*
-	The encoding of LEA is
-	15 12  11 9   8         0
-	1110    DR     PCoffset9
-
-	LEA is load effective address.
-	*/
-	uint16_t dr = (instr >> 9) & 0x7;					
-	uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);	
-	reg[dr] = reg[R_PC] + pc_offset;
-	update_flags(dr);
-}
-
-void LC3VM::op_st(uint16_t instr) {
-	/*
-	The encoding of ST is
-	15  12  11 9  8         0
-	0011    SR     PCoffset9
-
-	ST is store.
-	*/
-	uint16_t sr = (instr >> 9) & 0x7;				
-	uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);		
-	mem_write(reg[R_PC] + pc_offset, reg[sr]);
-}
-
-void LC3VM::op_sti(uint16_t instr) {
-	/*
-	The encoding of STI is
-	15  12  11 9  8         0
-	0011    SR     PCoffset9
-
-	STI is store indirect, similar to the load case.
-	*/
-	uint16_t sr = (instr >> 9) & 0x7;				
-	uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);	
-	mem_write(mem_read(reg[R_PC] + pc_offset), reg[sr]);
-}
-
-void LC3VM::op_str(uint16_t instr) {
-	/*
-	The encoding of STR is
-	15 12 11 9 8    6   5      0
-	0111   SR   BaseR   offset6
-
-	STR is store base + offset, similar to the load case.
-	*/
-	uint16_t sr = (instr >> 9) & 0x7;			
-	uint16_t baser = (instr >> 6) & 0x7;				
-	uint16_t pc_offset = sign_extend(instr & 0x3F, 6);	
-	mem_write(reg[baser] + pc_offset, reg[sr]);
-}
-
-void LC3VM::op_trap(uint16_t instr) {
+void Machine::op_trap(uint16_t instr) {
 	/*
 	The encoding of TRAP is
 	15 12  11   8   7        0
 	1111    0000    trapvect8
 	*/
+	uint16_t old_r7 = reg[R_R7];
 	reg[R_R7] = reg[R_PC];
 
 	switch (instr & 0xFF) {
 	case TRAP_GETC:
 		/* read a single ASCII char */
-		reg[R_R0] = (uint16_t)getchar();
+		if (suspend_for_input(old_r7)) {
+			break;
+		}
+		output.before_input();
+		reg[R_R0] = wait_for_key();
 		update_flags(R_R0);
 		break;
 	case TRAP_OUT:
-		putc((char)reg[R_R0], stdout);
-		fflush(stdout);
+		output.put((char)reg[R_R0]);
 		break;
 	case TRAP_PUTS:
 	{
-		/* one char per word */
-		uint16_t* c = memory + reg[R_R0];
-		while (*c)
-		{
-			putc((char)*c, stdout);
-			++c;
+		/* one char per word, copied in one go up to the terminating zero */
+		const uint16_t* s = memory + reg[R_R0];
+		size_t n = 0;
+		size_t limit = MEMORY_MAX - reg[R_R0];
+		while (n < limit && s[n]) {
+			n++;
 		}
-		fflush(stdout);
+		char* dst = output.reserve(n);
+		for (size_t i = 0; i < n; i++) {
+			dst[i] = (char)s[i];
+		}
+		output.commit(n);
 	}
 	break;
 	case TRAP_IN:
 	{
-		printf("Enter a character: ");
-		char c = getchar();
-		putc(c, stdout);
-		fflush(stdout);
+		if (suspend_for_input(old_r7)) {
+			break;
+		}
+		output.write("Enter a character: ", 19);
+		output.before_input();
+		char c = (char)wait_for_key();
+		output.put(c);
 		reg[R_R0] = (uint16_t)c;
 		update_flags(R_R0);
 	}
@@ -319,31 +106,110 @@ void LC3VM::op_trap(uint16_t instr) {
 		/* one char per byte (two bytes per word)
 		   here we need to swap back to
 		   big endian format */
-		uint16_t* c = memory + reg[R_R0];
-		while (*c)
-		{
-			char char1 = (*c) & 0xFF;
-			putc(char1, stdout);
-			char char2 = (*c) >> 8;
-			if (char2) putc(char2, stdout);
-			++c;
+		const uint16_t* s = memory + reg[R_R0];
+		size_t n = 0;
+		size_t limit = MEMORY_MAX - reg[R_R0];
+		while (n < limit && s[n]) {
+			n++;
+		}
+		char* dst = output.reserve(2 * n);
+		size_t len = 0;
+		for (size_t i = 0; i < n; i++) {
+			dst[len++] = (char)(s[i] & 0xFF);
+			char char2 = (char)(s[i] >> 8);
+			if (char2) dst[len++] = char2;
 		}
-		fflush(stdout);
+		output.commit(len);
 	}
 	break;
 	case TRAP_HALT:
-		puts("HALT");
-		fflush(stdout);
+		output.write("HALT\n", 5);
+		output.flush();
 		running = 0;
 		break;
+	default:
+		if (intrinsics) {
+			const Intrinsic* native = intrinsics->trap((uint8_t)instr);
+			if (native) {
+				// The routine the trap vector table points at is what a native trap replaces
+				call_native(*native, memory[instr & 0xFF]);
+			}
+		}
+		break;
+	}
+	// A trap undone to wait for input is counted when it runs again
+	if (metrics && !waiting_input) {
+		slice_metrics.traps[instr & 0xFF]++;
+		slice_metrics.trap_count++;
+	}
+	if (running) {
+		check_interrupts();
+	}
+}
+
+void Machine::enter_interrupt(uint8_t vector, uint16_t priority) {
+	/*
+	The PSR and then the PC of the interrupted program go on the supervisor
+	stack, and the handler runs in supervisor mode at the priority of the
+	interrupt. The condition codes are left as they were.
+	*/
+	uint16_t old_psr = get_psr();
+	if (psr & PSR_USER) {
+		saved_usp = reg[R_R6];
+		reg[R_R6] = saved_ssp;
+	}
+	psr = (uint16_t)(priority << PSR_PRIORITY_SHIFT);
+	mem_write(--reg[R_R6], old_psr);
+	mem_write(--reg[R_R6], reg[R_PC]);
+	reg[R_PC] = mem_read(IVT_BASE + vector);
+}
+
+void Machine::service_interrupts() {
+	interrupt_pending = 0;
+	// The keyboard is the only device that interrupts
+	uint16_t kbsr = memory[MR_KBSR];
+	if ((kbsr & KBSR_READY) && (kbsr & KBSR_IE) && KEYBOARD_PRIORITY > (psr & PSR_PRIORITY) >> PSR_PRIORITY_SHIFT) {
+		enter_interrupt(INT_KEYBOARD, KEYBOARD_PRIORITY);
 	}
 }
 
-void LC3VM::op_res(uint16_t instr) {}
+void Machine::check_idle(uint16_t instr) {
+	/*
+	Two loops can only be left once a key arrives, the polling loop
+
+		LOOP	LDI R0, KBSR_PTR	; through a word holding xFE00
+				BRzp LOOP			; any BR taken while the ready bit is clear
 
-void LC3VM::op_rti(uint16_t instr) {}
+	and, with the keyboard interrupt enabled, a branch to itself. Until the
+	keyboard is polled again at the end of the slice every iteration leaves
+	the machine as it was, so the core stops here and run_slice() retires the
+	rest of the slice in whole iterations. None of this applies while a
+	debugger, profiler or tracer needs to see every instruction, or once an
+	interrupt is pending.
+	*/
+	uint16_t kbsr = memory[MR_KBSR];
+	if ((kbsr & KBSR_READY) || interrupt_pending || debugger || tracer || profiler) {
+		return;
+	}
+	uint16_t head = reg[R_PC];
+	if ((instr & 0x1FF) == 0x1FF) {
+		if (kbsr & KBSR_IE) {
+			idle_period = 1;
+			running = 0;
+		}
+		return;
+	}
+	uint16_t ldi = memory[head];
+	uint16_t pointer = (uint16_t)(head + 1 + sign_extend(ldi & 0x1FF, 9));
+	// The BR must loop on what the LDI reads, the pointer must be plain memory
+	if ((ldi >> 12) != OP_LDI || memory[pointer] != MR_KBSR || io.is_io(pointer) || !(((instr >> 9) & 0x7) & flags_of(kbsr))) {
+		return;
+	}
+	idle_period = 2;
+	running = 0;
+}
 
-void LC3VM::switch_op(uint16_t instr) {
+void Machine::switch_op(uint16_t instr) {
 	uint16_t op = instr >> 12;
 	switch (op) {
 	case OP_ADD:
@@ -396,15 +262,277 @@ void LC3VM::switch_op(uint16_t instr) {
 	}
 }
 
-void LC3VM::run() {
+void Machine::reset() {
 	reg[R_COND] = FL_ZRO;
-	enum { PC_START = 0X3000 };
 	reg[R_PC] = PC_START;
+	psr = PSR_USER;
+	saved_ssp = SSP_START;
+	saved_usp = 0;
+	interrupt_pending = 0;
 
 	running = 1;
+}
+
+uint32_t Machine::run_slice(uint32_t count) {
+	waiting_input = false;
+	idle_period = 0;
+
+	// The clock is only read for someone counting
+	std::chrono::steady_clock::time_point started;
+	if (metrics) {
+		started = std::chrono::steady_clock::now();
+	}
+
+	// Stop exactly where the next timed key becomes visible
+	uint64_t due = keyboard->next_event();
+	if (due > instructions && due - instructions < count) {
+		count = (uint32_t)(due - instructions);
+	}
+
+	// A program waiting for keyboard interrupts does not poll, so keys are latched for it between slices
+	if ((memory[MR_KBSR] & (KBSR_IE | KBSR_READY)) == KBSR_IE) {
+		latch_key(*this);
+	}
+
+	uint32_t executed;
+	uint32_t idle = 0;
+	if (debugger) {
+		// Breakpoints live in the pre-decoded cache
+		executed = run_predecoded(count);
+	}
+	// Profiling and tracing need to see every instruction, so they always run on the switch core
+	else if (tracer || profiler) {
+		if (tracer && !tracer->started()) {
+			tracer->begin(*this);
+		}
+		if (!tracer) {
+			executed = switch_loop<true, false>(count);
+		}
+		else if (profiler) {
+			executed = switch_loop<true, true>(count);
+		}
+		else {
+			executed = switch_loop<false, true>(count);
+		}
+	}
+	else {
+		switch (engine) {
+		case ENGINE_THREADED:
+			executed = run_threaded(count);
+			break;
+		case ENGINE_PREDECODED:
+			executed = run_predecoded(count);
+			break;
+		case ENGINE_JIT:
+			executed = run_jit(count);
+			break;
+		case ENGINE_AOT:
+			executed = run_aot(count);
+			break;
+		default:
+			executed = run_switch(count);
+			break;
+		}
+	}
+
+	if (waiting_input) {
+		// The trap that suspended was undone, so it did not retire
+		executed--;
+		running = 1;
+	}
+	else if (idle_period) {
+		// The loop would have spun to the end of the slice, retire its whole iterations at once
+		uint32_t iterations = (count - executed) / idle_period;
+		if (iterations && idle_period == 2) {
+			// What the LDI of every iteration leaves behind
+			uint16_t r = (memory[reg[R_PC]] >> 9) & 0x7;
+			reg[r] = memory[MR_KBSR];
+			update_flags(r);
+			store_flags();
+		}
+		idle = iterations * idle_period;
+		executed += idle;
+		running = 1;
+		output.before_input();
+		if (suspend_on_input && !keyboard->ready()) {
+			waiting_input = true;
+		}
+	}
+	instructions += executed;
+	keyboard->advance(instructions);
+	if (metrics) {
+		publish_metrics(executed, idle, std::chrono::steady_clock::now() - started);
+	}
+	return executed;
+}
+
+bool Machine::suspend_for_input(uint16_t old_r7) {
+	if (!suspend_on_input || keyboard->ready()) {
+		return false;
+	}
+	reg[R_R7] = old_r7;
+	reg[R_PC]--;
+	waiting_input = true;
+	output.before_input();
+	// Every core leaves once a trap clears running, run_slice() sets it again
+	running = 0;
+	return true;
+}
+
+StopReason Machine::run_for(uint64_t n) {
+	suspend_on_input = true;
+	waiting_input = false;
+	uint64_t end = instructions + n;
+	while (running && instructions < end && !waiting_input) {
+		uint64_t left = end - instructions;
+		run_slice(left < UINT32_MAX ? (uint32_t)left : UINT32_MAX);
+	}
+	suspend_on_input = false;
+	if (!running) {
+		return STOP_HALTED;
+	}
+	return waiting_input ? STOP_INPUT : STOP_BUDGET;
+}
+
+StopReason Machine::run_until(std::chrono::steady_clock::time_point deadline) {
+	// Long enough that reading the clock is noise, short enough to stop within well under a millisecond
+	const uint32_t SLICE = 1 << 16;
+	suspend_on_input = true;
+	waiting_input = false;
+	while (running && !waiting_input && std::chrono::steady_clock::now() < deadline) {
+		run_slice(SLICE);
+	}
+	suspend_on_input = false;
+	if (!running) {
+		return STOP_HALTED;
+	}
+	return waiting_input ? STOP_INPUT : STOP_DEADLINE;
+}
+
+uint32_t Machine::run_switch(uint32_t count) {
+	return switch_loop<false, false>(count);
+}
+
+// With Profile and Trace false this is the plain reference core, the counting and recording compile away
+template <bool Profile, bool Trace>
+uint32_t Machine::switch_loop(uint32_t count) {
+	uint32_t executed = 0;
+	load_flags();
+	while (running && executed < count) {
+		uint16_t pc = reg[R_PC];
+		uint16_t instr = memory[reg[R_PC]++];
+		// Taking an interrupt at the end of the instruction changes R6 and the PC
+		bool any_register = Trace && (interrupt_pending || ((1 << (instr >> 12)) & ANY_REGISTER_OPS) != 0);
+		if (Trace) {
+			tracer->before(pc, instr);
+		}
+		if (Profile) {
+			profiler->instruction(pc, instr);
+			switch (instr >> 12) {
+			case OP_TRAP:
+			{
+				std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+				switch_op(instr);
+				std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start;
+				profiler->trap((uint8_t)instr, (uint64_t)elapsed.count());
+			}
+			break;
+			case OP_JSR:
+			{
+				uint16_t target = ((instr >> 11) & 1) ? (uint16_t)(pc + 1 + sign_extend(instr & 0x7FF, 11)) : reg[(instr >> 6) & 0x7];
+				switch_op(instr);
+				// A native routine has returned already
+				if (!intrinsics || !intrinsics->at(target)) {
+					profiler->call(reg[R_PC]);
+				}
+			}
+			break;
+			case OP_JMP:
+				switch_op(instr);
+				if (((instr >> 6) & 0x7) == R_R7) {
+					profiler->ret();
+				}
+				break;
+			default:
+				switch_op(instr);
+				break;
+			}
+		}
+		else {
+			switch_op(instr);
+		}
+		if (Trace) {
+			tracer->after(reg, flags_of(flag_value), any_register);
+		}
+		executed++;
+	}
+	store_flags();
+	return executed;
+}
+
+void Machine::run() {
+	reset();
+	run_to_halt();
+}
+
+void Machine::run_to_halt() {
+	// Slices are short enough for the output timer and Ctrl-C to be checked several times a second
+	while (running && !stop_requested.load(std::memory_order_relaxed)) {
+		run_slice(1 << 20);
+		if (stop_requested.load(std::memory_order_relaxed)) {
+			break;
+		}
+		if (idle_period) {
+			if (metrics) {
+				// Blocking anyway, so added straight away rather than with the next slice
+				std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+				keyboard->wait_ready();
+				std::chrono::nanoseconds waited = std::chrono::steady_clock::now() - start;
+				metrics->input_wait_ns.fetch_add((uint64_t)waited.count(), std::memory_order_relaxed);
+			}
+			else {
+				keyboard->wait_ready();
+			}
+		}
+		output.tick();
+	}
+	output.flush();
+	if (tracer) {
+		tracer->finish(*this);
+	}
+}
+
+uint32_t Machine::run_jit(uint32_t count) {
+	if (!jit) {
+		jit.reset(new Jit(*this));
+	}
+	return jit->run(count);
+}
 
-	while (running) {
-		uint16_t instr = mem_read(reg[R_PC]++); 
-		switch_op(instr); 
+uint32_t Machine::run_aot(uint32_t count) {
+	if (!aot) {
+		aot.reset(new Aot(*this));
+	}
+	return aot->run(count);
+}
+
+const char* LC3VM::engine_name(Engine engine) {
+	switch (engine) {
+	case ENGINE_SWITCH: return "switch";
+	case ENGINE_THREADED: return "threaded";
+	case ENGINE_PREDECODED: return "predecoded";
+	case ENGINE_JIT: return "jit";
+	case ENGINE_AOT: return "aot";
+	default: return "unknown";
+	}
+}
+
+bool LC3VM::engine_from_name(const char* name, Engine& engine) {
+	for (int e = 0; e < ENGINE_COUNT; e++) {
+		if (strcmp(name, engine_name((Engine)e)) == 0) {
+			engine = (Engine)e;
+			return true;
+		}
 	}
+	return false;
 }
\ No newline at end of file
@@ -1,25 +1,44 @@
 #pragma once
 
+#ifdef _MSC_VER
 #pragma warning(disable:4996)
+#endif
 
 #include <stdio.h>
 #include <stdint.h>
 #include <signal.h>
-
-/* windows only */
-#include <Windows.h>
-#include <conio.h>  // _kbhit
+#include <atomic>
+#include <memory>
+#include <chrono>
 
 #include "utils.h"
+#include "keyboard.h"
+#include "decode.h"
+#include "jit.h"
+#include "aot.h"
+#include "mmio.h"
+#include "output.h"
+#include "image.h"
+#include "profile.h"
+#include "intrinsics.h"
+#include "trace.h"
+#include "debug.h"
+#include "metrics.h"
 
 namespace LC3VM {
-	// Hardware data for the VM
+	// Memory
+	const int MEMORY_MAX = 65536; // Max amount of memory locations
+	const uint16_t PC_START = 0x3000; // Where execution begins
+	const int PAGE_WORDS = 256; // Memory is shared and snapshotted in pages of this many words
+	const int PAGE_COUNT = MEMORY_MAX / PAGE_WORDS;
 
-	extern int running;
+	// An immutable page of memory, shared between a machine and the machines forked from it
+	struct MemoryPage {
+		uint16_t words[PAGE_WORDS];
+	};
 
-	// Memory
-	extern const int MEMORY_MAX; // Max amount of memory locations
-	extern uint16_t memory[65536]; // Memory locations store 16-bit values
+	// Whether the PAGE_WORDS words at words are all zero, what a missing shared or snapshot page stands for
+	bool page_is_zero(const uint16_t* words);
 
 	// Registers
 	enum {
@@ -35,7 +54,6 @@ namespace LC3VM {
 		R_COND, // Condition flags
 		R_COUNT
 	};
-	extern uint16_t reg[R_COUNT];
 
 	// Opcodes
 	enum {
@@ -68,8 +86,33 @@ namespace LC3VM {
 	enum {
 		MR_KBSR = 0xFE00, // Keyboard status
 		MR_KBDR = 0xFE02, // Keyboard data
+		MR_PSR = 0xFFFC, // Processor status
+	};
+
+	// Keyboard status bits
+	enum {
+		KBSR_READY = 1 << 15, // A key is latched in KBDR, cleared by reading KBDR
+		KBSR_IE = 1 << 14, // Interrupt when a key is latched
+	};
+
+	// Processor status bits, the condition codes are the low three
+	enum {
+		PSR_USER = 1 << 15, // User mode, clear in supervisor mode
+		PSR_PRIORITY = 0x7 << 8, // Priority level of the running program
+		PSR_PRIORITY_SHIFT = 8,
 	};
 
+	// Vectors in the interrupt vector table, which starts at IVT_BASE
+	enum {
+		INT_PRIVILEGE = 0x00, // RTI in user mode
+		INT_ILLEGAL_OPCODE = 0x01, // The reserved opcode
+		INT_KEYBOARD = 0x80,
+	};
+
+	const uint16_t IVT_BASE = 0x0100;
+	const uint16_t KEYBOARD_PRIORITY = 4;
+	const uint16_t SSP_START = 0x3000; // Supervisor stack pointer after reset, the stack grows down from below user programs
+
 	// Trap codes
 	enum {
 		TRAP_GETC = 0x20, // Read single character from keyboard
@@ -80,41 +123,295 @@ namespace LC3VM {
 		TRAP_HALT = 0x25, // Halt execution and print message to console
 	};
 
-	// Reading LC-3 programs into memory
-	uint16_t swap16(uint16_t x);
-	void read_image_file(FILE* file);
-	int read_image(const char* image_path);
+	// Interpreter cores, they all produce exactly the same architectural state
+	enum Engine {
+		ENGINE_SWITCH = 0, // switch_op per instruction, the reference implementation
+		ENGINE_THREADED, // Direct-threaded dispatch (threaded.cpp)
+		ENGINE_PREDECODED, // Dispatch over the pre-decoded instruction cache (decode.cpp)
+		ENGINE_JIT, // Hot basic blocks compiled to x86-64 (jit.cpp)
+		ENGINE_AOT, // Images translated to C++ at build time (aot.cpp)
+		ENGINE_COUNT
+	};
 
-	// Memory reading / writing
-	void mem_write(uint16_t address, uint16_t val);
-	uint16_t mem_read(uint16_t address);
+	// Build with LC3VM_THREADED_DISPATCH defined to make the threaded core the default
+#ifdef LC3VM_THREADED_DISPATCH
+	const Engine DEFAULT_ENGINE = ENGINE_THREADED;
+#else
+	const Engine DEFAULT_ENGINE = ENGINE_SWITCH;
+#endif
+
+	// Why run_for() / run_until() returned
+	enum StopReason {
+		STOP_HALTED = 0, // The program executed TRAP_HALT (or was never started)
+		STOP_BUDGET, // The instruction budget ran out
+		STOP_DEADLINE, // The deadline passed
+		STOP_INPUT, // GETC/IN found no key, resuming executes the trap again, or the program idles until one arrives
+	};
 
-	// Helper functions for implementing the opcodes
+	const char* engine_name(Engine engine);
+	bool engine_from_name(const char* name, Engine& engine);
 
+	// Helpers shared by every machine
+	uint16_t swap16(uint16_t x);
 	uint16_t sign_extend(uint16_t x, int bit_count);
-	void update_flags(uint16_t r);
-
-	// Implementations of standard opcodes
-	void op_add(uint16_t instr);
-	void op_and(uint16_t instr);
-	void op_not(uint16_t instr);
-	void op_br(uint16_t instr);
-	void op_jmp(uint16_t instr);
-	void op_jsr(uint16_t instr);
-	void op_ld(uint16_t instr);
-	void op_ldi(uint16_t instr);
-	void op_ldr(uint16_t instr);
-	void op_lea(uint16_t instr);
-	void op_st(uint16_t instr);
-	void op_sti(uint16_t instr);
-	void op_str(uint16_t instr);
-	void op_trap(uint16_t instr);
-	void op_res(uint16_t instr);
-	void op_rti(uint16_t instr);
-
-	// Read an instruction and execute relevant opcode
-	void switch_op(uint16_t instr); 
-
-	// Run the VM
-	void run();
+	uint16_t flags_of(uint16_t value); // The FL_ condition code a result sets
+
+	/*
+	A single LC-3 machine.
+	Everything an executing program can observe lives in here, so any number of
+	machines can exist side by side in one process.
+	*/
+	class Machine {
+	public:
+		Machine();
+
+		// Hardware data for the VM
+		int running;
+		uint16_t memory[MEMORY_MAX]; // Memory locations store 16-bit values
+		uint16_t reg[R_COUNT];
+
+		/*
+		Condition codes are evaluated lazily: while a core is running, flag_value
+		holds the last result that would have set them and reg[R_COND] is stale.
+		Every core calls load_flags() on entry and store_flags() on exit, so
+		reg[R_COND] is always accurate between calls.
+		*/
+		uint16_t flag_value;
+
+		/*
+		Privilege and interrupts. psr holds the PSR_USER and PSR_PRIORITY bits, the
+		condition codes stay in reg[R_COND]. R6 is the stack pointer of the current
+		mode, the other mode's is kept in saved_ssp or saved_usp. Programs start
+		in user mode at priority 0; there is no memory protection, user mode only
+		decides whether RTI is allowed and which stack an interrupt switches from.
+
+		interrupt_pending is raised whenever an interrupt may have become
+		deliverable (a key latched with KBSR_IE set, KBSR or PSR written, RTI). It
+		is the only thing the cores test, and only at the end of instructions that
+		end a basic block (BR, JMP, JSR, JSRR, TRAP and RTI), so every core takes
+		an interrupt after exactly the same instruction.
+		*/
+		uint16_t psr;
+		uint16_t saved_ssp;
+		uint16_t saved_usp;
+		uint8_t interrupt_pending;
+
+		Engine engine; // Core used by run() and run_slice()
+		uint64_t instructions; // Retired by run_slice() since the machine was created, the clock of replayed input
+
+		// Set from any thread or a signal handler to make run_to_halt() return after the slice it is in, stays set until cleared
+		std::atomic<bool> stop_requested;
+
+		/*
+		With suspend_on_input set, GETC/IN never block: if no key is ready they
+		undo the trap and stop the core with waiting_input set, so the machine can
+		be resumed later. run_for() and run_until() run in this mode.
+		*/
+		bool suspend_on_input;
+		bool waiting_input;
+
+		/*
+		Instructions per iteration of the idle loop the last slice ended in, 0 if
+		it did not end in one. See check_idle(): the rest of the slice was retired
+		at once, and nothing but a key can end the loop. run_to_halt() blocks on
+		the keyboard until there is one, with suspend_on_input set waiting_input
+		is set instead.
+		*/
+		uint8_t idle_period;
+
+		// Pre-decoded copy of memory, only allocated once ENGINE_PREDECODED is used
+		std::unique_ptr<DecodedOp[]> decoded;
+
+		// Native code for hot blocks, only created once ENGINE_JIT is used
+		std::unique_ptr<Jit> jit;
+
+		// The translation of the loaded image built into the program, only looked up once ENGINE_AOT is used
+		std::unique_ptr<Aot> aot;
+
+		// Attach to profile execution, see profile.h
+		std::unique_ptr<Profiler> profiler;
+
+		// Attach to record every instruction, see trace.h
+		std::unique_ptr<Tracer> tracer;
+
+		// Native routines run in place of calls and spare trap vectors, see intrinsics.h. Set through attach_intrinsics().
+		Intrinsics* intrinsics;
+
+		// Counters for monitoring, see metrics.h. Set through attach_metrics(), run_slice() adds to them when it ends.
+		Metrics* metrics;
+		SliceMetrics slice_metrics;
+
+		// Set by a Debugger while it is attached, see debug.h
+		Debugger* debugger;
+
+		// Device registers, see mmio.h
+		IoMap io;
+
+		/*
+		Copy-on-write sharing with forked machines (fork.cpp). A clean page holds
+		exactly what shared_pages has for it (zeros for nullptr). Every write to
+		memory marks its page dirty, and share_pages() turns the dirty pages into
+		new shared pages, so forking only has to copy the pages two machines do
+		not already share. I/O pages are always treated as dirty, device hooks
+		write memory directly.
+		*/
+		uint8_t dirty_pages[PAGE_COUNT];
+		std::shared_ptr<const MemoryPage> shared_pages[PAGE_COUNT];
+
+		// I/O handles
+		InputSource* keyboard; // Source for KBSR/KBDR and the GETC/IN traps, see input.h
+		OutputBuffer output; // Destination for the output traps, flushed on input waits and HALT
+
+		// Reading LC-3 programs into memory
+		void read_image_file(FILE* file);
+		int read_image(const char* image_path); // Memory maps the file, see image.h
+		int read_image_data(const uint8_t* data, size_t size); // The contents of an .obj file, already in memory
+		void load_image(const Image& image); // Copy an image that is already in host order
+
+		// Called once memory[begin, begin + count) holds a newly loaded image
+		void after_load(uint16_t begin, uint32_t count);
+
+		// Refresh the pre-decoded cache (if there is one) for memory[begin, begin + count)
+		void decode_range(uint16_t begin, uint32_t count);
+
+		// Decode the entry at address, fusing it with the next instruction where possible
+		void decode_entry(uint16_t address);
+
+		// Memory reading / writing
+		void mem_write(uint16_t address, uint16_t val);
+		uint16_t mem_read(uint16_t address);
+
+		// Slow paths of mem_read/mem_write for I/O pages
+		uint16_t io_read(uint16_t address);
+		void io_write(uint16_t address, uint16_t val);
+
+		// A write that bypasses the I/O page table, device hooks use it to update memory
+		void ram_write(uint16_t address, uint16_t val);
+
+		// Publish the dirty pages as shared pages, leaving every page clean
+		void share_pages();
+
+		/*
+		Turn this machine into a copy of parent (memory, registers, running state
+		and core). Only pages that differ from what this machine already shares with
+		parent are copied, so re-forking a machine that was forked from the same
+		parent before costs O(pages written since). Device mappings, I/O handles and
+		buffered output are not copied. Shares parent's pages first, so parent must
+		not be running on another thread meanwhile.
+		*/
+		void fork_from(Machine& parent);
+
+		// fork_from() a parent whose pages are shared already, which only reads parent so any number of threads may fork from it at once
+		void fork_from_shared(const Machine& parent);
+
+		/*
+		Deprecated, use ForkPool (fork.h). A new machine forked from this one,
+		reading the same keyboard. It is not copy-on-write: it allocates a whole
+		Machine and copies every non-zero page eagerly, plus the decoded cache
+		on engines that need one. Only re-forking a machine, which ForkPool
+		does, costs O(dirty pages).
+		*/
+		[[deprecated("fork() copies the whole memory, use ForkPool")]]
+		std::unique_ptr<Machine> fork();
+
+		// Use table for calls from now on (nullptr for none), the table must not change while attached
+		void attach_intrinsics(Intrinsics* table);
+
+		// Count into target from now on (nullptr to stop), it must outlive the attachment
+		void attach_metrics(Metrics* target);
+
+		// Add what the slice counted to metrics
+		void publish_metrics(uint32_t executed, uint32_t idle, std::chrono::nanoseconds elapsed);
+
+		// keyboard->wait() for GETC/IN, timed while metrics is attached
+		uint16_t wait_for_key();
+
+		// Run native for the routine at entry, R7 holding the return address
+		void call_native(const Intrinsic& native, uint16_t entry);
+
+		// Attach or detach hooks for a memory mapped register
+		void map_device(uint16_t address, DeviceRegister reg);
+		void unmap_device(uint16_t address);
+
+		// Helper functions for implementing the opcodes
+		void update_flags(uint16_t r);
+		void load_flags(); // flag_value from reg[R_COND]
+		void store_flags(); // reg[R_COND] from flag_value
+
+		// Interrupts, called from inside a core where flag_value holds the condition codes
+		void check_interrupts(); // Service them if interrupt_pending is set
+		void service_interrupts(); // Enter the highest priority interrupt above the current priority, if any
+		void enter_interrupt(uint8_t vector, uint16_t priority); // Also used for exceptions, which keep the priority
+		uint16_t get_psr() const; // psr with the condition codes
+		void set_psr(uint16_t value);
+
+		// Called by the cores after a branch one or two words back was taken, stops the core if it is an idle loop
+		void check_idle(uint16_t instr);
+
+		// Implementations of standard opcodes
+		void op_add(uint16_t instr);
+		void op_and(uint16_t instr);
+		void op_not(uint16_t instr);
+		void op_br(uint16_t instr);
+		void op_jmp(uint16_t instr);
+		void op_jsr(uint16_t instr);
+		void op_ld(uint16_t instr);
+		void op_ldi(uint16_t instr);
+		void op_ldr(uint16_t instr);
+		void op_lea(uint16_t instr);
+		void op_st(uint16_t instr);
+		void op_sti(uint16_t instr);
+		void op_str(uint16_t instr);
+		void op_trap(uint16_t instr);
+		void op_res(uint16_t instr);
+		void op_rti(uint16_t instr);
+
+		/*
+		The same opcodes specialised on their mode bits: the immediate flag (bit 5)
+		of ADD and AND, the n, z and p bits of BR and bit 11 of JSR, which picks
+		between JSR and JSRR. The plain handlers above test those bits at run time
+		and call these; the threaded core decodes them into its dispatch table.
+		*/
+		template <bool Imm> void op_add(uint16_t instr);
+		template <bool Imm> void op_and(uint16_t instr);
+		template <uint16_t NZP> void op_br(uint16_t instr);
+		template <bool Offset> void op_jsr(uint16_t instr);
+		void take_branch(uint16_t instr); // PC += PCoffset9 for a BR whose condition holds
+
+		// Read an instruction and execute relevant opcode
+		void switch_op(uint16_t instr);
+
+		// Set up the registers to start the loaded image from PC_START
+		void reset();
+
+		// Execute at most count instructions, returns how many were executed. Ends early where a replayed key is due.
+		uint32_t run_slice(uint32_t count);
+
+		// The individual cores behind run_slice()
+		uint32_t run_switch(uint32_t count);
+		template <bool Profile, bool Trace> uint32_t switch_loop(uint32_t count);
+		uint32_t run_threaded(uint32_t count);
+		uint32_t run_predecoded(uint32_t count);
+		uint32_t run_jit(uint32_t count);
+		uint32_t run_aot(uint32_t count);
+
+		// Pre-decoded core that also stops after the first instruction ending a basic block, without syncing flags
+		uint32_t run_predecoded_block(uint32_t count);
+		template <bool BlockMode> uint32_t predecoded_loop(uint32_t count);
+
+		// Run the VM
+		void run();
+
+		// run() without the reset, carries on from the current state until the program halts or stop_requested is set
+		void run_to_halt();
+
+		// Run until halted, n more instructions retired or the program waits for input
+		StopReason run_for(uint64_t n);
+
+		// Run until halted, the deadline or the program waits for input, the clock is read between slices
+		StopReason run_until(std::chrono::steady_clock::time_point deadline);
+
+		// Undo a GETC/IN that found no key, returns false if it should go ahead
+		bool suspend_for_input(uint16_t old_r7);
+	};
 }
\ No newline at end of file
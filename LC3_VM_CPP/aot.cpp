@@ -0,0 +1,398 @@
+#include "aot.h"
+#include "LC3VM.h"
+#include "ops.h"
+
+#include <string.h>
+
+using namespace LC3VM;
+
+namespace {
+	std::vector<const AotProgram*>& registry() {
+		// Constructed on first use, generated files register while static objects are constructed
+		static std::vector<const AotProgram*> programs;
+		return programs;
+	}
+
+	const uint16_t TRAP_VECTOR_HALT = 0x25;
+
+	// Instructions after which control does not simply fall through to the next word
+	bool ends_block(uint16_t instr) {
+		switch (instr >> 12) {
+		case OP_BR:
+		case OP_JMP:
+		case OP_JSR:
+		case OP_TRAP:
+		case OP_RTI:
+		case OP_RES:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	void append(std::string& out, const char* format, unsigned a = 0, unsigned b = 0, unsigned c = 0) {
+		char line[160];
+		snprintf(line, sizeof(line), format, a, b, c);
+		out += line;
+	}
+
+	class Translator {
+	public:
+		Translator(const Image& image)
+			: begin(image.origin), end((uint32_t)image.origin + (uint32_t)image.words.size()), image(image),
+			reached(MEMORY_MAX), leader(MEMORY_MAX), block_of(MEMORY_MAX) {
+			if (end > MMIO_BASE) {
+				end = MMIO_BASE;
+			}
+		}
+
+		bool inside(uint32_t address) const { return address >= begin && address < end; }
+		uint16_t word(uint16_t address) const { return image.words[address - begin]; }
+
+		// Everything reachable from entry by the static control flow, marking where blocks start
+		void follow(uint16_t entry) {
+			std::vector<uint16_t> work;
+			work.push_back(entry);
+			leader[entry] = 1;
+			while (!work.empty()) {
+				uint16_t address = work.back();
+				work.pop_back();
+				while (inside(address) && !reached[address]) {
+					reached[address] = 1;
+					uint16_t instr = word(address);
+					uint16_t next = (uint16_t)(address + 1);
+					uint16_t op = instr >> 12;
+					bool falls_through = true;
+					if (op == OP_BR) {
+						uint16_t nzp = (instr >> 9) & 0x7;
+						if (nzp) {
+							branch_to(work, (uint16_t)(next + sign_extend(instr & 0x1FF, 9)));
+						}
+						falls_through = nzp != 0x7;
+					}
+					else if (op == OP_JSR && ((instr >> 11) & 1)) {
+						branch_to(work, (uint16_t)(next + sign_extend(instr & 0x7FF, 11)));
+					}
+					else if (op == OP_JMP || op == OP_RTI || op == OP_RES || (op == OP_TRAP && (instr & 0xFF) == TRAP_VECTOR_HALT)) {
+						falls_through = false;
+					}
+					if (!falls_through) {
+						break;
+					}
+					if (ends_block(instr)) {
+						leader[next] = 1;
+					}
+					address = next;
+				}
+			}
+		}
+
+		// Blocks run from a leader to the first instruction ending a block, or up to the next leader
+		void split() {
+			for (uint32_t address = begin; address < end; address++) {
+				if (!reached[address]) {
+					continue;
+				}
+				bool open = !blocks.empty() && blocks.back().start + blocks.back().length == address
+					&& !ends_block(word((uint16_t)(address - 1)));
+				if (!open || leader[address]) {
+					blocks.push_back(AotBlock{ (uint16_t)address, 0 });
+				}
+				blocks.back().length++;
+				block_of[address] = (uint32_t)blocks.size();
+			}
+		}
+
+		bool is_start(uint16_t address) const {
+			return block_of[address] && blocks[block_of[address] - 1].start == address;
+		}
+
+		// Continue at address, which reg[R_PC] already holds
+		std::string go(uint16_t address) const {
+			char label[32];
+			snprintf(label, sizeof(label), "goto b_%04X;", address);
+			return is_start(address) ? std::string(label) : std::string("goto dispatch;");
+		}
+
+		// After an instruction that changed reg[R_PC], possibly to an interrupt handler
+		void route(std::string& out, uint16_t address) const {
+			if (is_start(address)) {
+				append(out, "\tif (vm.reg[R_PC] == 0x%04X) { goto b_%04X; }\n", address, address);
+			}
+		}
+
+		void emit_block(std::string& out, uint32_t index) const {
+			const AotBlock& block = blocks[index];
+			append(out, "b_%04X: // x%04X-", block.start, block.start);
+			append(out, "x%04X\n", block.start + block.length - 1);
+			append(out, "\tif (stale[%u] || count - executed < %u) { ", index, block.length);
+			append(out, "vm.reg[R_PC] = 0x%04X; goto leave; }\n", block.start);
+			append(out, "\texecuted += %u;\n", block.length);
+
+			for (uint32_t i = 0; i < block.length; i++) {
+				uint16_t address = (uint16_t)(block.start + i);
+				uint16_t next = (uint16_t)(address + 1);
+				uint16_t instr = word(address);
+				uint32_t after = block.length - 1 - i;
+				switch (instr >> 12) {
+				case OP_ADD:
+					append(out, ((instr >> 5) & 1) ? "\tvm.op_add<true>(0x%04X);\n" : "\tvm.op_add<false>(0x%04X);\n", instr);
+					break;
+				case OP_AND:
+					append(out, ((instr >> 5) & 1) ? "\tvm.op_and<true>(0x%04X);\n" : "\tvm.op_and<false>(0x%04X);\n", instr);
+					break;
+				case OP_NOT:
+					append(out, "\tvm.op_not(0x%04X);\n", instr);
+					break;
+				case OP_LDR:
+					append(out, "\tvm.op_ldr(0x%04X);\n", instr);
+					break;
+				case OP_LD:
+				case OP_LDI:
+				case OP_LEA:
+					append(out, "\tvm.reg[R_PC] = 0x%04X;\n", next);
+					append(out, (instr >> 12) == OP_LD ? "\tvm.op_ld(0x%04X);\n" : (instr >> 12) == OP_LDI ? "\tvm.op_ldi(0x%04X);\n" : "\tvm.op_lea(0x%04X);\n", instr);
+					break;
+				case OP_ST:
+				case OP_STI:
+				case OP_STR:
+					append(out, "\tvm.reg[R_PC] = 0x%04X;\n", next);
+					append(out, (instr >> 12) == OP_ST ? "\tvm.op_st(0x%04X);\n" : (instr >> 12) == OP_STI ? "\tvm.op_sti(0x%04X);\n" : "\tvm.op_str(0x%04X);\n", instr);
+					// The store may have changed code of this block or any other
+					append(out, "\tif (aot.modified) { executed -= %u; goto leave; }\n", after);
+					break;
+				case OP_BR:
+				{
+					uint16_t nzp = (instr >> 9) & 0x7;
+					uint16_t target = (uint16_t)(next + sign_extend(instr & 0x1FF, 9));
+					append(out, "\tvm.reg[R_PC] = 0x%04X;\n", next);
+					append(out, "\tvm.op_br<%u>(0x%04X);\n", nzp, instr);
+					// op_br stops the machine in an idle loop
+					if (nzp && (uint16_t)(target - next + 2) < 2) {
+						out += "\tif (!vm.running) { goto leave; }\n";
+					}
+					if (nzp) {
+						route(out, target);
+					}
+					if (nzp != 0x7) {
+						route(out, next);
+					}
+					out += "\tgoto dispatch;\n";
+					break;
+				}
+				case OP_JSR:
+					append(out, "\tvm.reg[R_PC] = 0x%04X;\n", next);
+					append(out, ((instr >> 11) & 1) ? "\tvm.op_jsr<true>(0x%04X);\n" : "\tvm.op_jsr<false>(0x%04X);\n", instr);
+					// A native routine checked with --verify-native may halt
+					out += "\tif (!vm.running) { goto leave; }\n";
+					if ((instr >> 11) & 1) {
+						route(out, (uint16_t)(next + sign_extend(instr & 0x7FF, 11)));
+					}
+					out += "\tgoto dispatch;\n";
+					break;
+				case OP_JMP:
+					append(out, "\tvm.op_jmp(0x%04X);\n", instr);
+					out += "\tgoto dispatch;\n";
+					break;
+				case OP_TRAP:
+					append(out, "\tvm.reg[R_PC] = 0x%04X;\n", next);
+					append(out, "\tvm.op_trap(0x%04X);\n", instr);
+					out += "\tif (!vm.running) { goto leave; }\n";
+					route(out, next);
+					out += "\tgoto dispatch;\n";
+					break;
+				case OP_RTI:
+				case OP_RES:
+					append(out, "\tvm.reg[R_PC] = 0x%04X;\n", next);
+					append(out, (instr >> 12) == OP_RTI ? "\tvm.op_rti(0x%04X);\n" : "\tvm.op_res(0x%04X);\n", instr);
+					out += "\tgoto dispatch;\n";
+					break;
+				}
+			}
+			uint16_t last = word((uint16_t)(block.start + block.length - 1));
+			if (!ends_block(last)) {
+				uint16_t next = (uint16_t)(block.start + block.length);
+				append(out, "\tvm.reg[R_PC] = 0x%04X;\n", next);
+				out += "\t" + go(next) + "\n";
+			}
+		}
+
+		std::string emit(const char* name) const {
+			std::string out;
+			out += "// Translated from ";
+			out += name;
+			out += " by lc3 --aot, do not edit\n";
+			out += "#include \"LC3VM.h\"\n#include \"ops.h\"\n\nusing namespace LC3VM;\n\nnamespace {\n";
+
+			out += "\tconst AotBlock BLOCKS[] = {\n";
+			for (const AotBlock& block : blocks) {
+				append(out, "\t\t{ 0x%04X, %u },\n", block.start, block.length);
+			}
+			out += "\t};\n\n\tconst uint16_t CODE[] = {";
+			uint32_t n = 0;
+			for (const AotBlock& block : blocks) {
+				for (uint32_t i = 0; i < block.length; i++, n++) {
+					out += n % 12 ? " " : "\n\t\t";
+					append(out, "0x%04X,", word((uint16_t)(block.start + i)));
+				}
+			}
+			out += "\n\t};\n\n";
+
+			out += "\tuint32_t run(Machine& vm, Aot& aot, uint32_t count) {\n";
+			// The stale flags are never reallocated while a machine has its Aot
+			out += "\t\tconst uint8_t* stale = aot.stale.data();\n\t\tuint32_t executed = 0;\n\t\tgoto dispatch;\n\n";
+			std::string body;
+			for (uint32_t i = 0; i < blocks.size(); i++) {
+				emit_block(body, i);
+				body += "\n";
+			}
+			body += "dispatch:\n\tswitch (vm.reg[R_PC]) {\n";
+			for (const AotBlock& block : blocks) {
+				append(body, "\tcase 0x%04X: goto b_%04X;\n", block.start, block.start);
+			}
+			body += "\tdefault: goto leave;\n\t}\n\nleave:\n\treturn executed;\n";
+			// Into the namespace, labels stay one level out of the statements
+			size_t pos = 0;
+			while (pos < body.size()) {
+				size_t eol = body.find('\n', pos);
+				if (eol > pos) {
+					out += "\t" + body.substr(pos, eol - pos);
+				}
+				out += "\n";
+				pos = eol + 1;
+			}
+			out += "\t}\n\n";
+
+			out += "\tconst AotProgram PROGRAM = { \"";
+			out += name;
+			append(out, "\", BLOCKS, %u, CODE, run };\n", (unsigned)blocks.size());
+			out += "\tconst bool registered = register_aot_program(PROGRAM);\n}\n";
+			return out;
+		}
+
+		std::vector<AotBlock> blocks;
+
+	private:
+		uint32_t begin;
+		uint32_t end;
+		const Image& image;
+		std::vector<uint8_t> reached;
+		std::vector<uint8_t> leader;
+		std::vector<uint32_t> block_of; // Block index + 1
+
+		void branch_to(std::vector<uint16_t>& work, uint16_t target) {
+			leader[target] = 1;
+			work.push_back(target);
+		}
+	};
+}
+
+bool LC3VM::register_aot_program(const AotProgram& program) {
+	registry().push_back(&program);
+	return true;
+}
+
+bool LC3VM::translate_image(const Image& image, const char* name, std::string& source, std::string& error) {
+	Translator translator(image);
+	uint16_t entry = translator.inside(PC_START) ? (uint16_t)PC_START : image.origin;
+	if (!translator.inside(entry)) {
+		error = "the image holds no code";
+		return false;
+	}
+	translator.follow(entry);
+	translator.split();
+
+	// The name ends up in a string literal and a comment
+	std::string safe;
+	for (const char* c = name; *c; c++) {
+		bool plain = (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') || strchr("._-/", *c);
+		safe += plain ? *c : '_';
+	}
+	source = translator.emit(safe.c_str());
+	return true;
+}
+
+Aot::Aot(Machine& vm) : modified(0), vm(vm), selected(nullptr), covered(MEMORY_MAX), starts(MEMORY_MAX) {
+	// Stores only reach invalidate() through ram_write() while the pre-decoded cache exists
+	if (!vm.decoded) {
+		vm.decode_range(0, 0);
+	}
+
+	// The translation the most blocks of which are in memory right now
+	uint32_t best = 0;
+	for (const AotProgram* program : registry()) {
+		uint32_t matching = 0;
+		const uint16_t* code = program->code;
+		for (uint32_t b = 0; b < program->block_count; b++) {
+			const AotBlock& block = program->blocks[b];
+			matching += memcmp(vm.memory + block.start, code, block.length * sizeof(uint16_t)) == 0;
+			code += block.length;
+		}
+		if (matching > best) {
+			best = matching;
+			selected = program;
+		}
+	}
+	if (!selected) {
+		return;
+	}
+
+	uint32_t offset = 0;
+	for (uint32_t b = 0; b < selected->block_count; b++) {
+		const AotBlock& block = selected->blocks[b];
+		offsets.push_back(offset);
+		offset += block.length;
+		starts[block.start] = b + 1;
+		for (uint32_t i = 0; i < block.length; i++) {
+			covered[block.start + i] = b + 1;
+		}
+	}
+	stale.resize(selected->block_count);
+	flush();
+}
+
+bool Aot::matches(uint32_t block) const {
+	const AotBlock& b = selected->blocks[block];
+	return memcmp(vm.memory + b.start, selected->code + offsets[block], b.length * sizeof(uint16_t)) == 0;
+}
+
+void Aot::invalidate(uint16_t address) {
+	uint32_t block = covered[address] - 1;
+	// Writing back the word that was there, or patching code back, makes the block usable again
+	uint8_t was_stale = stale[block];
+	stale[block] = !matches(block);
+	if (stale[block] && !was_stale) {
+		modified = 1;
+	}
+}
+
+void Aot::flush() {
+	for (uint32_t b = 0; b < stale.size(); b++) {
+		stale[b] = !matches(b);
+	}
+	modified = 1;
+}
+
+uint32_t Aot::run(uint32_t count) {
+	if (!selected) {
+		return vm.run_predecoded(count);
+	}
+
+	uint32_t executed = 0;
+	vm.load_flags();
+	while (vm.running && executed < count) {
+		uint32_t block = starts[vm.reg[R_PC]];
+		if (block && !stale[block - 1]) {
+			modified = 0;
+			uint32_t ran = selected->run(vm, *this, count - executed);
+			executed += ran;
+			if (ran) {
+				continue;
+			}
+			// Not enough budget left for the whole block
+		}
+		executed += vm.run_predecoded_block(count - executed);
+	}
+	vm.store_flags();
+	return executed;
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+/*
+Ahead-of-time translation of images to C++ (ENGINE_AOT).
+
+translate_image() follows the control flow of an image from PC_START, the
+targets of BR and JSR and the return address of every call, and writes a C++
+source file with one label per basic block. Every instruction in it is the
+op_* handler from ops.h applied to a constant word, so the host compiler
+folds the decoding away, and blocks jump straight to the blocks they branch
+to. `lc3 --aot image.obj -o image_aot.cpp` and lc3vm_add_aot() in CMake do
+this at build time.
+
+A program built with the generated file registers it before main() runs. A
+machine on ENGINE_AOT picks the registered translation that matches the most
+of its memory and runs blocks from it while they still hold the words they
+were translated from. Everything else is interpreted on the pre-decoded core
+one basic block at a time: JMP/RET/JSRR targets and interrupt handlers that
+were never found statically, and blocks that have been stored into, which
+stop matching at the store (the generated code leaves right after any store
+that did that). Nothing is generated at run time, so no memory is ever both
+writable and executable. Without a matching translation ENGINE_AOT behaves
+like ENGINE_PREDECODED.
+*/
+
+namespace LC3VM {
+	class Machine;
+	class Image;
+	class Aot;
+
+	struct AotBlock {
+		uint16_t start;
+		uint16_t length;
+	};
+
+	// A translated image, as registered by a generated file
+	struct AotProgram {
+		const char* name;
+		const AotBlock* blocks; // Disjoint, in address order
+		uint32_t block_count;
+		const uint16_t* code; // The words of every block, concatenated in block order
+		// Run blocks from the one at reg[R_PC] until count instructions ran or control leaves the translation
+		uint32_t (*run)(Machine& vm, Aot& aot, uint32_t count);
+	};
+
+	// Called by generated files while static objects are constructed, the program must outlive every machine
+	bool register_aot_program(const AotProgram& program);
+
+	// Write C++ source for image to source, registered as name. False with error set if nothing is reachable.
+	bool translate_image(const Image& image, const char* name, std::string& source, std::string& error);
+
+	class Aot {
+	public:
+		explicit Aot(Machine& vm);
+
+		// The translation in use, nullptr if none matches the memory of the machine
+		const AotProgram* program() const { return selected; }
+
+		// Execute at most count instructions, translated blocks where they match and interpreted blocks elsewhere
+		uint32_t run(uint32_t count);
+
+		// Look at the block covering address again after a store to it
+		bool covers(uint16_t address) const { return covered[address] != 0; }
+		void invalidate(uint16_t address);
+
+		// Compare every block with memory again
+		void flush();
+
+		// Used by the generated code
+		std::vector<uint8_t> stale; // Per block, it no longer holds the words it was translated from
+		uint8_t modified; // A block went stale since the generated code was entered
+
+	private:
+		Machine& vm;
+		const AotProgram* selected;
+		std::vector<uint32_t> offsets; // Of each block in program()->code
+		std::vector<uint32_t> covered; // Block index + 1 for every address inside a block, 0 elsewhere
+		std::vector<uint32_t> starts; // Block index + 1 at the first address of every block, 0 elsewhere
+
+		bool matches(uint32_t block) const;
+	};
+}
@@ -0,0 +1,219 @@
+#include "batch.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+using namespace LC3VM;
+
+namespace {
+	// A started job that is waiting for its next slice
+	struct Task {
+		size_t job;
+		std::unique_ptr<Machine> vm;
+		std::unique_ptr<BufferInput> keys;
+	};
+
+	struct Worker {
+		std::mutex lock;
+		std::deque<std::unique_ptr<Task>> tasks;
+	};
+
+	class Pool {
+	public:
+		Pool(std::vector<BatchJob>& jobs, const BatchOptions& options, unsigned threads)
+			: jobs(jobs), options(options), workers(threads), next_job(0), remaining(jobs.size()), surplus(0) {}
+
+		void run() {
+			std::vector<std::thread> threads;
+			for (size_t i = 1; i < workers.size(); i++) {
+				threads.emplace_back(&Pool::work, this, i);
+			}
+			work(0);
+			for (std::thread& t : threads) {
+				t.join();
+			}
+		}
+
+	private:
+		std::vector<BatchJob>& jobs;
+		const BatchOptions& options;
+		std::vector<Worker> workers;
+		std::atomic<size_t> next_job; // First job no worker has started yet
+		std::atomic<size_t> remaining; // Jobs not finished yet
+		ImageCache images; // Jobs running the same program share one converted copy
+		// Workers with nothing to run or steal sleep on idle until surplus changes or the last job finishes
+		std::mutex idle_lock;
+		std::condition_variable idle;
+		uint64_t surplus; // Bumped whenever a task waits in a rotation behind another one
+
+		void work(size_t self) {
+			Worker& me = workers[self];
+			Metrics* shard = options.metrics ? &options.metrics->add_shard() : nullptr;
+			uint64_t seen = 0; // surplus before the last look for work
+			for (;;) {
+				std::unique_ptr<Task> task;
+
+				// Start a new job while this worker has room in its rotation
+				size_t active;
+				{
+					std::lock_guard<std::mutex> guard(me.lock);
+					active = me.tasks.size();
+				}
+				if (active < options.active_per_worker) {
+					size_t j = next_job.fetch_add(1);
+					if (j < jobs.size()) {
+						task = start(j);
+						if (!task) {
+							continue;
+						}
+					}
+				}
+
+				if (!task) {
+					std::lock_guard<std::mutex> guard(me.lock);
+					if (!me.tasks.empty()) {
+						task = std::move(me.tasks.front());
+						me.tasks.pop_front();
+					}
+				}
+				if (!task) {
+					task = steal(self);
+				}
+				if (!task) {
+					// Every job has started, so only a task pushed behind another one can give this worker work
+					std::unique_lock<std::mutex> guard(idle_lock);
+					idle.wait(guard, [&] { return remaining.load() == 0 || surplus != seen; });
+					if (remaining.load() == 0) {
+						return;
+					}
+					seen = surplus;
+					continue;
+				}
+
+				if (run_slice(*task, shard)) {
+					finish(*task);
+				}
+				else {
+					// Go to the back of the rotation so the other jobs get a turn
+					size_t queued;
+					{
+						std::lock_guard<std::mutex> guard(me.lock);
+						me.tasks.push_back(std::move(task));
+						queued = me.tasks.size();
+					}
+					// A lone task stays with its worker, stealing it would only move it back and forth
+					if (queued > 1) {
+						std::lock_guard<std::mutex> guard(idle_lock);
+						surplus++;
+						idle.notify_one();
+					}
+				}
+			}
+		}
+
+		void job_done() {
+			if (remaining.fetch_sub(1) == 1) {
+				std::lock_guard<std::mutex> guard(idle_lock);
+				idle.notify_all();
+			}
+		}
+
+		std::unique_ptr<Task> steal(size_t self) {
+			for (size_t i = 1; i < workers.size(); i++) {
+				Worker& victim = workers[(self + i) % workers.size()];
+				std::lock_guard<std::mutex> guard(victim.lock);
+				if (!victim.tasks.empty()) {
+					std::unique_ptr<Task> task = std::move(victim.tasks.back());
+					victim.tasks.pop_back();
+					return task;
+				}
+			}
+			return nullptr;
+		}
+
+		// Returns nullptr if the job failed to start, in which case it is already finished
+		std::unique_ptr<Task> start(size_t j) {
+			BatchJob& job = jobs[j];
+			std::unique_ptr<Task> task(new Task());
+			task->job = j;
+			task->vm.reset(new Machine());
+			task->vm->engine = options.engine;
+			task->vm->output.set_sink(nullptr, false); // Keep the output in memory until the job finishes
+
+			bool loaded = true;
+			for (size_t i = 0; loaded && i < job.images.size(); i++) {
+				std::shared_ptr<const Image> image = images.get(job.images[i]);
+				if (image) {
+					task->vm->load_image(*image);
+				}
+				loaded = image != nullptr;
+			}
+			if (!loaded) {
+				job.status = BATCH_LOAD_FAILED;
+				job_done();
+				return nullptr;
+			}
+
+			// The whole script is available up front, so the machine never waits for input
+			task->keys.reset(new BufferInput(job.input));
+
+			task->vm->keyboard = task->keys.get();
+			task->vm->reset();
+			return task;
+		}
+
+		// Returns true once the job is finished
+		bool run_slice(Task& task, Metrics* shard) {
+			BatchJob& job = jobs[task.job];
+			// Tasks move between workers, the counts go to the shard of whichever runs the slice
+			if (task.vm->metrics != shard) {
+				task.vm->attach_metrics(shard);
+			}
+			uint32_t budget = options.slice;
+			if (options.max_instructions && options.max_instructions - job.instructions < budget) {
+				budget = (uint32_t)(options.max_instructions - job.instructions);
+			}
+
+			job.instructions += task.vm->run_slice(budget);
+
+			if (!task.vm->running) {
+				job.status = BATCH_HALTED;
+				return true;
+			}
+			if (options.max_instructions && job.instructions >= options.max_instructions) {
+				job.status = BATCH_BUDGET_EXHAUSTED;
+				return true;
+			}
+			return false;
+		}
+
+		void finish(Task& task) {
+			BatchJob& job = jobs[task.job];
+			job.output = task.vm->output.take_captured();
+			job_done();
+		}
+	};
+}
+
+void LC3VM::run_batch(std::vector<BatchJob>& jobs, const BatchOptions& options) {
+	unsigned threads = options.threads ? options.threads : std::thread::hardware_concurrency();
+	if (threads == 0) {
+		threads = 1;
+	}
+	Pool pool(jobs, options, threads);
+	pool.run();
+}
+
+const char* LC3VM::batch_status_name(BatchStatus status) {
+	switch (status) {
+	case BATCH_PENDING: return "pending";
+	case BATCH_HALTED: return "halted";
+	case BATCH_BUDGET_EXHAUSTED: return "budget-exhausted";
+	case BATCH_LOAD_FAILED: return "load-failed";
+	}
+	return "unknown";
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "LC3VM.h"
+
+/*
+Batch execution of many LC-3 programs in one process.
+
+Every job gets its own Machine. Jobs are spread over a pool of worker threads,
+each worker runs a job for a slice of instructions and then moves on to the next
+one, and idle workers steal jobs from busy ones. Once every job has started, a
+worker with nothing to run or steal sleeps until another worker has a job
+waiting in its rotation or the batch is done.
+*/
+
+namespace LC3VM {
+	// Final state of a batch job
+	enum BatchStatus {
+		BATCH_PENDING = 0, // Not finished yet
+		BATCH_HALTED, // The program executed TRAP_HALT
+		BATCH_BUDGET_EXHAUSTED, // The program hit max_instructions
+		BATCH_LOAD_FAILED, // One of the images could not be read
+	};
+
+	struct BatchJob {
+		// Inputs
+		std::vector<std::string> images; // Loaded in order, like the command line
+		std::string input; // Keys fed to GETC/IN/KBSR, input is closed once they run out
+
+		// Results
+		BatchStatus status = BATCH_PENDING;
+		std::string output;
+		uint64_t instructions = 0;
+	};
+
+	struct BatchOptions {
+		unsigned threads = 0; // 0 means one per hardware thread
+		uint32_t slice = 100000; // Instructions a worker runs before yielding
+		uint64_t max_instructions = 0; // Per job, 0 means no limit
+		unsigned active_per_worker = 4; // Started jobs a worker keeps in rotation
+		Engine engine = DEFAULT_ENGINE; // Interpreter core every job runs on
+		MetricsShards* metrics = nullptr; // Every worker adds a shard and counts the slices it runs into it
+	};
+
+	// Run every job to completion, filling in the result fields
+	void run_batch(std::vector<BatchJob>& jobs, const BatchOptions& options);
+
+	const char* batch_status_name(BatchStatus status);
+}
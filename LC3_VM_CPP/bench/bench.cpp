@@ -0,0 +1,244 @@
+#ifdef _MSC_VER
+#pragma warning(disable:4996)
+#endif
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../LC3VM.h"
+
+/*
+Benchmark of the interpreter cores.
+
+Every kernel runs headless with fixed input, on every engine, several times,
+in a fresh machine each run so that JIT warm-up is part of what is measured.
+The engines must agree on the instructions executed and the final registers,
+a disagreement is reported and makes the benchmark exit with status 1.
+
+--save writes the mean time of every kernel and engine to a file, and
+--compare reads such a file back and reports the speedup of this build over
+the one that saved it, which is how the PGO pipeline (cmake/pgo.cmake)
+measures the optimised build against the plain one.
+
+bench [--runs N] [--engine NAME] [--kernel NAME] [--dir obj_files] [--save PATH] [--compare PATH]
+
+The kernels are read from the obj_files directory of the source tree the
+benchmark was built from (LC3VM_OBJ_DIR), --dir reads them from elsewhere.
+*/
+
+// Set by CMakeLists.txt, a build without it looks in the working directory
+#if !defined(LC3VM_OBJ_DIR)
+#define LC3VM_OBJ_DIR "obj_files"
+#endif
+
+using namespace LC3VM;
+
+namespace {
+	struct Kernel {
+		const char* name;
+		const char* image; // Relative to the obj_files directory
+		std::string input; // Keys fed to the program, input is closed after them
+		uint64_t max_instructions; // For kernels that would otherwise wait for input forever
+	};
+
+	struct Result {
+		uint64_t instructions;
+		uint16_t reg[R_COUNT];
+		double seconds;
+	};
+
+	void run_once(const Kernel& kernel, const Image& image, Engine engine, Result& result) {
+		std::unique_ptr<Machine> vm(new Machine());
+		BufferInput keys(kernel.input);
+		vm->keyboard = &keys;
+		vm->output.set_sink(nullptr, false);
+		vm->engine = engine;
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		vm->load_image(image);
+		vm->reset();
+		uint64_t executed = 0;
+		while (vm->running && (!kernel.max_instructions || executed < kernel.max_instructions)) {
+			uint64_t left = kernel.max_instructions ? kernel.max_instructions - executed : UINT32_MAX;
+			executed += vm->run_slice(left < (1u << 24) ? (uint32_t)left : (1u << 24));
+		}
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		result.instructions = executed;
+		memcpy(result.reg, vm->reg, sizeof(result.reg));
+		result.seconds = elapsed.count();
+	}
+
+	std::string script_2048() {
+		// Plain (non-ANSI) board, then the same cycle of moves until the game is lost or the budget runs out
+		std::string keys = "n";
+		for (int i = 0; i < 2000; i++) {
+			keys += "wasd"[i % 4];
+			keys += "dswa"[(i / 7) % 4];
+		}
+		return keys + "n";
+	}
+
+	// Mean seconds per "kernel engine" from a file written by --save
+	bool read_baseline(const char* path, std::map<std::string, double>& seconds) {
+		FILE* f = fopen(path, "r");
+		if (!f) {
+			return false;
+		}
+		char kernel[64], engine[64];
+		double mean;
+		while (fscanf(f, "%63s %63s %lf", kernel, engine, &mean) == 3) {
+			seconds[std::string(kernel) + " " + engine] = mean;
+		}
+		fclose(f);
+		return true;
+	}
+}
+
+int main(int argc, const char* argv[]) {
+	int runs = 5;
+	std::string dir = LC3VM_OBJ_DIR;
+	const char* only_kernel = nullptr;
+	const char* save_path = nullptr;
+	const char* compare_path = nullptr;
+	bool engines[ENGINE_COUNT] = {};
+	bool any_engine = false;
+
+	for (int j = 1; j < argc; j++) {
+		std::string arg = argv[j];
+		if (arg == "--runs" && j + 1 < argc) {
+			runs = atoi(argv[++j]);
+		}
+		else if (arg == "--dir" && j + 1 < argc) {
+			dir = argv[++j];
+		}
+		else if (arg == "--kernel" && j + 1 < argc) {
+			only_kernel = argv[++j];
+		}
+		else if (arg == "--engine" && j + 1 < argc) {
+			Engine e;
+			if (!engine_from_name(argv[++j], e)) {
+				printf("unknown engine: %s\n", argv[j]);
+				return 2;
+			}
+			engines[e] = true;
+			any_engine = true;
+		}
+		else if (arg == "--save" && j + 1 < argc) {
+			save_path = argv[++j];
+		}
+		else if (arg == "--compare" && j + 1 < argc) {
+			compare_path = argv[++j];
+		}
+		else {
+			printf("bench [--runs N] [--engine NAME] [--kernel NAME] [--dir obj_files] [--save PATH] [--compare PATH]\n");
+			return 2;
+		}
+	}
+	if (runs < 1) {
+		runs = 1;
+	}
+	for (int e = 0; e < ENGINE_COUNT && !any_engine; e++) {
+		engines[e] = true;
+	}
+
+	const Kernel kernels[] = {
+		{ "loops", "bench/loops.obj", "", 0 },
+		{ "memcpy", "bench/memcpy.obj", "", 0 },
+		{ "multiply", "bench/multiply.obj", "", 0 },
+		{ "sort", "bench/sort.obj", "", 0 },
+		{ "2048", "2048.obj", script_2048(), 20000000 },
+	};
+
+	std::map<std::string, double> baseline;
+	if (compare_path && !read_baseline(compare_path, baseline)) {
+		printf("failed to read %s\n", compare_path);
+		return 2;
+	}
+	FILE* save = nullptr;
+	if (save_path && !(save = fopen(save_path, "w"))) {
+		printf("failed to write %s\n", save_path);
+		return 2;
+	}
+
+	int failed = 0;
+	double log_speedup = 0;
+	int compared = 0;
+	printf("%-9s %-11s %13s %10s %9s %9s %8s%s\n", "kernel", "engine", "instructions", "mean ms", "MIPS", "ns/instr", "stddev%",
+		compare_path ? "  speedup" : "");
+	for (const Kernel& kernel : kernels) {
+		if (only_kernel && kernel.name != std::string(only_kernel)) {
+			continue;
+		}
+		std::string path = dir + "/" + kernel.image;
+		std::shared_ptr<const Image> image = Image::load(path.c_str());
+		if (!image) {
+			printf("%-9s failed to load %s\n", kernel.name, path.c_str());
+			failed++;
+			continue;
+		}
+
+		bool have_reference = false;
+		Result reference = {};
+		for (int e = 0; e < ENGINE_COUNT; e++) {
+			if (!engines[e]) {
+				continue;
+			}
+			std::vector<double> times;
+			Result result = {};
+			for (int r = 0; r < runs; r++) {
+				run_once(kernel, *image, (Engine)e, result);
+				times.push_back(result.seconds);
+			}
+
+			double mean = 0;
+			for (double t : times) {
+				mean += t;
+			}
+			mean /= times.size();
+			double variance = 0;
+			for (double t : times) {
+				variance += (t - mean) * (t - mean);
+			}
+			variance /= times.size();
+			double mips = result.instructions / mean / 1e6;
+			double ns = mean * 1e9 / (double)result.instructions;
+			printf("%-9s %-11s %13llu %10.2f %9.1f %9.3f %8.2f", kernel.name, engine_name((Engine)e),
+				(unsigned long long)result.instructions, mean * 1e3, mips, ns, 100.0 * sqrt(variance) / mean);
+			std::string key = std::string(kernel.name) + " " + engine_name((Engine)e);
+			auto base = baseline.find(key);
+			if (base != baseline.end()) {
+				printf("  %6.3fx", base->second / mean);
+				log_speedup += log(base->second / mean);
+				compared++;
+			}
+			printf("\n");
+			if (save) {
+				fprintf(save, "%s %.9f\n", key.c_str(), mean);
+			}
+
+			if (!have_reference) {
+				reference = result;
+				have_reference = true;
+			}
+			else if (result.instructions != reference.instructions || memcmp(result.reg, reference.reg, sizeof(result.reg)) != 0) {
+				printf("%-9s %-11s MISMATCH with the first engine measured\n", kernel.name, engine_name((Engine)e));
+				failed++;
+			}
+		}
+	}
+	if (save) {
+		fclose(save);
+	}
+	if (compared) {
+		printf("geometric mean speedup over %s: %.3fx\n", compare_path, exp(log_speedup / compared));
+	}
+	return failed ? 1 : 0;
+}
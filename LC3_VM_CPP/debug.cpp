@@ -0,0 +1,165 @@
+#include "debug.h"
+#include "LC3VM.h"
+#include "ops.h"
+
+using namespace LC3VM;
+
+Debugger::Debugger(Machine& vm) : vm(vm), breakpoints(MEMORY_MAX), resume_from(-1), stop() {
+	vm.debugger = this;
+}
+
+Debugger::~Debugger() {
+	while (!watches.empty()) {
+		remove_watchpoint(watches.back().address, WATCH_ACCESS);
+	}
+	vm.debugger = nullptr;
+	for (uint32_t address = 0; address < MEMORY_MAX; address++) {
+		if (breakpoints[address]) {
+			breakpoints[address] = 0;
+			redecode((uint16_t)address);
+		}
+	}
+}
+
+void Debugger::redecode(uint16_t address) {
+	// Without a cache the entry is patched when the pre-decoded core first decodes it
+	if (vm.decoded) {
+		vm.decode_entry(address);
+	}
+}
+
+void Debugger::add_breakpoint(uint16_t address) {
+	breakpoints[address] = 1;
+	redecode(address);
+}
+
+void Debugger::remove_breakpoint(uint16_t address) {
+	breakpoints[address] = 0;
+	redecode(address);
+}
+
+Debugger::Watch* Debugger::find_watch(uint16_t address) {
+	for (Watch& w : watches) {
+		if (w.address == address) {
+			return &w;
+		}
+	}
+	return nullptr;
+}
+
+void Debugger::add_watchpoint(uint16_t address, WatchKind kind) {
+	if (Watch* w = find_watch(address)) {
+		w->kind = (WatchKind)(w->kind | kind);
+		return;
+	}
+	Watch w;
+	w.address = address;
+	w.kind = kind;
+	const DeviceRegister* device = vm.io.find(address);
+	w.had_device = device != nullptr;
+	w.device = device ? *device : DeviceRegister{ nullptr, nullptr };
+	watches.push_back(w);
+
+	DeviceRegister hooks = { watch_read, watch_write };
+	vm.map_device(address, hooks);
+	if (watches.size() == 1 && vm.decoded) {
+		// Loads and stores take the slow path from now on
+		vm.decode_range(0, MEMORY_MAX);
+	}
+}
+
+void Debugger::remove_watchpoint(uint16_t address, WatchKind kind) {
+	Watch* w = find_watch(address);
+	if (!w) {
+		return;
+	}
+	w->kind = (WatchKind)(w->kind & ~kind);
+	if (w->kind) {
+		return;
+	}
+	if (w->had_device) {
+		vm.map_device(address, w->device);
+	}
+	else {
+		vm.unmap_device(address);
+	}
+	watches.erase(watches.begin() + (w - watches.data()));
+	if (watches.empty() && vm.decoded) {
+		vm.decode_range(0, MEMORY_MAX);
+	}
+}
+
+bool Debugger::stop_at(uint16_t address) {
+	if (resume_from == address) {
+		resume_from = -1;
+		return false;
+	}
+	stop.event = DEBUG_BREAKPOINT;
+	stop.address = address;
+	return true;
+}
+
+void Debugger::watch_hit(uint16_t address, WatchKind kind) {
+	stop.event = DEBUG_WATCHPOINT;
+	stop.address = address;
+	stop.kind = kind;
+	// Every core leaves once running is cleared after the slow path, resume() sets it again
+	vm.running = 0;
+}
+
+uint16_t Debugger::watch_read(Machine& vm, uint16_t address) {
+	Debugger& d = *vm.debugger;
+	Watch* w = d.find_watch(address);
+	uint16_t val = w->device.read ? w->device.read(vm, address) : vm.memory[address];
+	if (w->kind & WATCH_READ) {
+		d.watch_hit(address, WATCH_READ);
+	}
+	return val;
+}
+
+void Debugger::watch_write(Machine& vm, uint16_t address, uint16_t val) {
+	Debugger& d = *vm.debugger;
+	Watch* w = d.find_watch(address);
+	if (w->device.write) {
+		w->device.write(vm, address, val);
+	}
+	else {
+		vm.ram_write(address, val);
+	}
+	if (w->kind & WATCH_WRITE) {
+		d.watch_hit(address, WATCH_WRITE);
+	}
+}
+
+DebugStop Debugger::resume(uint32_t count) {
+	stop = DebugStop();
+	if (!vm.running) {
+		stop.event = DEBUG_HALTED;
+		return stop;
+	}
+	resume_from = breakpoints[vm.reg[R_PC]] ? vm.reg[R_PC] : -1;
+	vm.run_slice(count);
+	resume_from = -1;
+	if (stop.event == DEBUG_WATCHPOINT) {
+		vm.running = 1;
+	}
+	else if (!vm.running) {
+		stop.event = DEBUG_HALTED;
+	}
+	// Show everything the program printed before it stopped
+	if (stop.event != DEBUG_NONE) {
+		vm.output.flush();
+	}
+	else {
+		vm.output.tick();
+	}
+	return stop;
+}
+
+DebugStop Debugger::step() {
+	DebugStop s = resume(1);
+	if (s.event == DEBUG_NONE) {
+		s.event = DEBUG_STEP;
+	}
+	return s;
+}
@@ -0,0 +1,102 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+
+#include "mmio.h"
+
+/*
+Breakpoints and watchpoints.
+
+A Debugger attaches itself to a machine (Machine::debugger) and from then on
+run_slice() executes on the pre-decoded core, whatever engine is selected.
+Nothing the cores do per instruction changes, so machines without a debugger
+run exactly as before:
+
+Breakpoints are patched into the pre-decoded instruction cache. The entry of a
+breakpoint address gets the H_BREAK handler (decode_entry() puts it back
+whenever the entry is decoded again), which stops the core in front of the
+instruction. Resuming from a breakpoint runs the instruction underneath once
+through the slow path.
+
+Watchpoints map the watched address in the I/O page table, so only accesses to
+its page leave the fast path of mem_read/mem_write, and the hook reports the
+access and passes it on to the device or RAM that was there before. While any
+watchpoint is set, loads and stores are decoded to the slow path so the core
+stops right after the instruction that made the access. Instruction fetch and
+the trap routines read memory[] directly and never trigger a watchpoint.
+*/
+
+namespace LC3VM {
+	class Machine;
+
+	enum WatchKind {
+		WATCH_WRITE = 1 << 0,
+		WATCH_READ = 1 << 1,
+		WATCH_ACCESS = WATCH_WRITE | WATCH_READ,
+	};
+
+	enum DebugEvent {
+		DEBUG_NONE = 0, // The instruction budget ran out
+		DEBUG_STEP, // step() executed its instruction
+		DEBUG_BREAKPOINT, // Stopped in front of the instruction at address
+		DEBUG_WATCHPOINT, // The last instruction accessed address, kind says how
+		DEBUG_HALTED, // The program halted
+	};
+
+	struct DebugStop {
+		DebugEvent event;
+		uint16_t address;
+		WatchKind kind;
+	};
+
+	class Debugger {
+	public:
+		// Attaches to vm, which must outlive the debugger
+		explicit Debugger(Machine& vm);
+
+		// Removes every breakpoint and watchpoint and detaches
+		~Debugger();
+
+		Debugger(const Debugger&) = delete;
+		Debugger& operator=(const Debugger&) = delete;
+
+		void add_breakpoint(uint16_t address);
+		void remove_breakpoint(uint16_t address);
+		bool breakpoint_at(uint16_t address) const { return breakpoints[address] != 0; }
+
+		// Kinds accumulate, removing a kind leaves the others watched
+		void add_watchpoint(uint16_t address, WatchKind kind);
+		void remove_watchpoint(uint16_t address, WatchKind kind);
+		bool watching() const { return !watches.empty(); }
+
+		// Execute up to count instructions, stopping early at breakpoints, watchpoints and HALT
+		DebugStop resume(uint32_t count);
+
+		// Execute one instruction, a breakpoint at the PC does not stop it
+		DebugStop step();
+
+		// Called by H_BREAK, false once for the breakpoint execution resumes from
+		bool stop_at(uint16_t address);
+
+	private:
+		struct Watch {
+			uint16_t address;
+			WatchKind kind;
+			DeviceRegister device; // What was mapped here before, called for the access itself
+			bool had_device;
+		};
+
+		Machine& vm;
+		std::vector<uint8_t> breakpoints; // Indexed by address
+		std::vector<Watch> watches;
+		int32_t resume_from; // Breakpoint address that does not stop, -1 for none
+		DebugStop stop;
+
+		Watch* find_watch(uint16_t address);
+		void redecode(uint16_t address);
+		void watch_hit(uint16_t address, WatchKind kind);
+
+		static uint16_t watch_read(Machine& vm, uint16_t address);
+		static void watch_write(Machine& vm, uint16_t address, uint16_t val);
+	};
+}
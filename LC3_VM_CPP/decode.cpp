@@ -0,0 +1,486 @@
+#include "decode.h"
+#include "LC3VM.h"
+#include "ops.h"
+
+using namespace LC3VM;
+
+DecodedOp LC3VM::decode(uint16_t address, uint16_t instr, const Intrinsics* intrinsics, bool slow_memory) {
+	DecodedOp op;
+	op.a = (instr >> 9) & 0x7;
+	op.b = (instr >> 6) & 0x7;
+	op.c = instr & 0x7;
+	op.imm = 0;
+	op.instr = instr;
+
+	// Device hooks update memory without mem_write, so code there always runs the slow way
+	if (address >= MMIO_BASE) {
+		op.handler = H_SLOW;
+		return op;
+	}
+
+	switch (instr >> 12) {
+	case OP_BR:
+		op.handler = H_BR;
+		op.imm = sign_extend(instr & 0x1FF, 9);
+		break;
+	case OP_ADD:
+		op.handler = ((instr >> 5) & 0x1) ? H_ADD_IMM : H_ADD;
+		op.imm = sign_extend(instr & 0x1F, 5);
+		break;
+	case OP_AND:
+		op.handler = ((instr >> 5) & 0x1) ? H_AND_IMM : H_AND;
+		op.imm = sign_extend(instr & 0x1F, 5);
+		break;
+	case OP_NOT:
+		op.handler = H_NOT;
+		break;
+	case OP_JMP:
+		op.handler = H_JMP;
+		break;
+	case OP_JSR:
+		op.handler = ((instr >> 11) & 1) ? H_JSR : H_JSRR;
+		op.imm = sign_extend(instr & 0x7FF, 11);
+		// op_jsr looks the target up, any JSRR might reach a native routine
+		if (intrinsics && (op.handler == H_JSRR || intrinsics->at((uint16_t)(address + 1 + op.imm)))) {
+			op.handler = H_SLOW;
+		}
+		break;
+	case OP_LD:
+		op.handler = H_LD;
+		op.imm = sign_extend(instr & 0x1FF, 9);
+		break;
+	case OP_LDI:
+		op.handler = H_LDI;
+		op.imm = sign_extend(instr & 0x1FF, 9);
+		break;
+	case OP_LDR:
+		op.handler = H_LDR;
+		op.imm = sign_extend(instr & 0x3F, 6);
+		break;
+	case OP_LEA:
+		op.handler = H_LEA;
+		op.imm = sign_extend(instr & 0x1FF, 9);
+		break;
+	case OP_ST:
+		op.handler = H_ST;
+		op.imm = sign_extend(instr & 0x1FF, 9);
+		break;
+	case OP_STI:
+		op.handler = H_STI;
+		op.imm = sign_extend(instr & 0x1FF, 9);
+		break;
+	case OP_STR:
+		op.handler = H_STR;
+		op.imm = sign_extend(instr & 0x3F, 6);
+		break;
+	case OP_TRAP:
+		op.handler = H_TRAP;
+		op.imm = instr & 0xFF;
+		break;
+	case OP_RES:
+		op.handler = H_RES;
+		break;
+	case OP_RTI:
+		op.handler = H_RTI;
+		break;
+	}
+	if (slow_memory) {
+		switch (op.handler) {
+		case H_LD:
+		case H_LDI:
+		case H_LDR:
+		case H_ST:
+		case H_STI:
+		case H_STR:
+			op.handler = H_SLOW;
+			break;
+		}
+	}
+	return op;
+}
+
+namespace {
+	// Picked from profiles of the benchmark kernels and 2048
+	struct Fusion {
+		uint8_t first;
+		uint8_t second;
+		uint8_t fused;
+	};
+
+	const Fusion FUSIONS[] = {
+		{ H_ADD_IMM, H_BR, H_ADD_IMM_BR },
+		{ H_ADD, H_BR, H_ADD_BR },
+		{ H_LD, H_ADD, H_LD_ADD },
+		{ H_LD, H_AND, H_LD_AND },
+		{ H_LDR, H_LDR, H_LDR_LDR },
+		{ H_STR, H_STR, H_STR_STR },
+		{ H_LDR, H_ADD_IMM, H_LDR_ADD_IMM },
+		{ H_STR, H_ADD_IMM, H_STR_ADD_IMM },
+	};
+}
+
+uint8_t LC3VM::fuse(uint8_t first, uint8_t second) {
+	for (const Fusion& f : FUSIONS) {
+		if (f.first == first && f.second == second) {
+			return f.fused;
+		}
+	}
+	return first;
+}
+
+void Machine::decode_entry(uint16_t address) {
+	// A superinstruction ending here was fused with what used to be at address
+	if (address > 0 && decoded[address - 1].handler >= H_FIRST_FUSED) {
+		decoded[address - 1].handler = H_UNDECODED;
+	}
+	bool slow_memory = debugger && debugger->watching();
+	DecodedOp op = decode(address, memory[address], intrinsics, slow_memory);
+	if (debugger && debugger->breakpoint_at(address)) {
+		op.handler = H_BREAK;
+	}
+	if (address < MEMORY_MAX - 1) {
+		uint16_t next = (uint16_t)(address + 1);
+		DecodedOp second = decode(next, memory[next], intrinsics, slow_memory);
+		if (debugger && debugger->breakpoint_at(next)) {
+			second.handler = H_BREAK;
+		}
+		op.handler = fuse(op.handler, second.handler);
+		// The superinstruction reads the fields of the second instruction from its entry
+		if (op.handler >= H_FIRST_FUSED && decoded[next].handler == H_UNDECODED) {
+			decoded[next] = second;
+		}
+	}
+	decoded[address] = op;
+}
+
+void Machine::decode_range(uint16_t begin, uint32_t count) {
+	if (!decoded) {
+		// Value-initialised, so every entry starts out as H_UNDECODED
+		decoded.reset(new DecodedOp[MEMORY_MAX]());
+	}
+	// Backwards, so every entry is fused with an entry that is already up to date
+	for (uint32_t i = count; i-- > 0;) {
+		uint16_t address = (uint16_t)(begin + i);
+		if (jit && jit->coverage()[address]) {
+			jit->invalidate(address);
+		}
+		if (aot && aot->covers(address)) {
+			aot->invalidate(address);
+		}
+		decode_entry(address);
+	}
+}
+
+/*
+The pre-decoded core.
+
+The program counter is kept in a local and only written back to reg[R_PC] when
+something outside the loop can observe it (traps and the slow path). The same
+handler bodies are used for computed goto on GCC/Clang and for a switch elsewhere.
+
+In block mode the loop also returns after any instruction that ends a basic
+block, which is what the JIT uses to interpret code that is not compiled yet.
+The loop itself works on flag_value, syncing the condition codes is up to the caller.
+*/
+template <bool BlockMode>
+uint32_t Machine::predecoded_loop(uint32_t count) {
+	if (!running) {
+		return 0;
+	}
+	if (!decoded) {
+		decode_range(0, 0);
+	}
+
+	DecodedOp* const ops = decoded.get();
+	uint16_t pc = reg[R_PC];
+	uint32_t executed = 0;
+	const DecodedOp* op;
+
+#define END_BLOCK() do { if (BlockMode) { goto done; } } while (0)
+
+// Instructions that end a basic block take pending interrupts, as check_interrupts() does in the other cores
+#define CHECK_INTERRUPTS() \
+	do { \
+		if (interrupt_pending) { \
+			reg[R_PC] = pc; \
+			service_interrupts(); \
+			pc = reg[R_PC]; \
+		} \
+	} while (0)
+
+/*
+Move on to the second instruction of a superinstruction. If the budget ends
+after the first one, or the second entry went stale (a store into it), the
+first instruction stands alone and finish_first sets its condition codes.
+*/
+#define SECOND(finish_first) \
+	do { \
+		if (executed == count || ops[pc].handler == H_UNDECODED) { \
+			finish_first; \
+			goto first_alone; \
+		} \
+		executed++; \
+		op = &ops[pc++]; \
+	} while (0)
+
+#if defined(__GNUC__)
+	// Indexed by handler, the order must match the H_ enum
+	static void* const labels[H_COUNT] = {
+		&&do_H_UNDECODED, &&do_H_SLOW, &&do_H_BR, &&do_H_ADD, &&do_H_ADD_IMM,
+		&&do_H_LD, &&do_H_ST, &&do_H_JSR, &&do_H_JSRR, &&do_H_AND,
+		&&do_H_AND_IMM, &&do_H_LDR, &&do_H_STR, &&do_H_RTI, &&do_H_NOT,
+		&&do_H_LDI, &&do_H_STI, &&do_H_JMP, &&do_H_RES, &&do_H_LEA,
+		&&do_H_TRAP, &&do_H_BREAK, &&do_H_ADD_IMM_BR, &&do_H_ADD_BR, &&do_H_LD_ADD,
+		&&do_H_LD_AND, &&do_H_LDR_LDR, &&do_H_STR_STR, &&do_H_LDR_ADD_IMM, &&do_H_STR_ADD_IMM,
+	};
+#define HANDLER(h) do_##h:
+#define DISPATCH() \
+	do { \
+		if (executed == count) { goto done; } \
+		executed++; \
+		op = &ops[pc++]; \
+		goto *labels[op->handler]; \
+	} while (0)
+#define NEXT() DISPATCH()
+
+	DISPATCH();
+#else
+#define HANDLER(h) case h:
+#define NEXT() break
+
+	while (executed < count) {
+		executed++;
+		op = &ops[pc++];
+	redispatch:
+		switch (op->handler) {
+#endif
+
+	HANDLER(H_UNDECODED)
+		decode_entry((uint16_t)(pc - 1));
+#if defined(__GNUC__)
+		goto *labels[op->handler];
+#else
+		goto redispatch;
+#endif
+
+	HANDLER(H_BREAK)
+		if (debugger && debugger->stop_at((uint16_t)(pc - 1))) {
+			// In front of the instruction, which has not retired
+			pc--;
+			executed--;
+			goto done;
+		}
+		// Resuming from the breakpoint, run the instruction underneath
+
+	HANDLER(H_SLOW)
+		reg[R_PC] = (uint16_t)(pc - 1);
+		switch_op(memory[reg[R_PC]++]);
+		pc = reg[R_PC];
+		if (!running || BlockMode) { goto done; }
+		NEXT();
+
+	HANDLER(H_BR)
+		if (op->a & flags_of(flag_value)) {
+			pc += op->imm;
+			if ((uint16_t)(op->imm + 2) < 2) {
+				reg[R_PC] = pc;
+				check_idle(op->instr);
+				if (!running) { goto done; }
+			}
+		}
+		CHECK_INTERRUPTS();
+		END_BLOCK();
+		NEXT();
+
+	HANDLER(H_ADD)
+		reg[op->a] = reg[op->b] + reg[op->c];
+		update_flags(op->a);
+		NEXT();
+
+	HANDLER(H_ADD_IMM)
+		reg[op->a] = reg[op->b] + op->imm;
+		update_flags(op->a);
+		NEXT();
+
+	HANDLER(H_AND)
+		reg[op->a] = reg[op->b] & reg[op->c];
+		update_flags(op->a);
+		NEXT();
+
+	HANDLER(H_AND_IMM)
+		reg[op->a] = reg[op->b] & op->imm;
+		update_flags(op->a);
+		NEXT();
+
+	HANDLER(H_NOT)
+		reg[op->a] = ~reg[op->b];
+		update_flags(op->a);
+		NEXT();
+
+	HANDLER(H_JMP)
+		pc = reg[op->b];
+		CHECK_INTERRUPTS();
+		END_BLOCK();
+		NEXT();
+
+	HANDLER(H_JSR)
+		reg[R_R7] = pc;
+		pc += op->imm;
+		CHECK_INTERRUPTS();
+		END_BLOCK();
+		NEXT();
+
+	HANDLER(H_JSRR)
+		// R7 is written first, exactly as op_jsr does, so JSRR R7 falls through
+		reg[R_R7] = pc;
+		pc = reg[op->b];
+		CHECK_INTERRUPTS();
+		END_BLOCK();
+		NEXT();
+
+	HANDLER(H_LD)
+		reg[op->a] = mem_read(pc + op->imm);
+		update_flags(op->a);
+		NEXT();
+
+	HANDLER(H_LDI)
+		reg[op->a] = mem_read(mem_read(pc + op->imm));
+		update_flags(op->a);
+		NEXT();
+
+	HANDLER(H_LDR)
+		reg[op->a] = mem_read(reg[op->b] + op->imm);
+		update_flags(op->a);
+		NEXT();
+
+	HANDLER(H_LEA)
+		reg[op->a] = pc + op->imm;
+		update_flags(op->a);
+		NEXT();
+
+	HANDLER(H_ST)
+		mem_write(pc + op->imm, reg[op->a]);
+		NEXT();
+
+	HANDLER(H_STI)
+		mem_write(mem_read(pc + op->imm), reg[op->a]);
+		NEXT();
+
+	HANDLER(H_STR)
+		mem_write(reg[op->b] + op->imm, reg[op->a]);
+		NEXT();
+
+	HANDLER(H_TRAP)
+		reg[R_PC] = pc;
+		op_trap(op->instr);
+		pc = reg[R_PC];
+		if (!running || BlockMode) { goto done; }
+		NEXT();
+
+	HANDLER(H_RTI)
+		reg[R_PC] = pc;
+		op_rti(op->instr);
+		pc = reg[R_PC];
+		if (!running || BlockMode) { goto done; }
+		NEXT();
+
+	HANDLER(H_RES)
+		reg[R_PC] = pc;
+		op_res(op->instr);
+		pc = reg[R_PC];
+		if (!running || BlockMode) { goto done; }
+		NEXT();
+
+	HANDLER(H_ADD_IMM_BR)
+		reg[op->a] = reg[op->b] + op->imm;
+		update_flags(op->a);
+		SECOND((void)0);
+		if (op->a & flags_of(flag_value)) {
+			pc += op->imm;
+		}
+		CHECK_INTERRUPTS();
+		END_BLOCK();
+		NEXT();
+
+	HANDLER(H_ADD_BR)
+		reg[op->a] = reg[op->b] + reg[op->c];
+		update_flags(op->a);
+		SECOND((void)0);
+		if (op->a & flags_of(flag_value)) {
+			pc += op->imm;
+		}
+		CHECK_INTERRUPTS();
+		END_BLOCK();
+		NEXT();
+
+	HANDLER(H_LD_ADD)
+		reg[op->a] = mem_read(pc + op->imm);
+		SECOND(update_flags(op->a));
+		reg[op->a] = reg[op->b] + reg[op->c];
+		update_flags(op->a);
+		NEXT();
+
+	HANDLER(H_LD_AND)
+		reg[op->a] = mem_read(pc + op->imm);
+		SECOND(update_flags(op->a));
+		reg[op->a] = reg[op->b] & reg[op->c];
+		update_flags(op->a);
+		NEXT();
+
+	HANDLER(H_LDR_LDR)
+		reg[op->a] = mem_read(reg[op->b] + op->imm);
+		SECOND(update_flags(op->a));
+		reg[op->a] = mem_read(reg[op->b] + op->imm);
+		update_flags(op->a);
+		NEXT();
+
+	HANDLER(H_STR_STR)
+		mem_write(reg[op->b] + op->imm, reg[op->a]);
+		SECOND((void)0);
+		mem_write(reg[op->b] + op->imm, reg[op->a]);
+		NEXT();
+
+	HANDLER(H_LDR_ADD_IMM)
+		reg[op->a] = mem_read(reg[op->b] + op->imm);
+		SECOND(update_flags(op->a));
+		reg[op->a] = reg[op->b] + op->imm;
+		update_flags(op->a);
+		NEXT();
+
+	HANDLER(H_STR_ADD_IMM)
+		mem_write(reg[op->b] + op->imm, reg[op->a]);
+		SECOND((void)0);
+		reg[op->a] = reg[op->b] + op->imm;
+		update_flags(op->a);
+		NEXT();
+
+	// The first instruction of a superinstruction ran by itself
+	first_alone:
+		NEXT();
+
+#if !defined(__GNUC__)
+		}
+	}
+#endif
+
+#undef HANDLER
+#undef END_BLOCK
+#undef CHECK_INTERRUPTS
+#undef NEXT
+#undef DISPATCH
+
+done:
+	reg[R_PC] = pc;
+	return executed;
+}
+
+uint32_t Machine::run_predecoded(uint32_t count) {
+	load_flags();
+	uint32_t executed = predecoded_loop<false>(count);
+	store_flags();
+	return executed;
+}
+
+uint32_t Machine::run_predecoded_block(uint32_t count) {
+	return predecoded_loop<true>(count);
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <stdint.h>
+
+/*
+Pre-decoded instructions for the pre-decoded core (ENGINE_PREDECODED).
+
+Every memory address has a parallel DecodedOp holding the register fields and
+sign extended offset already pulled out of the instruction word, plus the index
+of the handler to run. Images are decoded as they are loaded, and mem_write
+marks the entry of the written address as stale so it is decoded again the
+next time it is executed.
+
+Common pairs of instructions are fused into superinstructions: the entry of the
+first gets a handler that executes both, taking the second one's fields from
+the next entry, with one dispatch and without setting condition codes the
+second instruction overwrites anyway. Entries still describe only their own
+instruction, so jumping to the second one works as before. A superinstruction
+whose second entry has gone stale runs as its first instruction alone, and
+decoding an entry again unfuses the one before it.
+*/
+
+namespace LC3VM {
+	class Intrinsics;
+
+	// Handlers of the pre-decoded core, the ADD/AND and JSR modes get their own
+	enum {
+		H_UNDECODED = 0, // Entry is stale, decode it before executing
+		H_SLOW, // Execute through switch_op (instructions fetched from device space, calls to native routines, memory accesses while watching)
+		H_BR,
+		H_ADD,
+		H_ADD_IMM,
+		H_LD,
+		H_ST,
+		H_JSR,
+		H_JSRR,
+		H_AND,
+		H_AND_IMM,
+		H_LDR,
+		H_STR,
+		H_RTI,
+		H_NOT,
+		H_LDI,
+		H_STI,
+		H_JMP,
+		H_RES,
+		H_LEA,
+		H_TRAP,
+		H_BREAK, // Debugger breakpoint, the instruction runs through switch_op when resuming from it
+
+		// Superinstructions, see fuse()
+		H_ADD_IMM_BR, // Loop counter and back edge
+		H_ADD_BR,
+		H_LD_ADD, // Constant loaded for the next ALU op
+		H_LD_AND,
+		H_LDR_LDR, // Consecutive loads and stores, stack frames through R6
+		H_STR_STR,
+		H_LDR_ADD_IMM, // Pop
+		H_STR_ADD_IMM, // Push
+		H_COUNT,
+		H_FIRST_FUSED = H_ADD_IMM_BR
+	};
+
+	struct DecodedOp {
+		uint8_t handler;
+		uint8_t a; // DR or SR, or the nzp mask of BR
+		uint8_t b; // SR1 or BaseR
+		uint8_t c; // SR2
+		uint16_t imm; // Sign extended immediate or offset, or the trap vector
+		uint16_t instr; // The raw instruction word
+	};
+
+	/*
+	Decode the instruction found at address. Calls that may reach one of the
+	intrinsics take the slow path, and so do loads and stores with slow_memory.
+	*/
+	DecodedOp decode(uint16_t address, uint16_t instr, const Intrinsics* intrinsics = nullptr, bool slow_memory = false);
+
+	// The superinstruction for first followed by second, or first's own handler if the pair is not fused
+	uint8_t fuse(uint8_t first, uint8_t second);
+}
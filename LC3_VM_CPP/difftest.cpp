@@ -0,0 +1,358 @@
+#include "difftest.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+using namespace LC3VM;
+
+namespace {
+	const uint64_t FNV_OFFSET = 14695981039346656037ull;
+	const uint64_t FNV_PRIME = 1099511628211ull;
+	const size_t MAX_LISTED_WORDS = 8; // Memory differences listed one by one, the rest are counted
+
+	uint64_t hash_words(uint64_t h, const uint16_t* words, size_t count) {
+		for (size_t i = 0; i < count; i++) {
+			h = (h ^ words[i]) * FNV_PRIME;
+		}
+		return h;
+	}
+
+	uint64_t hash_u64(uint64_t h, uint64_t value) {
+		for (int i = 0; i < 4; i++) {
+			h = (h ^ (uint16_t)(value >> (16 * i))) * FNV_PRIME;
+		}
+		return h;
+	}
+
+	uint64_t hash_bytes(uint64_t h, const std::string& bytes) {
+		for (char c : bytes) {
+			h = (h ^ (uint8_t)c) * FNV_PRIME;
+		}
+		return h;
+	}
+
+	// The hash of a page depends on where it is, so two pages swapping contents changes the memory hash
+	uint64_t hash_page(const Machine& vm, int p) {
+		return hash_words(FNV_OFFSET ^ (uint64_t)p, vm.memory + p * PAGE_WORDS, PAGE_WORDS);
+	}
+
+	// One engine's machine and the hash of its state at the last check
+	struct Lane {
+		Engine engine;
+		std::unique_ptr<Machine> vm;
+		std::unique_ptr<BufferInput> keys;
+		uint64_t page_hash[PAGE_COUNT];
+		uint64_t memory_hash; // All page hashes xor'ed, so changing a page costs only that page
+		uint64_t output_hash; // Of every byte written so far
+		uint64_t hash;
+		bool keep_output; // Collect the output in output as well, for the report
+		std::string output;
+
+		void start(const std::vector<std::shared_ptr<const Image>>& images, const std::string& input) {
+			vm.reset(new Machine());
+			vm->engine = engine;
+			vm->output.set_sink(nullptr, false);
+			for (const std::shared_ptr<const Image>& image : images) {
+				vm->load_image(*image);
+			}
+			keys.reset(new BufferInput(input));
+			vm->keyboard = keys.get();
+			vm->reset();
+
+			memory_hash = 0;
+			for (int p = 0; p < PAGE_COUNT; p++) {
+				page_hash[p] = hash_page(*vm, p);
+				memory_hash ^= page_hash[p];
+			}
+			vm->share_pages();
+			output_hash = FNV_OFFSET;
+			output.clear();
+			update_hash();
+		}
+
+		// Run until target instructions were executed since the start or the program halted
+		void advance(uint64_t target) {
+			while (vm->running && vm->instructions < target) {
+				uint64_t left = target - vm->instructions;
+				vm->run_slice(left < UINT32_MAX ? (uint32_t)left : UINT32_MAX);
+			}
+			update_hash();
+		}
+
+		// Hash the pages written since the last check again and leave them clean
+		void update_hash() {
+			for (int p = 0; p < PAGE_COUNT; p++) {
+				if (!vm->dirty_pages[p] && !vm->io.is_io((uint16_t)(p * PAGE_WORDS))) {
+					continue;
+				}
+				uint64_t h = hash_page(*vm, p);
+				memory_hash ^= page_hash[p] ^ h;
+				page_hash[p] = h;
+			}
+			vm->share_pages();
+
+			std::string written = vm->output.take_captured();
+			output_hash = hash_bytes(output_hash, written);
+			if (keep_output) {
+				output += written;
+			}
+
+			uint16_t state[R_COUNT + 4] = {};
+			memcpy(state, vm->reg, sizeof(vm->reg));
+			state[R_COUNT] = vm->psr;
+			state[R_COUNT + 1] = vm->saved_ssp;
+			state[R_COUNT + 2] = vm->saved_usp;
+			state[R_COUNT + 3] = (uint16_t)vm->running;
+			hash = hash_words(FNV_OFFSET, state, R_COUNT + 4);
+			hash = hash_u64(hash, vm->instructions);
+			hash = hash_u64(hash, memory_hash);
+			hash = hash_u64(hash, output_hash);
+		}
+	};
+
+	/*
+	One thread per lane after the first, which runs on the calling thread. The
+	threads sleep between checks; run_to() wakes them all and returns once every
+	lane has reached the target and hashed its state.
+	*/
+	class Lockstep {
+	public:
+		explicit Lockstep(std::vector<Lane>& lanes) : lanes(lanes), generation(0), target(0), finished(0), quit(false) {
+			for (size_t i = 1; i < lanes.size(); i++) {
+				threads.emplace_back(&Lockstep::work, this, i);
+			}
+		}
+
+		~Lockstep() {
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				quit = true;
+			}
+			wake.notify_all();
+			for (std::thread& t : threads) {
+				t.join();
+			}
+		}
+
+		void run_to(uint64_t to) {
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				target = to;
+				finished = 0;
+				generation++;
+			}
+			wake.notify_all();
+			lanes[0].advance(to);
+			std::unique_lock<std::mutex> guard(lock);
+			done.wait(guard, [this] { return finished == threads.size(); });
+		}
+
+	private:
+		std::vector<Lane>& lanes;
+		std::vector<std::thread> threads;
+		std::mutex lock;
+		std::condition_variable wake;
+		std::condition_variable done;
+		uint64_t generation; // Bumped by every run_to()
+		uint64_t target;
+		size_t finished; // Threads done with the current generation
+		bool quit;
+
+		void work(size_t lane) {
+			uint64_t seen = 0;
+			for (;;) {
+				uint64_t to;
+				{
+					std::unique_lock<std::mutex> guard(lock);
+					wake.wait(guard, [&] { return quit || generation != seen; });
+					if (quit) {
+						return;
+					}
+					seen = generation;
+					to = target;
+				}
+				lanes[lane].advance(to);
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					finished++;
+				}
+				done.notify_one();
+			}
+		}
+	};
+
+	bool lanes_agree(const std::vector<Lane>& lanes) {
+		for (size_t i = 1; i < lanes.size(); i++) {
+			if (lanes[i].hash != lanes[0].hash) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Fresh machines run to target in the same slices as the checks, so every engine does exactly what it did the first time
+	void replay(std::vector<Lane>& lanes, Lockstep& lockstep, const std::vector<std::shared_ptr<const Image>>& images,
+		const std::string& input, uint32_t interval, uint64_t target) {
+		for (Lane& lane : lanes) {
+			lane.keep_output = true;
+			lane.start(images, input);
+		}
+		uint64_t at = 0;
+		while (at < target) {
+			at = target - at > interval ? at + interval : target;
+			lockstep.run_to(at);
+		}
+	}
+
+	std::string hex(uint16_t value) {
+		char text[8];
+		snprintf(text, sizeof(text), "x%04X", value);
+		return text;
+	}
+
+	void differ(DiffResult& result, const Lane& lane, const Lane& reference, const std::string& what,
+		const std::string& value, const std::string& expected) {
+		result.differences.push_back(std::string(engine_name(lane.engine)) + ": " + what + " " + value + ", "
+			+ engine_name(reference.engine) + ": " + expected);
+	}
+
+	// Everything that differs between reference and lane
+	void describe(DiffResult& result, const Lane& lane, const Lane& reference) {
+		static const char* const REGISTER_NAMES[R_COUNT] = { "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "PC", "COND" };
+		const Machine& vm = *lane.vm;
+		const Machine& ref = *reference.vm;
+
+		if (vm.instructions != ref.instructions) {
+			differ(result, lane, reference, "instructions", std::to_string(vm.instructions), std::to_string(ref.instructions));
+		}
+		if (vm.running != ref.running) {
+			differ(result, lane, reference, "state", vm.running ? "running" : "halted", ref.running ? "running" : "halted");
+		}
+		for (int r = 0; r < R_COUNT; r++) {
+			if (vm.reg[r] != ref.reg[r]) {
+				differ(result, lane, reference, REGISTER_NAMES[r], hex(vm.reg[r]), hex(ref.reg[r]));
+			}
+		}
+		if (vm.psr != ref.psr) {
+			differ(result, lane, reference, "PSR", hex(vm.psr), hex(ref.psr));
+		}
+		if (vm.saved_ssp != ref.saved_ssp) {
+			differ(result, lane, reference, "saved SSP", hex(vm.saved_ssp), hex(ref.saved_ssp));
+		}
+		if (vm.saved_usp != ref.saved_usp) {
+			differ(result, lane, reference, "saved USP", hex(vm.saved_usp), hex(ref.saved_usp));
+		}
+
+		size_t words = 0;
+		for (int a = 0; a < MEMORY_MAX; a++) {
+			if (vm.memory[a] != ref.memory[a] && words++ < MAX_LISTED_WORDS) {
+				differ(result, lane, reference, "memory[" + hex((uint16_t)a) + "]", hex(vm.memory[a]), hex(ref.memory[a]));
+			}
+		}
+		if (words > MAX_LISTED_WORDS) {
+			result.differences.push_back(std::string(engine_name(lane.engine)) + ": " + std::to_string(words - MAX_LISTED_WORDS)
+				+ " more words of memory differ");
+		}
+
+		if (lane.output != reference.output) {
+			size_t at = 0;
+			while (at < lane.output.size() && at < reference.output.size() && lane.output[at] == reference.output[at]) {
+				at++;
+			}
+			differ(result, lane, reference, "output from byte " + std::to_string(at),
+				std::to_string(lane.output.size() - at) + " bytes", std::to_string(reference.output.size() - at) + " bytes");
+		}
+	}
+}
+
+DiffResult LC3VM::diff_engines(const std::vector<std::string>& images, const std::string& input, const DiffOptions& options) {
+	DiffResult result;
+
+	std::vector<std::shared_ptr<const Image>> loaded;
+	for (const std::string& path : images) {
+		std::shared_ptr<const Image> image = Image::load(path.c_str());
+		if (!image) {
+			result.status = DIFF_LOAD_FAILED;
+			return result;
+		}
+		loaded.push_back(image);
+	}
+
+	std::vector<Engine> engines = options.engines;
+	if (engines.empty()) {
+		for (int e = 0; e < ENGINE_COUNT; e++) {
+			engines.push_back((Engine)e);
+		}
+	}
+	uint32_t interval = options.interval ? options.interval : 1;
+
+	std::vector<Lane> lanes(engines.size());
+	for (size_t i = 0; i < lanes.size(); i++) {
+		lanes[i].engine = engines[i];
+		lanes[i].keep_output = false;
+		lanes[i].start(loaded, input);
+	}
+	Lockstep lockstep(lanes);
+
+	uint64_t agreed = 0;
+	for (;;) {
+		uint64_t target = agreed + interval;
+		if (options.max_instructions && target > options.max_instructions) {
+			target = options.max_instructions;
+		}
+		lockstep.run_to(target);
+		result.checks++;
+		if (!lanes_agree(lanes)) {
+			// The first instruction that tells them apart is in (agreed, target]
+			uint64_t low = agreed;
+			uint64_t high = target;
+			while (high - low > 1) {
+				uint64_t middle = low + (high - low) / 2;
+				replay(lanes, lockstep, loaded, input, interval, middle);
+				if (lanes_agree(lanes)) {
+					low = middle;
+				}
+				else {
+					high = middle;
+				}
+			}
+			replay(lanes, lockstep, loaded, input, interval, low);
+			const Machine& before = *lanes[0].vm;
+			result.status = DIFF_DIVERGED;
+			result.instructions = before.instructions;
+			result.pc = before.reg[R_PC];
+			result.instr = before.memory[before.reg[R_PC]];
+			replay(lanes, lockstep, loaded, input, interval, high);
+			for (size_t i = 1; i < lanes.size(); i++) {
+				describe(result, lanes[i], lanes[0]);
+			}
+			return result;
+		}
+
+		agreed = lanes[0].vm->instructions;
+		if (!lanes[0].vm->running) {
+			result.status = DIFF_AGREED;
+			break;
+		}
+		if (options.max_instructions && agreed >= options.max_instructions) {
+			result.status = DIFF_BUDGET_EXHAUSTED;
+			break;
+		}
+	}
+	result.instructions = agreed;
+	return result;
+}
+
+const char* LC3VM::diff_status_name(DiffStatus status) {
+	switch (status) {
+	case DIFF_AGREED: return "agreed";
+	case DIFF_BUDGET_EXHAUSTED: return "budget-exhausted";
+	case DIFF_DIVERGED: return "diverged";
+	case DIFF_LOAD_FAILED: return "load-failed";
+	}
+	return "unknown";
+}
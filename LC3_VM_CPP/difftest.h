@@ -0,0 +1,55 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "LC3VM.h"
+
+/*
+Differential testing of the interpreter cores.
+
+The same program runs on several engines at once, one thread per engine, each
+on its own machine reading its own copy of the same keys. The machines run in
+lockstep: every one stops after each `interval` instructions, and their state
+is compared there as a hash of the registers, the processor status, the
+running flag, the output written so far and memory. Memory is hashed per
+page and only the pages written since the last check (the copy-on-write dirty
+pages, see fork.cpp) are hashed again, so a check costs the pages the
+program touched rather than all 128 KiB.
+
+Once a check finds the engines apart, the program is run again from the start
+on fresh machines, cut into the same slices, and a binary search over the
+instructions since the last check that agreed finds the first instruction
+after which the machines differ. The result names it and lists what differs.
+*/
+
+namespace LC3VM {
+	enum DiffStatus {
+		DIFF_AGREED = 0, // Every engine halted in the same state
+		DIFF_BUDGET_EXHAUSTED, // Every engine agreed up to max_instructions
+		DIFF_DIVERGED, // The engines disagree, see DiffResult
+		DIFF_LOAD_FAILED, // One of the images could not be read
+	};
+
+	struct DiffOptions {
+		std::vector<Engine> engines; // Compared with the first one, empty means every engine
+		uint32_t interval = 100000; // Instructions between checks
+		uint64_t max_instructions = 0; // 0 means no limit
+	};
+
+	struct DiffResult {
+		DiffStatus status = DIFF_AGREED;
+		uint64_t instructions = 0; // Executed in agreement, up to the diverging instruction
+		uint64_t checks = 0; // Times the hashes were compared
+
+		// The first instruction after which the engines differ, with DIFF_DIVERGED
+		uint16_t pc = 0;
+		uint16_t instr = 0;
+		std::vector<std::string> differences; // One line per register, memory word or output that differs
+	};
+
+	// Run images (loaded in order) with input as keys on every engine of options and compare them
+	DiffResult diff_engines(const std::vector<std::string>& images, const std::string& input, const DiffOptions& options);
+
+	const char* diff_status_name(DiffStatus status);
+}
@@ -0,0 +1,136 @@
+#include "fork.h"
+
+#include <string.h>
+
+using namespace LC3VM;
+
+/*
+Copy-on-write forking.
+
+Pages are shared as immutable, reference counted MemoryPage objects. A machine
+never executes out of them: it keeps its own flat memory array, and
+shared_pages only records which shared page each clean page is a copy of. That
+keeps every core and compiled block addressing memory directly, and a fork
+only pays for the pages whose shared page differs between the two machines.
+
+So the cost of a fork depends on the machine it goes into. fork(), which is
+deprecated, builds a new one, which starts out zeroed and has every non-zero
+page of the parent copied in, 128 KiB of memory per clone. The O(dirty pages)
+path is to fork into a machine that was forked from the same parent before:
+ForkPool keeps the children of one parent and re-forks them with
+fork_from_shared() when a run is done, so each run costs the pages the
+previous run on that child wrote, plus the decoded entries of those pages.
+Restoring a snapshot into the parent (snapshot.h) only dirties the pages it
+changes, so boot, restore, then forking from a pool shares everything else.
+*/
+
+bool LC3VM::page_is_zero(const uint16_t* words) {
+	for (int i = 0; i < PAGE_WORDS; i++) {
+		if (words[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void Machine::share_pages() {
+	for (int p = 0; p < PAGE_COUNT; p++) {
+		if (!dirty_pages[p] && !io.is_io((uint16_t)(p * PAGE_WORDS))) {
+			continue;
+		}
+		dirty_pages[p] = 0;
+		const uint16_t* words = memory + p * PAGE_WORDS;
+		const MemoryPage* current = shared_pages[p].get();
+		// Written back to what it was, keep sharing the old page so forks see no difference
+		if (current ? memcmp(current->words, words, sizeof(current->words)) == 0 : page_is_zero(words)) {
+			continue;
+		}
+		if (page_is_zero(words)) {
+			shared_pages[p].reset();
+			continue;
+		}
+		MemoryPage* page = new MemoryPage();
+		memcpy(page->words, words, sizeof(page->words));
+		shared_pages[p].reset(page);
+	}
+}
+
+void Machine::fork_from(Machine& parent) {
+	parent.share_pages();
+	fork_from_shared(parent);
+}
+
+void Machine::fork_from_shared(const Machine& parent) {
+	for (int p = 0; p < PAGE_COUNT; p++) {
+		bool clean = !dirty_pages[p] && !io.is_io((uint16_t)(p * PAGE_WORDS));
+		if (clean && shared_pages[p] == parent.shared_pages[p]) {
+			continue;
+		}
+		uint16_t* words = memory + p * PAGE_WORDS;
+		if (parent.shared_pages[p]) {
+			memcpy(words, parent.shared_pages[p]->words, PAGE_WORDS * sizeof(uint16_t));
+		}
+		else {
+			memset(words, 0, PAGE_WORDS * sizeof(uint16_t));
+		}
+		shared_pages[p] = parent.shared_pages[p];
+		dirty_pages[p] = 0;
+		// Also drops compiled blocks covering the page, the others survive the fork
+		if (decoded) {
+			decode_range((uint16_t)(p * PAGE_WORDS), PAGE_WORDS);
+		}
+	}
+
+	memcpy(reg, parent.reg, sizeof(reg));
+	running = parent.running;
+	psr = parent.psr;
+	saved_ssp = parent.saved_ssp;
+	saved_usp = parent.saved_usp;
+	interrupt_pending = parent.interrupt_pending;
+	engine = parent.engine;
+	instructions = parent.instructions;
+	if (!decoded && (engine == ENGINE_PREDECODED || engine == ENGINE_JIT || engine == ENGINE_AOT)) {
+		decode_range(0, MEMORY_MAX);
+	}
+}
+
+std::unique_ptr<Machine> Machine::fork() {
+	std::unique_ptr<Machine> child(new Machine());
+	child->keyboard = keyboard;
+	child->intrinsics = intrinsics;
+	child->fork_from(*this);
+	return child;
+}
+
+ForkPool::ForkPool(Machine& parent) : parent(parent) {
+	parent.share_pages();
+}
+
+std::unique_ptr<Machine> ForkPool::acquire() {
+	std::unique_ptr<Machine> child;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (!children.empty()) {
+			child = std::move(children.back());
+			children.pop_back();
+		}
+	}
+	if (!child) {
+		child.reset(new Machine());
+		child->keyboard = parent.keyboard;
+		child->intrinsics = parent.intrinsics;
+	}
+	// Outside the lock, several threads may copy pages from the parent at once
+	child->fork_from_shared(parent);
+	return child;
+}
+
+void ForkPool::release(std::unique_ptr<Machine> child) {
+	std::lock_guard<std::mutex> guard(lock);
+	children.push_back(std::move(child));
+}
+
+size_t ForkPool::idle() const {
+	std::lock_guard<std::mutex> guard(lock);
+	return children.size();
+}
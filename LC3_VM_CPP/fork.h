@@ -0,0 +1,49 @@
+#pragma once
+#include <stddef.h>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "LC3VM.h"
+
+/*
+Many runs forked from one prefix state, as a fuzzer explores input branches.
+
+Machine::fork() pays for a whole new machine every time. A ForkPool keeps the
+children of one parent instead: acquire() hands out a child in the parent's
+state and release() takes it back once its run is done. A released child is
+forked again with Machine::fork_from_shared(), which only copies the pages
+that differ from the parent, normally the ones its last run wrote, and keeps
+the decoded entries and compiled blocks of every other page. Only the first
+acquire() of each child copies all of the parent's memory.
+
+The parent's pages are shared when the pool is created, and the parent must
+not run or be written while the pool is in use; acquire() and release() may
+then be called from any number of threads.
+*/
+
+namespace LC3VM {
+	class ForkPool {
+	public:
+		explicit ForkPool(Machine& parent);
+
+		/*
+		A machine in the state of parent: memory, registers, running state,
+		instruction count and core. A new child reads parent's keyboard and
+		uses its intrinsics; a released one keeps whatever keyboard, output and
+		attachments its last user left, take its output before releasing it.
+		*/
+		std::unique_ptr<Machine> acquire();
+
+		// Hand back a child of this pool, to be re-forked by a later acquire()
+		void release(std::unique_ptr<Machine> child);
+
+		// Children released and not acquired again
+		size_t idle() const;
+
+	private:
+		Machine& parent;
+		mutable std::mutex lock;
+		std::vector<std::unique_ptr<Machine>> children;
+	};
+}
@@ -0,0 +1,413 @@
+#include "gdbstub.h"
+#include "LC3VM.h"
+#include "ops.h"
+
+#include <stdlib.h>
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef int socklen_t;
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+using namespace LC3VM;
+
+namespace {
+	// Instructions between checks for Ctrl-C while the program runs
+	const uint32_t SLICE = 1 << 16;
+
+	const intptr_t NO_SOCKET = -1;
+
+	void close_socket(intptr_t s) {
+#if defined(_WIN32)
+		closesocket((SOCKET)s);
+#else
+		close((int)s);
+#endif
+	}
+
+	const char HEX[] = "0123456789abcdef";
+
+	int hex_digit(char c) {
+		if (c >= '0' && c <= '9') { return c - '0'; }
+		if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+		if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
+		return -1;
+	}
+
+	void put_word(std::string& out, uint16_t word) {
+		for (int shift = 12; shift >= 0; shift -= 4) {
+			out += HEX[(word >> shift) & 0xF];
+		}
+	}
+
+	// Whether words [address, address + count) are all in memory, without address + count wrapping around
+	bool in_memory(uint32_t address, uint32_t count) {
+		return address < (uint32_t)MEMORY_MAX && count <= (uint32_t)MEMORY_MAX - address;
+	}
+
+	// Hex number at pos, which is moved past it. False if there are no digits.
+	bool get_hex(const std::string& s, size_t& pos, uint32_t& value) {
+		value = 0;
+		size_t start = pos;
+		while (pos < s.size() && hex_digit(s[pos]) >= 0 && pos - start < 8) {
+			value = (value << 4) | (uint32_t)hex_digit(s[pos++]);
+		}
+		return pos > start;
+	}
+
+	bool get_word(const std::string& s, size_t& pos, uint16_t& word) {
+		if (s.size() - pos < 4) {
+			return false;
+		}
+		word = 0;
+		for (int i = 0; i < 4; i++) {
+			int d = hex_digit(s[pos++]);
+			if (d < 0) {
+				return false;
+			}
+			word = (uint16_t)((word << 4) | d);
+		}
+		return true;
+	}
+
+	bool expect(const std::string& s, size_t& pos, char c) {
+		if (pos < s.size() && s[pos] == c) {
+			pos++;
+			return true;
+		}
+		return false;
+	}
+}
+
+GdbStub::GdbStub(Machine& vm, Debugger& debugger)
+	: vm(vm), debugger(debugger), connection(NO_SOCKET), no_ack(false), detach(false), last_stop("S05") {}
+
+bool GdbStub::serve(uint16_t port, FILE* log) {
+#if defined(_WIN32)
+	WSADATA wsa;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+		return false;
+	}
+#endif
+	intptr_t listener = (intptr_t)socket(AF_INET, SOCK_STREAM, 0);
+	if (listener == NO_SOCKET) {
+		return false;
+	}
+	int yes = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t length = sizeof(address);
+	if (bind(listener, (const sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 1) != 0
+		|| getsockname(listener, (sockaddr*)&address, &length) != 0) {
+		close_socket(listener);
+		return false;
+	}
+	if (log) {
+		fprintf(log, "gdb: waiting for a connection on 127.0.0.1:%d\n", ntohs(address.sin_port));
+		fflush(log);
+	}
+	connection = (intptr_t)accept(listener, nullptr, nullptr);
+	close_socket(listener);
+	if (connection == NO_SOCKET) {
+		return false;
+	}
+	setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, (const char*)&yes, sizeof(yes));
+
+	std::string packet;
+	bool done = false;
+	while (!done && read_packet(packet)) {
+		std::string reply = handle(packet, done);
+		if (packet != "k" && !send_packet(reply)) {
+			break;
+		}
+		if (packet == "QStartNoAckMode") {
+			no_ack = true;
+		}
+	}
+	close_socket(connection);
+	connection = NO_SOCKET;
+	if (log) {
+		fprintf(log, detach ? "gdb: detached\n" : "gdb: connection closed\n");
+	}
+	return true;
+}
+
+bool GdbStub::read_packet(std::string& packet) {
+	for (;;) {
+		char c;
+		do {
+			// Acks and Ctrl-C while stopped come outside of packets
+			if (recv(connection, &c, 1, 0) != 1) {
+				return false;
+			}
+		} while (c != '$');
+
+		packet.clear();
+		uint8_t sum = 0;
+		while (recv(connection, &c, 1, 0) == 1) {
+			if (c == '#') {
+				break;
+			}
+			packet += c;
+			sum = (uint8_t)(sum + c);
+		}
+		char check[2];
+		if (recv(connection, &check[0], 1, 0) != 1 || recv(connection, &check[1], 1, 0) != 1) {
+			return false;
+		}
+		bool good = hex_digit(check[0]) >= 0 && hex_digit(check[1]) >= 0 && (uint8_t)(hex_digit(check[0]) * 16 + hex_digit(check[1])) == sum;
+		if (no_ack) {
+			return true;
+		}
+		char ack = good ? '+' : '-';
+		send(connection, &ack, 1, 0);
+		if (good) {
+			return true;
+		}
+	}
+}
+
+bool GdbStub::send_packet(const std::string& data) {
+	uint8_t sum = 0;
+	for (char c : data) {
+		sum = (uint8_t)(sum + c);
+	}
+	std::string framed = "$" + data + "#";
+	framed += HEX[sum >> 4];
+	framed += HEX[sum & 0xF];
+	for (int attempt = 0; attempt < 8; attempt++) {
+		if (send(connection, framed.data(), (int)framed.size(), 0) != (int)framed.size()) {
+			return false;
+		}
+		if (no_ack) {
+			return true;
+		}
+		char c;
+		do {
+			if (recv(connection, &c, 1, 0) != 1) {
+				return false;
+			}
+		} while (c != '+' && c != '-');
+		if (c == '+') {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool GdbStub::interrupted() {
+	fd_set readable;
+	FD_ZERO(&readable);
+	FD_SET(connection, &readable);
+	timeval now = {};
+	if (select((int)connection + 1, &readable, nullptr, nullptr, &now) <= 0) {
+		return false;
+	}
+	char c;
+	// A closed connection stops the program too, the next read ends the session
+	return recv(connection, &c, 1, 0) != 1 || c == 0x03;
+}
+
+std::string GdbStub::stop_reply(const DebugStop& stop) {
+	char reply[32];
+	switch (stop.event) {
+	case DEBUG_BREAKPOINT:
+		return "T05swbreak:;";
+	case DEBUG_WATCHPOINT:
+		snprintf(reply, sizeof(reply), "T05%s:%04x;", stop.kind == WATCH_READ ? "rwatch" : "watch", stop.address);
+		return reply;
+	case DEBUG_HALTED:
+		return "W00";
+	default:
+		return "S05";
+	}
+}
+
+std::string GdbStub::run(bool single_step) {
+	DebugStop stop;
+	if (single_step) {
+		stop = debugger.step();
+	}
+	else {
+		for (;;) {
+			stop = debugger.resume(SLICE);
+			if (stop.event != DEBUG_NONE) {
+				break;
+			}
+			if (interrupted()) {
+				return "S02";
+			}
+		}
+	}
+	return stop_reply(stop);
+}
+
+std::string GdbStub::handle(const std::string& packet, bool& done) {
+	size_t pos = 1;
+	uint32_t a, b;
+	std::string reply;
+	char kind = packet.empty() ? 0 : packet[0];
+
+	switch (kind) {
+	case '?':
+		return last_stop;
+
+	case 'g':
+		for (int r = 0; r < R_COUNT; r++) {
+			put_word(reply, vm.reg[r]);
+		}
+		return reply;
+
+	case 'G':
+		for (int r = 0; r < R_COUNT; r++) {
+			if (!get_word(packet, pos, vm.reg[r])) {
+				return "E01";
+			}
+		}
+		return "OK";
+
+	case 'p':
+		if (!get_hex(packet, pos, a) || a >= R_COUNT) {
+			return "E01";
+		}
+		put_word(reply, vm.reg[a]);
+		return reply;
+
+	case 'P':
+	{
+		uint16_t value;
+		if (!get_hex(packet, pos, a) || a >= R_COUNT || !expect(packet, pos, '=') || !get_word(packet, pos, value)) {
+			return "E01";
+		}
+		vm.reg[a] = value;
+		return "OK";
+	}
+
+	case 'm':
+		// Memory as the program sees it, without running device hooks
+		if (!get_hex(packet, pos, a) || !expect(packet, pos, ',') || !get_hex(packet, pos, b) || !in_memory(a, b)) {
+			return "E01";
+		}
+		for (uint32_t i = 0; i < b; i++) {
+			put_word(reply, vm.memory[a + i]);
+		}
+		return reply;
+
+	case 'M':
+		if (!get_hex(packet, pos, a) || !expect(packet, pos, ',') || !get_hex(packet, pos, b) || !in_memory(a, b) || !expect(packet, pos, ':')) {
+			return "E01";
+		}
+		for (uint32_t i = 0; i < b; i++) {
+			uint16_t word;
+			if (!get_word(packet, pos, word)) {
+				return "E01";
+			}
+			// Through ram_write so the decoded and compiled copies see the change
+			vm.ram_write((uint16_t)(a + i), word);
+		}
+		return "OK";
+
+	case 'c':
+	case 's':
+		if (get_hex(packet, pos, a)) {
+			vm.reg[R_PC] = (uint16_t)a;
+		}
+		last_stop = run(kind == 's');
+		done = last_stop == "W00";
+		return last_stop;
+
+	case 'Z':
+	case 'z':
+	{
+		uint32_t type;
+		if (!get_hex(packet, pos, type) || !expect(packet, pos, ',') || !get_hex(packet, pos, a) || a >= MEMORY_MAX
+			|| !expect(packet, pos, ',') || !get_hex(packet, pos, b)) {
+			return "E01";
+		}
+		bool add = kind == 'Z';
+		if (type == 0 || type == 1) {
+			if (add) {
+				debugger.add_breakpoint((uint16_t)a);
+			}
+			else {
+				debugger.remove_breakpoint((uint16_t)a);
+			}
+			return "OK";
+		}
+		if (type > 4) {
+			return "";
+		}
+		WatchKind watch = type == 2 ? WATCH_WRITE : type == 3 ? WATCH_READ : WATCH_ACCESS;
+		// The length counts words, watch every one of them
+		for (uint32_t i = 0; i < (b ? b : 1) && a + i < MEMORY_MAX; i++) {
+			if (add) {
+				debugger.add_watchpoint((uint16_t)(a + i), watch);
+			}
+			else {
+				debugger.remove_watchpoint((uint16_t)(a + i), watch);
+			}
+		}
+		return "OK";
+	}
+
+	case 'k':
+		vm.running = 0;
+		done = true;
+		return "";
+
+	case 'D':
+		detach = true;
+		done = true;
+		return "OK";
+
+	case 'H':
+	case 'T':
+		// One thread, whatever is selected
+		return "OK";
+
+	case 'q':
+		if (packet.compare(0, 10, "qSupported") == 0) {
+			return "PacketSize=1000;swbreak+;hwbreak+;QStartNoAckMode+";
+		}
+		if (packet == "qAttached") {
+			return "1";
+		}
+		if (packet == "qC") {
+			return "QC1";
+		}
+		if (packet == "qfThreadInfo") {
+			return "m1";
+		}
+		if (packet == "qsThreadInfo") {
+			return "l";
+		}
+		if (packet == "qOffsets") {
+			return "Text=0;Data=0;Bss=0";
+		}
+		if (packet.compare(0, 7, "qSymbol") == 0) {
+			return "OK";
+		}
+		return "";
+
+	case 'Q':
+		if (packet == "QStartNoAckMode") {
+			return "OK";
+		}
+		return "";
+
+	default:
+		return "";
+	}
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+
+#include "debug.h"
+
+/*
+A GDB remote serial protocol stub.
+
+GDB (or any client speaking the protocol) connects over TCP and drives the
+machine through a Debugger. The target has a single thread. Memory is
+addressed in 16-bit words, the machine's addressable unit: addresses and
+lengths in m/M packets and Z/z packets count words, and every word is sent as
+four hex digits, most significant first. Registers are sent the same way, in
+the order R0-R7, PC, COND.
+
+Supported: ?, g, G, p, P, m, M, c, s (both with an optional address to resume
+at), Z0/Z1 breakpoints, Z2/Z3/Z4 write/read/access watchpoints, z to remove
+them, k, D, Ctrl-C while running, QStartNoAckMode and the usual queries for
+threads, offsets and symbols.
+*/
+
+namespace LC3VM {
+	class Machine;
+
+	class GdbStub {
+	public:
+		GdbStub(Machine& vm, Debugger& debugger);
+
+		/*
+		Listen on 127.0.0.1:port, accept one connection and serve it until the
+		client detaches or kills the program, or the program halts. The machine
+		should be reset and stopped at its first instruction. Progress is
+		described on log. False if the port could not be opened.
+		*/
+		bool serve(uint16_t port, FILE* log);
+
+		// The client detached rather than killed the program or saw it exit
+		bool detached() const { return detach; }
+
+	private:
+		Machine& vm;
+		Debugger& debugger;
+		intptr_t connection;
+		bool no_ack;
+		bool detach;
+		std::string last_stop;
+
+		bool read_packet(std::string& packet);
+		bool send_packet(const std::string& data);
+		bool interrupted(); // Ctrl-C arrived while running
+
+		std::string stop_reply(const DebugStop& stop);
+		std::string run(bool single_step);
+
+		// The reply to packet, done set when the session is over
+		std::string handle(const std::string& packet, bool& done);
+	};
+}
@@ -0,0 +1,275 @@
+#include "image.h"
+#include "LC3VM.h"
+
+#include <string.h>
+
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+On x86-64 every build carries the AVX2, SSSE3 and SSE2 kernels, whatever the
+compiler targets, and the first call picks the best one the CPU runs. GCC and
+Clang compile each kernel for its own instruction set through the target
+attribute; MSVC compiles intrinsics of any set without flags.
+*/
+#if defined(__x86_64__) || defined(_M_X64)
+#define SWAP_DISPATCH
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define SWAP_TARGET(isa)
+#else
+#define SWAP_TARGET(isa) __attribute__((target(isa)))
+#endif
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#include <arm_neon.h>
+#endif
+
+using namespace LC3VM;
+
+namespace {
+	// Every kernel swaps a prefix of whole vectors and returns how many words that was
+	typedef size_t (*SwapKernel)(uint16_t* dst, const uint16_t* src, size_t count);
+
+#if defined(SWAP_DISPATCH)
+	SWAP_TARGET("avx2") size_t swap_avx2(uint16_t* dst, const uint16_t* src, size_t count) {
+		const __m256i order = _mm256_setr_epi8(
+			1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+			1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+		size_t i = 0;
+		for (; i + 16 <= count; i += 16) {
+			__m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+			_mm256_storeu_si256((__m256i*)(dst + i), _mm256_shuffle_epi8(v, order));
+		}
+		return i;
+	}
+
+	SWAP_TARGET("ssse3") size_t swap_ssse3(uint16_t* dst, const uint16_t* src, size_t count) {
+		const __m128i order = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_shuffle_epi8(v, order));
+		}
+		return i;
+	}
+
+	// Part of x86-64 itself. No byte shuffle before SSSE3, shifting each 16-bit lane both ways does the same.
+	size_t swap_sse2(uint16_t* dst, const uint16_t* src, size_t count) {
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+			v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+			_mm_storeu_si128((__m128i*)(dst + i), v);
+		}
+		return i;
+	}
+
+	SwapKernel pick_kernel() {
+		bool avx2, ssse3;
+#if defined(_MSC_VER) && !defined(__clang__)
+		int info[4];
+		__cpuid(info, 0);
+		int leaves = info[0];
+		__cpuid(info, 1);
+		ssse3 = (info[2] & (1 << 9)) != 0;
+		// AVX2 also needs the OS to save the YMM registers
+		bool ymm = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 6) == 6;
+		avx2 = false;
+		if (ymm && leaves >= 7) {
+			__cpuidex(info, 7, 0);
+			avx2 = (info[1] & (1 << 5)) != 0;
+		}
+#else
+		// May run before the constructors that would initialise the CPU model
+		__builtin_cpu_init();
+		avx2 = __builtin_cpu_supports("avx2");
+		ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+		return avx2 ? swap_avx2 : ssse3 ? swap_ssse3 : swap_sse2;
+	}
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+	size_t swap_neon(uint16_t* dst, const uint16_t* src, size_t count) {
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8) {
+			uint8x16_t v = vld1q_u8((const uint8_t*)(src + i));
+			vst1q_u8((uint8_t*)(dst + i), vrev16q_u8(v));
+		}
+		return i;
+	}
+
+	SwapKernel pick_kernel() {
+		return swap_neon;
+	}
+#else
+	size_t swap_none(uint16_t* dst, const uint16_t* src, size_t count) {
+		return 0;
+	}
+
+	SwapKernel pick_kernel() {
+		return swap_none;
+	}
+#endif
+}
+
+void LC3VM::swap16_buffer(uint16_t* dst, const uint16_t* src, size_t count) {
+	static const SwapKernel kernel = pick_kernel();
+	for (size_t i = kernel(dst, src, count); i < count; i++) {
+		dst[i] = swap16(src[i]);
+	}
+}
+
+MappedFile::MappedFile() : bytes(nullptr), length(0), mapping(nullptr) {}
+
+#if defined(_WIN32)
+
+bool MappedFile::open(const char* path) {
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+		// Empty files cannot be mapped, they are still opened successfully
+		CloseHandle(file);
+		return size.QuadPart == 0;
+	}
+	HANDLE m = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file); // The mapping keeps the file open
+	if (!m) {
+		return false;
+	}
+	const void* view = MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+	if (!view) {
+		CloseHandle(m);
+		return false;
+	}
+	bytes = (const uint8_t*)view;
+	length = (size_t)size.QuadPart;
+	mapping = m;
+	return true;
+}
+
+MappedFile::~MappedFile() {
+	if (bytes) {
+		UnmapViewOfFile(bytes);
+		CloseHandle((HANDLE)mapping);
+	}
+}
+
+#else
+
+bool MappedFile::open(const char* path) {
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return false;
+	}
+	if (st.st_size == 0) {
+		// mmap of an empty file fails, there is nothing to map anyway
+		close(fd);
+		return true;
+	}
+	void* view = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // The mapping keeps the file open
+	if (view == MAP_FAILED) {
+		return false;
+	}
+	bytes = (const uint8_t*)view;
+	length = (size_t)st.st_size;
+	return true;
+}
+
+MappedFile::~MappedFile() {
+	if (bytes) {
+		munmap((void*)bytes, length);
+	}
+}
+
+#endif
+
+bool LC3VM::image_extent(const uint8_t* data, size_t size, uint16_t& origin, size_t& count) {
+	if (size < 2) {
+		return false;
+	}
+	origin = (uint16_t)((data[0] << 8) | data[1]);
+	count = (size - 2) / 2;
+	if (count > (size_t)(MEMORY_MAX - origin)) {
+		count = MEMORY_MAX - origin;
+	}
+	return true;
+}
+
+std::shared_ptr<const Image> Image::load(const char* path) {
+	MappedFile file;
+	uint16_t origin;
+	size_t count;
+	if (!file.open(path) || !image_extent(file.data(), file.size(), origin, count)) {
+		return nullptr;
+	}
+	std::shared_ptr<Image> image(new Image());
+	image->origin = origin;
+	image->words.resize(count);
+	// Mappings are page aligned, so the words after the origin are aligned too
+	swap16_buffer(image->words.data(), (const uint16_t*)(file.data() + 2), count);
+	return image;
+}
+
+std::shared_ptr<const Image> ImageCache::get(const std::string& path) {
+	std::lock_guard<std::mutex> guard(lock);
+	auto found = images.find(path);
+	if (found != images.end()) {
+		return found->second;
+	}
+	std::shared_ptr<const Image> image = Image::load(path.c_str());
+	if (image) {
+		images[path] = image;
+	}
+	return image;
+}
+
+int Machine::read_image(const char* image_path) {
+	MappedFile file;
+	uint16_t origin;
+	size_t count;
+	if (!file.open(image_path) || !image_extent(file.data(), file.size(), origin, count)) {
+		return 0;
+	}
+	// Swap straight from the mapping into memory, the file contents are never copied as they are
+	swap16_buffer(memory + origin, (const uint16_t*)(file.data() + 2), count);
+	after_load(origin, (uint32_t)count);
+	return 1;
+}
+
+int Machine::read_image_data(const uint8_t* data, size_t size) {
+	uint16_t origin;
+	size_t count;
+	if (!image_extent(data, size, origin, count)) {
+		return 0;
+	}
+	if ((uintptr_t)(data + 2) % alignof(uint16_t) == 0) {
+		swap16_buffer(memory + origin, (const uint16_t*)(data + 2), count);
+	}
+	else {
+		// The caller's buffer may start anywhere, the swap wants whole words
+		memcpy(memory + origin, data + 2, count * sizeof(uint16_t));
+		swap16_buffer(memory + origin, memory + origin, count);
+	}
+	after_load(origin, (uint32_t)count);
+	return 1;
+}
+
+void Machine::load_image(const Image& image) {
+	memcpy(memory + image.origin, image.words.data(), image.words.size() * sizeof(uint16_t));
+	after_load(image.origin, (uint32_t)image.words.size());
+}
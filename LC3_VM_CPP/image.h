@@ -0,0 +1,71 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+Loading .obj images.
+
+An .obj file is a big-endian origin word followed by big-endian program words.
+Files are memory mapped and converted to host order in one pass straight from
+the mapping, with a vectorised byte swap (AVX2, SSSE3 or SSE2 on x86-64, picked
+at run time from what the CPU supports, NEON on ARM).
+
+An Image is a file converted once and kept in host order. It is immutable and
+shared, so any number of machines running the same program load it with a
+plain copy instead of reading and swapping the file again; ImageCache hands out
+one Image per path.
+*/
+
+namespace LC3VM {
+	// Convert count big-endian words at src to host order at dst, dst may equal src
+	void swap16_buffer(uint16_t* dst, const uint16_t* src, size_t count);
+
+	// A read-only view of a whole file
+	class MappedFile {
+	public:
+		MappedFile();
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		bool open(const char* path);
+		const uint8_t* data() const { return bytes; }
+		size_t size() const { return length; }
+
+	private:
+		const uint8_t* bytes;
+		size_t length;
+		void* mapping; // Mapping handle on Windows, unused elsewhere
+	};
+
+	/*
+	Where the .obj contents in data[0, size) go: the origin, and how many words
+	fit between it and the end of memory. False if there is no origin word.
+	*/
+	bool image_extent(const uint8_t* data, size_t size, uint16_t& origin, size_t& count);
+
+	class Image {
+	public:
+		// nullptr if the file cannot be read or has no origin
+		static std::shared_ptr<const Image> load(const char* path);
+
+		uint16_t origin;
+		std::vector<uint16_t> words; // Host order, placed at memory[origin]
+	};
+
+	// Images by path, each file is only loaded once. Safe to use from several threads.
+	class ImageCache {
+	public:
+		std::shared_ptr<const Image> get(const std::string& path);
+
+	private:
+		std::mutex lock;
+		std::unordered_map<std::string, std::shared_ptr<const Image>> images;
+	};
+}
@@ -0,0 +1,143 @@
+#include "input.h"
+
+#include <fstream>
+#include <sstream>
+#include <stdlib.h>
+
+namespace {
+	const uint64_t WAIT = UINT64_MAX; // Due time of a key that went to a blocking read
+}
+
+BufferInput::BufferInput(const std::string& keys) : keys(keys), next(0) {}
+
+bool BufferInput::load_file(const char* path) {
+	std::ifstream file(path, std::ios::binary);
+	if (!file) {
+		return false;
+	}
+	std::ostringstream ss;
+	ss << file.rdbuf();
+	keys = ss.str();
+	next = 0;
+	return true;
+}
+
+bool BufferInput::poll(uint16_t& key) {
+	if (next == keys.size()) {
+		return false;
+	}
+	key = (uint8_t)keys[next++];
+	return true;
+}
+
+uint16_t BufferInput::wait() {
+	uint16_t key;
+	return poll(key) ? key : (uint16_t)EOF;
+}
+
+ReplayInput::ReplayInput() : now(0) {}
+
+bool ReplayInput::load_file(const char* path) {
+	FILE* log = fopen(path, "r");
+	if (!log) {
+		return false;
+	}
+	bool ok = load(log);
+	fclose(log);
+	return ok;
+}
+
+bool ReplayInput::load(FILE* log) {
+	events.clear();
+	char when[32];
+	unsigned key;
+	int fields;
+	while ((fields = fscanf(log, "%31s %u", when, &key)) == 2) {
+		Event e;
+		e.key = (uint16_t)key;
+		if (std::string(when) == "wait") {
+			e.due = WAIT;
+		}
+		else {
+			char* end;
+			e.due = strtoull(when, &end, 10);
+			if (*end) {
+				return false;
+			}
+		}
+		events.push_back(e);
+	}
+	return fields == EOF;
+}
+
+bool ReplayInput::poll(uint16_t& key) {
+	if (events.empty() || events.front().due == WAIT || events.front().due > now) {
+		return false;
+	}
+	key = events.front().key;
+	events.pop_front();
+	return true;
+}
+
+uint16_t ReplayInput::wait() {
+	if (events.empty()) {
+		return (uint16_t)EOF;
+	}
+	uint16_t key = events.front().key;
+	events.pop_front();
+	return key;
+}
+
+void ReplayInput::advance(uint64_t instructions) {
+	now = instructions;
+}
+
+uint64_t ReplayInput::next_event() const {
+	if (events.empty() || events.front().due == WAIT) {
+		return UINT64_MAX;
+	}
+	return events.front().due;
+}
+
+RecordingInput::RecordingInput(InputSource& source, FILE* log) : source(source), log(log), now(0) {}
+
+bool RecordingInput::poll(uint16_t& key) {
+	if (visible.empty()) {
+		return false;
+	}
+	key = visible.front();
+	visible.pop_front();
+	return true;
+}
+
+uint16_t RecordingInput::wait() {
+	uint16_t key;
+	if (poll(key)) {
+		return key;
+	}
+	key = source.wait();
+	if (key != (uint16_t)EOF) {
+		fprintf(log, "wait %u\n", key);
+	}
+	return key;
+}
+
+bool RecordingInput::ready() const {
+	return !visible.empty() || source.ready();
+}
+
+void RecordingInput::wait_ready() {
+	if (visible.empty()) {
+		source.wait_ready();
+	}
+}
+
+void RecordingInput::advance(uint64_t instructions) {
+	// Keys only become visible here, between slices, so the log can say exactly when
+	now = instructions;
+	uint16_t key;
+	while (source.poll(key)) {
+		visible.push_back(key);
+		fprintf(log, "%llu %u\n", (unsigned long long)now, key);
+	}
+}
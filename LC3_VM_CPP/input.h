@@ -0,0 +1,106 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <deque>
+#include <string>
+
+/*
+Keyboard input sources.
+
+A machine reads keys through an InputSource: KBSR polling calls poll(), the
+GETC and IN traps call wait(). Besides the live console (KeyBuffer, see
+keyboard.h) there are sources that never touch the console:
+
+	BufferInput		keys from memory or a file, available immediately
+	ReplayInput		keys that become visible at recorded instruction counts
+	RecordingInput	wraps another source and logs what the program saw
+
+Time for the replay log is the machine's retired instruction count. run_slice()
+ends a slice exactly at next_event() and then calls advance(), so a replayed key
+reaches KBSR at the same instruction it did when it was recorded, whatever core
+runs the program. A blocking read that finds nothing visible takes the next key
+straight away: the program would have waited for it anyway.
+
+Replay log format, one key per line:
+	<instruction count> <key code>	key visible to polling from that point on
+	wait <key code>					key delivered to a blocking read
+*/
+
+class InputSource {
+public:
+	virtual ~InputSource() {}
+
+	// A key that is available right now, without waiting
+	virtual bool poll(uint16_t& key) = 0;
+
+	// The next key, waiting for it if need be. (uint16_t)EOF once the input has ended.
+	virtual uint16_t wait() = 0;
+
+	// True if wait() would return straight away, with a key or EOF
+	virtual bool ready() const { return true; }
+
+	// Block until ready(), used while the program idles in a loop that only a key can end
+	virtual void wait_ready() {}
+
+	// The machine has retired this many instructions in total
+	virtual void advance(uint64_t instructions) {}
+
+	// Instruction count at which poll() may start returning a new key, UINT64_MAX if that is not tied to execution
+	virtual uint64_t next_event() const { return UINT64_MAX; }
+};
+
+class BufferInput : public InputSource {
+public:
+	explicit BufferInput(const std::string& keys = "");
+
+	// False if the file cannot be read
+	bool load_file(const char* path);
+
+	bool poll(uint16_t& key) override;
+	uint16_t wait() override;
+
+private:
+	std::string keys;
+	size_t next;
+};
+
+class ReplayInput : public InputSource {
+public:
+	ReplayInput();
+
+	// False if the log cannot be read or is malformed
+	bool load_file(const char* path);
+	bool load(FILE* log);
+
+	bool poll(uint16_t& key) override;
+	uint16_t wait() override;
+	void advance(uint64_t instructions) override;
+	uint64_t next_event() const override;
+
+private:
+	struct Event {
+		uint64_t due; // WAIT for keys that went to a blocking read
+		uint16_t key;
+	};
+
+	std::deque<Event> events;
+	uint64_t now;
+};
+
+class RecordingInput : public InputSource {
+public:
+	// Keys come from source and every key the program sees is written to log
+	RecordingInput(InputSource& source, FILE* log);
+
+	bool poll(uint16_t& key) override;
+	uint16_t wait() override;
+	bool ready() const override;
+	void wait_ready() override;
+	void advance(uint64_t instructions) override;
+
+private:
+	InputSource& source;
+	FILE* log;
+	uint64_t now;
+	std::deque<uint16_t> visible; // Keys taken from source at the last advance(), already logged
+};
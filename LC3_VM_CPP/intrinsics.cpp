@@ -0,0 +1,191 @@
+#include "intrinsics.h"
+#include "LC3VM.h"
+#include "ops.h"
+
+#include <string.h>
+
+using namespace LC3VM;
+
+namespace {
+	// A verified routine that runs longer than this is taken not to return
+	const uint32_t VERIFY_LIMIT = 1u << 24;
+
+	const uint16_t FLAGS_SCRATCH = 1 << R_COND;
+
+	void native_mul(Machine& vm) {
+		vm.reg[R_R0] = (uint16_t)(vm.reg[R_R1] * vm.reg[R_R2]);
+	}
+
+	void native_div(Machine& vm) {
+		uint16_t divisor = vm.reg[R_R2];
+		if (divisor == 0) {
+			vm.reg[R_R0] = 0;
+			return;
+		}
+		uint16_t dividend = vm.reg[R_R1];
+		vm.reg[R_R0] = dividend / divisor;
+		vm.reg[R_R1] = dividend % divisor;
+	}
+
+	void native_memset(Machine& vm) {
+		for (uint16_t i = 0; i < vm.reg[R_R2]; i++) {
+			vm.mem_write((uint16_t)(vm.reg[R_R0] + i), vm.reg[R_R1]);
+		}
+	}
+
+	void native_memcpy(Machine& vm) {
+		for (uint16_t i = 0; i < vm.reg[R_R2]; i++) {
+			vm.mem_write((uint16_t)(vm.reg[R_R0] + i), vm.mem_read((uint16_t)(vm.reg[R_R1] + i)));
+		}
+	}
+
+	void native_strcpy(Machine& vm) {
+		for (uint32_t i = 0; i < MEMORY_MAX; i++) {
+			uint16_t c = vm.mem_read((uint16_t)(vm.reg[R_R1] + i));
+			vm.mem_write((uint16_t)(vm.reg[R_R0] + i), c);
+			if (!c) {
+				break;
+			}
+		}
+	}
+
+	struct Builtin {
+		const char* name;
+		NativeRoutine routine;
+	};
+
+	const Builtin BUILTINS[] = {
+		{ "mul", native_mul },
+		{ "div", native_div },
+		{ "memset", native_memset },
+		{ "memcpy", native_memcpy },
+		{ "strcpy", native_strcpy },
+	};
+}
+
+Intrinsics::Intrinsics() : verify(false), verify_log(stderr), calls(0), mismatches(0), by_address(MEMORY_MAX), by_vector() {}
+
+void Intrinsics::add(uint16_t address, const Intrinsic& native) {
+	if (by_address[address]) {
+		routines[by_address[address] - 1] = native;
+		return;
+	}
+	routines.push_back(native);
+	by_address[address] = (uint16_t)routines.size();
+}
+
+void Intrinsics::add_trap(uint8_t vector, const Intrinsic& native) {
+	if (by_vector[vector]) {
+		routines[by_vector[vector] - 1] = native;
+		return;
+	}
+	routines.push_back(native);
+	by_vector[vector] = (uint16_t)routines.size();
+}
+
+bool Intrinsics::builtin(const std::string& name, Intrinsic& native) {
+	for (const Builtin& b : BUILTINS) {
+		if (name == b.name) {
+			native.name = b.name;
+			native.routine = b.routine;
+			native.scratch = FLAGS_SCRATCH;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char* Intrinsics::builtin_names() {
+	return "mul|div|memset|memcpy|strcpy";
+}
+
+void Machine::attach_intrinsics(Intrinsics* table) {
+	intrinsics = table;
+	// Calls are decoded and compiled differently with a table attached
+	if (jit) {
+		jit->flush();
+	}
+	if (decoded) {
+		decode_range(0, MEMORY_MAX);
+	}
+}
+
+void Machine::call_native(const Intrinsic& native, uint16_t entry) {
+	Intrinsics& table = *intrinsics;
+	table.calls.fetch_add(1, std::memory_order_relaxed);
+	uint16_t ret = reg[R_R7];
+
+	if (!table.verify || entry == 0) {
+		native.routine(*this);
+		reg[R_PC] = ret;
+		return;
+	}
+
+	std::vector<uint16_t> entry_memory(memory, memory + MEMORY_MAX);
+	uint16_t entry_reg[R_COUNT];
+	memcpy(entry_reg, reg, sizeof(reg));
+	uint16_t entry_flags = flag_value;
+
+	native.routine(*this);
+	reg[R_PC] = ret;
+	std::vector<uint16_t> native_memory(memory, memory + MEMORY_MAX);
+	uint16_t native_reg[R_COUNT];
+	memcpy(native_reg, reg, sizeof(reg));
+	uint16_t native_flags = flags_of(flag_value);
+
+	// Back to the entry state, through ram_write so the caches see the old words again
+	for (int address = 0; address < MEMORY_MAX; address++) {
+		if (memory[address] != entry_memory[address]) {
+			ram_write((uint16_t)address, entry_memory[address]);
+		}
+	}
+	memcpy(reg, entry_reg, sizeof(reg));
+	flag_value = entry_flags;
+
+	// Interpret the routine itself, with every call inside it interpreted too
+	// The native routine took no interrupts, neither does the interpreted one
+	reg[R_PC] = entry;
+	intrinsics = nullptr;
+	uint8_t pending = interrupt_pending;
+	uint16_t kbsr = memory[MR_KBSR];
+	memory[MR_KBSR] &= (uint16_t)~KBSR_IE;
+	uint32_t steps = 0;
+	while (running && reg[R_PC] != ret && steps < VERIFY_LIMIT) {
+		switch_op(memory[reg[R_PC]++]);
+		steps++;
+	}
+	memory[MR_KBSR] = (uint16_t)((memory[MR_KBSR] & ~KBSR_IE) | (kbsr & KBSR_IE));
+	interrupt_pending |= pending;
+	intrinsics = &table;
+
+	char what[96] = "";
+	if (!running || reg[R_PC] != ret) {
+		snprintf(what, sizeof(what), "did not return to x%04X", ret);
+	}
+	for (int r = 0; !what[0] && r < R_COUNT; r++) {
+		if (native.scratch & (1 << r)) {
+			continue;
+		}
+		if (r == R_COND) {
+			if (native_flags != flags_of(flag_value)) {
+				snprintf(what, sizeof(what), "condition codes are %d, interpreted %d", native_flags, flags_of(flag_value));
+			}
+		}
+		else if (native_reg[r] != reg[r]) {
+			snprintf(what, sizeof(what), "R%d is x%04X, interpreted x%04X", r, native_reg[r], reg[r]);
+		}
+	}
+	for (int address = 0; !what[0] && address < MEMORY_MAX; address++) {
+		if (native_memory[address] != memory[address]) {
+			snprintf(what, sizeof(what), "memory[x%04X] is x%04X, interpreted x%04X", address, native_memory[address], memory[address]);
+		}
+	}
+
+	if (what[0]) {
+		// The interpreted result stands
+		table.mismatches.fetch_add(1, std::memory_order_relaxed);
+		if (table.verify_log) {
+			fprintf(table.verify_log, "native %s at x%04X: %s\n", native.name.c_str(), entry, what);
+		}
+	}
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+/*
+Native intrinsics: host implementations of LC-3 subroutines.
+
+A routine is registered either by the address it is called at, in which case a
+JSR or JSRR to that address runs the native routine instead of the call and the
+routine returns at once, or by a trap vector that op_trap has no built-in
+handler for. Either way the native routine sees the machine as the LC-3 routine
+would on entry (R7 already holds the return address) and must leave registers
+and memory as the routine would on return, writing memory through mem_write.
+The whole call retires as the one JSR or TRAP instruction.
+
+Inside a core the condition codes live in flag_value, so a routine that
+defines them sets them with update_flags(). Registers the routine may leave in
+any state, the condition codes usually among them, are listed in its scratch
+mask and are not compared when verifying.
+
+With verify set every call is checked: the native routine runs, then the
+machine is put back and the routine is interpreted from its entry point until
+it returns (the instructions are not counted). If registers or memory differ
+the mismatch is logged and the machine keeps the interpreted result. The
+routine at a trap vector's entry in the trap vector table is the reference for
+trap intrinsics. Routines that do console I/O cannot be verified this way.
+*/
+
+namespace LC3VM {
+	class Machine;
+
+	typedef void (*NativeRoutine)(Machine& vm);
+
+	struct Intrinsic {
+		std::string name;
+		NativeRoutine routine;
+		uint16_t scratch; // 1 << R_x for every register left unspecified, R_COND included
+	};
+
+	class Intrinsics {
+	public:
+		Intrinsics();
+
+		// JSR/JSRR to address runs native
+		void add(uint16_t address, const Intrinsic& native);
+
+		// TRAP vector runs native, vectors with a built-in handler are never looked up
+		void add_trap(uint8_t vector, const Intrinsic& native);
+
+		const Intrinsic* at(uint16_t address) const {
+			return by_address[address] ? &routines[by_address[address] - 1] : nullptr;
+		}
+
+		const Intrinsic* trap(uint8_t vector) const {
+			return by_vector[vector] ? &routines[by_vector[vector] - 1] : nullptr;
+		}
+
+		/*
+		Stock routines, looked up by name. Arguments and results are in registers,
+		all other registers are preserved and the condition codes are scratch:
+			mul		R0 = R1 * R2 (low 16 bits)
+			div		R0 = R1 / R2, R1 = R1 % R2, unsigned; if R2 is 0, R0 = 0 and R1 is kept
+			memset	memory[R0, R0 + R2) = R1
+			memcpy	memory[R0, R0 + R2) = memory[R1, R1 + R2), one word at a time upwards
+			strcpy	copies the zero terminated string at R1 to R0, terminator included
+		*/
+		static bool builtin(const std::string& name, Intrinsic& native);
+		static const char* builtin_names(); // "mul|div|..." for usage text
+
+		bool verify;
+		FILE* verify_log; // Where mismatches are described, stderr by default, nullptr to only count them
+
+		std::atomic<uint64_t> calls;
+		std::atomic<uint64_t> mismatches;
+
+	private:
+		std::vector<Intrinsic> routines;
+		std::vector<uint16_t> by_address; // Index into routines plus one, 0 for none
+		uint16_t by_vector[256];
+	};
+}
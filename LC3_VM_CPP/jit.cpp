@@ -0,0 +1,579 @@
+#include "jit.h"
+#include "LC3VM.h"
+#include "ops.h"
+
+#include <string.h>
+#include <algorithm>
+
+#if defined(_WIN32)
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define LC3VM_JIT_X64 1
+#endif
+
+using namespace LC3VM;
+
+namespace {
+	const uint16_t HOT_THRESHOLD = 50; // Interpreted executions before a block is compiled
+	const uint16_t NEVER = 0xFFFF; // Counter value for start addresses that cannot be compiled
+	const uint32_t MAX_BLOCK = 64; // Instructions per block
+	const size_t CODE_SIZE = 4 << 20; // Bytes of executable memory per machine
+	const size_t MAX_BLOCK_BYTES = MAX_BLOCK * 160 + 64; // Upper bound on the code one block needs
+
+	// What compiled code sees, the offsets are baked into the generated instructions
+	struct JitContext {
+		uint32_t budget; // Instructions left, blocks subtract their length on entry
+		uint32_t unused;
+		uint16_t* reg; // +8
+		uint16_t* memory; // +16
+		DecodedOp* decoded; // +24
+		const uint8_t* covered; // +32
+		uint16_t* flag_value; // +40, the machine's lazily evaluated condition codes
+		const uint8_t* io_pages; // +48, non-zero for pages that go through the device hooks
+		uint8_t* dirty_pages; // +56, the machine's copy-on-write dirty flags
+	};
+	static_assert(offsetof(JitContext, reg) == 8, "JitContext layout");
+	static_assert(offsetof(JitContext, covered) == 32, "JitContext layout");
+	static_assert(offsetof(JitContext, flag_value) == 40, "JitContext layout");
+	static_assert(offsetof(JitContext, io_pages) == 48, "JitContext layout");
+	static_assert(offsetof(JitContext, dirty_pages) == 56, "JitContext layout");
+	static_assert(sizeof(DecodedOp) == 8 && offsetof(DecodedOp, handler) == 0, "DecodedOp layout");
+
+	typedef void (*NativeBlock)(JitContext* ctx);
+}
+
+struct Jit::Block {
+	uint16_t start;
+	uint16_t length; // Instructions, all at increasing addresses from start
+	uint8_t* entry; // Called from C++, loads the pinned registers
+	uint8_t* body; // Target for chained jumps from other blocks
+};
+
+struct Jit::Exit {
+	Block* owner;
+	uint8_t* site; // rel32 of the jmp, 0 falls through to a ret
+	uint16_t target;
+};
+
+#if defined(LC3VM_JIT_X64)
+
+namespace {
+	/*
+	Register assignment inside compiled code. Only registers that are volatile in
+	both the System V and Windows x64 conventions are used, so blocks need no
+	prologue beyond loading the pinned pointers, and they never call out.
+		r8  = reg
+		r9  = memory
+		r10 = decoded
+		r11 = JitContext
+		eax, ecx, edx = scratch
+	*/
+	enum { EAX = 0, ECX = 1 };
+
+	void patch(uint8_t* site, const uint8_t* target) {
+		int32_t rel = target ? (int32_t)(target - (site + 4)) : 0;
+		memcpy(site, &rel, sizeof(rel));
+	}
+
+	class Emitter {
+	public:
+		explicit Emitter(uint8_t* p) : p(p) {}
+		uint8_t* p;
+
+		void b(uint8_t x) { *p++ = x; }
+		void w(uint16_t x) { memcpy(p, &x, 2); p += 2; }
+		void d(uint32_t x) { memcpy(p, &x, 4); p += 4; }
+
+		// Emit a zero rel32 and return where it is so it can be patched later
+		uint8_t* rel32() { uint8_t* site = p; d(0); return site; }
+
+		void prologue() {
+#if defined(_WIN32)
+			b(0x49); b(0x89); b(0xCB); // mov r11, rcx
+#else
+			b(0x49); b(0x89); b(0xFB); // mov r11, rdi
+#endif
+			b(0x4D); b(0x8B); b(0x43); b(0x08); // mov r8, [r11+8]
+			b(0x4D); b(0x8B); b(0x4B); b(0x10); // mov r9, [r11+16]
+			b(0x4D); b(0x8B); b(0x53); b(0x18); // mov r10, [r11+24]
+		}
+
+		// x = reg[r] (zero extended)
+		void load_reg(int x, int r) { b(0x41); b(0x0F); b(0xB7); b((uint8_t)(0x40 | x << 3)); b((uint8_t)(2 * r)); }
+		// reg[r] = x
+		void store_reg(int r, int x) { b(0x66); b(0x41); b(0x89); b((uint8_t)(0x40 | x << 3)); b((uint8_t)(2 * r)); }
+		// reg[r] = value
+		void store_reg_imm(int r, uint16_t value) { b(0x66); b(0x41); b(0xC7); b(0x40); b((uint8_t)(2 * r)); w(value); }
+
+		void mov_eax(uint32_t value) { b(0xB8); d(value); }
+		void add_ax_cx() { b(0x66); b(0x01); b(0xC8); }
+		void and_ax_cx() { b(0x66); b(0x21); b(0xC8); }
+		void add_ax(uint16_t value) { b(0x66); b(0x05); w(value); }
+		void and_ax(uint16_t value) { b(0x66); b(0x25); w(value); }
+		void not_ax() { b(0x66); b(0xF7); b(0xD0); }
+		void zero_extend_ax() { b(0x0F); b(0xB7); b(0xC0); }
+
+		// eax = memory[rax]
+		void load_mem() { b(0x41); b(0x0F); b(0xB7); b(0x04); b(0x41); }
+
+		// Jump to a side exit if ax is in an I/O page, returns the patch site
+		uint8_t* io_check() {
+			b(0x0F); b(0xB6); b(0xCC); // movzx ecx, ah
+			b(0x49); b(0x8B); b(0x53); b(0x30); // mov rdx, [r11+48]
+			b(0x80); b(0x3C); b(0x0A); b(0x00); // cmp byte [rdx+rcx], 0
+			b(0x0F); b(0x85); return rel32(); // jne
+		}
+
+		/*
+		memory[ax] = reg[sr], leaving through a side exit first if ax is in an I/O
+		page or inside a compiled block. Also marks the decoded entry stale and the
+		page dirty, like ram_write. Returns the two patch sites.
+		*/
+		void store_mem(int sr, uint8_t*& io_site, uint8_t*& code_site) {
+			zero_extend_ax();
+			io_site = io_check();
+			b(0x49); b(0x8B); b(0x53); b(0x20); // mov rdx, [r11+32]
+			b(0x80); b(0x3C); b(0x02); b(0x00); // cmp byte [rdx+rax], 0
+			b(0x0F); b(0x85); code_site = rel32(); // jne
+			load_reg(ECX, sr);
+			b(0x66); b(0x41); b(0x89); b(0x0C); b(0x41); // mov [r9+rax*2], cx
+			b(0x41); b(0xC6); b(0x04); b(0xC2); b(H_UNDECODED); // mov byte [r10+rax*8], 0
+			b(0x0F); b(0xB6); b(0xCC); // movzx ecx, ah
+			b(0x49); b(0x8B); b(0x53); b(0x38); // mov rdx, [r11+56]
+			b(0xC6); b(0x04); b(0x0A); b(0x01); // mov byte [rdx+rcx], 1
+		}
+
+		// flag_value = ax, what update_flags does
+		void store_flag_value() {
+			b(0x49); b(0x8B); b(0x53); b(0x28); // mov rdx, [r11+40]
+			b(0x66); b(0x89); b(0x02); // mov [rdx], ax
+		}
+
+		// ax = flag_value
+		void load_flag_value() {
+			b(0x49); b(0x8B); b(0x53); b(0x28); // mov rdx, [r11+40]
+			b(0x0F); b(0xB7); b(0x02); // movzx eax, word [rdx]
+		}
+
+		void budget_cmp(uint32_t n) { b(0x41); b(0x81); b(0x3B); d(n); } // cmp dword [r11], n
+		void budget_sub(uint32_t n) { b(0x41); b(0x81); b(0x2B); d(n); } // sub dword [r11], n
+		void budget_add(uint32_t n) { b(0x41); b(0x81); b(0x03); d(n); } // add dword [r11], n
+
+		/*
+		Branch if the condition codes of the value in ax intersect the nzp mask of
+		a BR (mask is neither 0 nor 7), returns the patch site.
+		*/
+		uint8_t* jump_if_cond(uint8_t mask) {
+			static const uint8_t jcc[8] = {
+				0, 0x8F, 0x84, 0x89, // -, p: jg, z: jz, zp: jns
+				0x88, 0x85, 0x8E, 0, // n: js, np: jnz, nz: jle, -
+			};
+			b(0x66); b(0x85); b(0xC0); // test ax, ax
+			b(0x0F); b(jcc[mask]); return rel32();
+		}
+
+		void ret() { b(0xC3); }
+	};
+}
+
+Jit::Jit(Machine& vm)
+	: vm(vm), code(nullptr), code_size(0), code_used(0), compile_count(0),
+	blocks_by_pc(MEMORY_MAX), counters(MEMORY_MAX), covered(MEMORY_MAX) {
+	// Compiled stores write the decoded cache, so it has to exist first
+	if (!vm.decoded) {
+		vm.decode_range(0, 0);
+	}
+
+	// Blocks are patched in place when they are chained, so the buffer is writable and executable
+#if defined(_WIN32)
+	void* p = VirtualAlloc(nullptr, CODE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+	if (p) { code = (uint8_t*)p; }
+#else
+	void* p = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p != MAP_FAILED) { code = (uint8_t*)p; }
+#endif
+	if (code) {
+		code_size = CODE_SIZE;
+	}
+}
+
+Jit::~Jit() {
+	flush();
+	if (code) {
+#if defined(_WIN32)
+		VirtualFree(code, 0, MEM_RELEASE);
+#else
+		munmap(code, code_size);
+#endif
+	}
+}
+
+bool Jit::available() const {
+	return code != nullptr;
+}
+
+uint32_t Jit::run(uint32_t count) {
+	if (!code) {
+		return vm.run_predecoded(count);
+	}
+
+	JitContext ctx;
+	ctx.unused = 0;
+	ctx.reg = vm.reg;
+	ctx.memory = vm.memory;
+	ctx.decoded = vm.decoded.get();
+	ctx.covered = covered.data();
+	ctx.flag_value = &vm.flag_value;
+	ctx.io_pages = vm.io.pages();
+	ctx.dirty_pages = vm.dirty_pages;
+
+	uint32_t executed = 0;
+	vm.load_flags();
+	while (vm.running && executed < count) {
+		uint16_t pc = vm.reg[R_PC];
+		Block* block = blocks_by_pc[pc];
+		if (!block && counters[pc] != NEVER && ++counters[pc] >= HOT_THRESHOLD) {
+			block = compile(pc);
+		}
+
+		// Compiled code never takes interrupts, the interpreter does at the end of the block
+		if (block && !vm.interrupt_pending) {
+			ctx.budget = count - executed;
+			((NativeBlock)block->entry)(&ctx);
+			uint32_t ran = (count - executed) - ctx.budget;
+			executed += ran;
+			if (ran) {
+				continue;
+			}
+			// Not enough budget for the block, or it left before its first instruction
+		}
+		executed += vm.run_predecoded_block(count - executed);
+	}
+	vm.store_flags();
+	return executed;
+}
+
+Jit::Block* Jit::compile(uint16_t start) {
+	// Find the extent of the block first, stopping before anything that has to be interpreted
+	uint32_t length = 0;
+	bool terminated = false;
+	while (length < MAX_BLOCK && !terminated) {
+		uint32_t address = (uint32_t)start + length;
+		if (address >= MMIO_BASE) {
+			break;
+		}
+		uint16_t instr = vm.memory[address];
+		uint16_t npc = (uint16_t)(address + 1);
+		uint16_t op = instr >> 12;
+		if (op == OP_TRAP || op == OP_RTI || op == OP_RES) {
+			break;
+		}
+		// So are calls that may reach a native routine
+		if (op == OP_JSR && vm.intrinsics && (!((instr >> 11) & 1) || vm.intrinsics->at(npc + sign_extend(instr & 0x7FF, 11)))) {
+			break;
+		}
+		// Accesses to a known I/O address are left to mem_read/mem_write
+		if (op == OP_LD || op == OP_LDI || op == OP_ST || op == OP_STI) {
+			uint16_t target = npc + sign_extend(instr & 0x1FF, 9);
+			if (vm.io.is_io(target)) {
+				break;
+			}
+		}
+		// A branch to itself is left to the interpreter, which can tell when it is an idle loop
+		if (op == OP_BR && (instr & 0x1FF) == 0x1FF) {
+			break;
+		}
+		terminated = op == OP_BR || op == OP_JMP || op == OP_JSR;
+		length++;
+	}
+	if (length == 0) {
+		counters[start] = NEVER;
+		return nullptr;
+	}
+	for (uint32_t i = 0; i < length; i++) {
+		if (covered[start + i] == 0xFF) {
+			counters[start] = NEVER;
+			return nullptr;
+		}
+	}
+
+	if (code_size - code_used < MAX_BLOCK_BYTES) {
+		flush();
+	}
+
+	Block* block = new Block();
+	block->start = start;
+	block->length = (uint16_t)length;
+
+	struct SideExit {
+		uint8_t* site;
+		uint16_t pc; // Instruction that has to be interpreted
+		uint32_t refund; // Instructions of the block that did not run
+		int flag_reg; // Register whose value the flags have to reflect, -1 if none
+	};
+	std::vector<SideExit> side_exits;
+
+	Emitter e(code + code_used);
+	block->entry = e.p;
+	e.prologue();
+	block->body = e.p;
+
+	// Leave without running anything if the budget cannot cover the whole block
+	e.budget_cmp(length);
+	e.b(0x0F); e.b(0x82); uint8_t* no_budget = e.rel32(); // jb
+	e.budget_sub(length);
+
+	/*
+	Of all the instructions that set the condition codes only the last one before
+	a BR or an exit is observable, so flag_value is written once, from flag_reg.
+	flush_flags() leaves the value in ax.
+	*/
+	int flag_reg = -1;
+	auto flush_flags = [&]() {
+		if (flag_reg >= 0) {
+			e.load_reg(EAX, flag_reg);
+			e.store_flag_value();
+		}
+	};
+	auto chain_exit = [&](uint16_t target) {
+		e.store_reg_imm(R_PC, target);
+		e.b(0xE9);
+		Exit exit = { block, e.rel32(), target };
+		exits.push_back(exit);
+		e.ret();
+	};
+	auto side_exit = [&](uint8_t* site, uint32_t k, uint16_t pc) {
+		SideExit exit = { site, pc, length - k, flag_reg };
+		side_exits.push_back(exit);
+	};
+	auto store = [&](int sr, uint32_t k, uint16_t pc) {
+		uint8_t* io_site;
+		uint8_t* code_site;
+		e.store_mem(sr, io_site, code_site);
+		side_exit(io_site, k, pc);
+		side_exit(code_site, k, pc);
+	};
+
+	for (uint32_t k = 0; k < length; k++) {
+		uint16_t address = (uint16_t)(start + k);
+		uint16_t instr = vm.memory[address];
+		uint16_t npc = (uint16_t)(address + 1);
+		int r0 = (instr >> 9) & 0x7;
+		int r1 = (instr >> 6) & 0x7;
+		uint16_t offset9 = sign_extend(instr & 0x1FF, 9);
+		uint16_t offset6 = sign_extend(instr & 0x3F, 6);
+
+		switch (instr >> 12) {
+		case OP_ADD:
+		case OP_AND:
+			e.load_reg(EAX, r1);
+			if ((instr >> 5) & 0x1) {
+				uint16_t imm5 = sign_extend(instr & 0x1F, 5);
+				if ((instr >> 12) == OP_ADD) { e.add_ax(imm5); } else { e.and_ax(imm5); }
+			}
+			else {
+				e.load_reg(ECX, instr & 0x7);
+				if ((instr >> 12) == OP_ADD) { e.add_ax_cx(); } else { e.and_ax_cx(); }
+			}
+			e.store_reg(r0, EAX);
+			flag_reg = r0;
+			break;
+		case OP_NOT:
+			e.load_reg(EAX, r1);
+			e.not_ax();
+			e.store_reg(r0, EAX);
+			flag_reg = r0;
+			break;
+		case OP_LEA:
+			e.store_reg_imm(r0, npc + offset9);
+			flag_reg = r0;
+			break;
+		case OP_LD:
+			e.mov_eax((uint16_t)(npc + offset9));
+			e.load_mem();
+			e.store_reg(r0, EAX);
+			flag_reg = r0;
+			break;
+		case OP_LDI:
+			e.mov_eax((uint16_t)(npc + offset9));
+			e.load_mem();
+			side_exit(e.io_check(), k, address);
+			e.load_mem();
+			e.store_reg(r0, EAX);
+			flag_reg = r0;
+			break;
+		case OP_LDR:
+			e.load_reg(EAX, r1);
+			e.add_ax(offset6);
+			side_exit(e.io_check(), k, address);
+			e.zero_extend_ax();
+			e.load_mem();
+			e.store_reg(r0, EAX);
+			flag_reg = r0;
+			break;
+		case OP_ST:
+			e.mov_eax((uint16_t)(npc + offset9));
+			store(r0, k, address);
+			break;
+		case OP_STI:
+			e.mov_eax((uint16_t)(npc + offset9));
+			e.load_mem();
+			store(r0, k, address);
+			break;
+		case OP_STR:
+			e.load_reg(EAX, r1);
+			e.add_ax(offset6);
+			store(r0, k, address);
+			break;
+		case OP_BR:
+		{
+			uint8_t mask = (instr >> 9) & 0x7;
+			uint16_t target = npc + offset9;
+			flush_flags();
+			if (mask == 0x7) {
+				chain_exit(target);
+			}
+			else if (mask == 0) {
+				chain_exit(npc);
+			}
+			else {
+				if (flag_reg < 0) {
+					e.load_flag_value();
+				}
+				uint8_t* taken = e.jump_if_cond(mask);
+				chain_exit(npc);
+				patch(taken, e.p);
+				chain_exit(target);
+			}
+		}
+		break;
+		case OP_JMP:
+			flush_flags();
+			e.load_reg(EAX, r1);
+			e.store_reg(R_PC, EAX);
+			e.ret();
+			break;
+		case OP_JSR:
+			flush_flags();
+			// R7 is written first, exactly as op_jsr does, so JSRR R7 falls through
+			e.store_reg_imm(R_R7, npc);
+			if ((instr >> 11) & 1) {
+				chain_exit(npc + sign_extend(instr & 0x7FF, 11));
+			}
+			else {
+				e.load_reg(EAX, r1);
+				e.store_reg(R_PC, EAX);
+				e.ret();
+			}
+			break;
+		}
+	}
+	if (!terminated) {
+		flush_flags();
+		chain_exit((uint16_t)(start + length));
+	}
+
+	// Out of line side exits: settle the condition codes and the budget, then hand the instruction to the interpreter
+	for (const SideExit& exit : side_exits) {
+		patch(exit.site, e.p);
+		if (exit.flag_reg >= 0) {
+			e.load_reg(EAX, exit.flag_reg);
+			e.store_flag_value();
+		}
+		e.budget_add(exit.refund);
+		e.store_reg_imm(R_PC, exit.pc);
+		e.ret();
+	}
+	patch(no_budget, e.p);
+	e.ret();
+
+	code_used = e.p - code;
+	compile_count++;
+
+	for (uint32_t i = 0; i < length; i++) {
+		covered[start + i]++;
+	}
+	blocks_by_pc[start] = block;
+	blocks.push_back(block);
+	link(block);
+	return block;
+}
+
+#else
+
+// No code generator for this host, ENGINE_JIT runs on the pre-decoded core
+Jit::Jit(Machine& vm)
+	: vm(vm), code(nullptr), code_size(0), code_used(0), compile_count(0), covered(MEMORY_MAX) {}
+
+Jit::~Jit() {}
+
+bool Jit::available() const {
+	return false;
+}
+
+uint32_t Jit::run(uint32_t count) {
+	return vm.run_predecoded(count);
+}
+
+Jit::Block* Jit::compile(uint16_t start) {
+	return nullptr;
+}
+
+namespace {
+	void patch(uint8_t* site, const uint8_t* target) {}
+}
+
+#endif
+
+void Jit::link(Block* block) {
+	for (Exit& exit : exits) {
+		if (exit.target == block->start) {
+			patch(exit.site, block->body);
+		}
+		else if (exit.owner == block && blocks_by_pc[exit.target]) {
+			patch(exit.site, blocks_by_pc[exit.target]->body);
+		}
+	}
+}
+
+void Jit::kill(Block* block) {
+	// Exits into this block go back to returning to the dispatcher
+	for (Exit& exit : exits) {
+		if (exit.target == block->start && exit.owner != block) {
+			patch(exit.site, nullptr);
+		}
+	}
+	exits.erase(std::remove_if(exits.begin(), exits.end(),
+		[block](const Exit& exit) { return exit.owner == block; }), exits.end());
+
+	for (uint32_t i = 0; i < block->length; i++) {
+		covered[block->start + i]--;
+	}
+	blocks_by_pc[block->start] = nullptr;
+	counters[block->start] = 0;
+	blocks.erase(std::find(blocks.begin(), blocks.end(), block));
+	delete block;
+}
+
+void Jit::invalidate(uint16_t address) {
+	std::vector<Block*> dead;
+	for (Block* block : blocks) {
+		if (address >= block->start && address < block->start + block->length) {
+			dead.push_back(block);
+		}
+	}
+	for (Block* block : dead) {
+		kill(block);
+	}
+}
+
+void Jit::flush() {
+	while (!blocks.empty()) {
+		kill(blocks.back());
+	}
+	code_used = 0;
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/*
+Basic-block JIT to x86-64 (ENGINE_JIT).
+
+Code runs on the pre-decoded core one basic block at a time, counting how often
+each block start address is reached. Once a block gets hot it is translated to
+native code, and from then on it is entered directly. A block runs up to and
+including a BR/JMP/JSR/JSRR, and stops short of TRAP and RTI, which are left to
+the interpreter.
+
+Compiled blocks chain: exits with a static target jump straight to the target's
+code once it is compiled too. Every address covered by a compiled block is
+marked in a per-address table; stores check it, and a store into a compiled
+range leaves native code so that mem_write can throw the affected blocks away.
+
+Only x86-64 (System V and Windows calling conventions) is supported, everywhere
+else available() is false and ENGINE_JIT behaves like ENGINE_PREDECODED.
+*/
+
+namespace LC3VM {
+	class Machine;
+
+	class Jit {
+	public:
+		explicit Jit(Machine& vm);
+		~Jit();
+
+		// False if native code cannot be generated on this host
+		bool available() const;
+
+		// Execute at most count instructions, mixing compiled and interpreted blocks
+		uint32_t run(uint32_t count);
+
+		// Drop every compiled block that covers address
+		void invalidate(uint16_t address);
+
+		// Drop every compiled block
+		void flush();
+
+		// Non-zero for addresses inside at least one compiled block, indexed by address
+		const uint8_t* coverage() const { return covered.data(); }
+
+		// Blocks compiled so far, for diagnostics
+		size_t compiled_blocks() const { return compile_count; }
+
+	private:
+		struct Block;
+		struct Exit;
+
+		Machine& vm;
+		uint8_t* code; // Executable buffer, nullptr if unavailable
+		size_t code_size;
+		size_t code_used;
+		size_t compile_count;
+
+		std::vector<Block*> blocks_by_pc; // Live block starting at each address
+		std::vector<Block*> blocks; // Every live block, for range invalidation
+		std::vector<Exit> exits; // Chainable exits of the live blocks
+		std::vector<uint16_t> counters; // Executions of each block start address
+		std::vector<uint8_t> covered;
+
+		Block* compile(uint16_t start);
+		void link(Block* block);
+		void kill(Block* block);
+	};
+}
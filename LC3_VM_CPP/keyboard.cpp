@@ -0,0 +1,101 @@
+#include "keyboard.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <thread>
+#include <chrono>
+
+KeyBuffer::KeyBuffer(uint32_t min_capacity) {
+	uint32_t size = 1;
+	while (size < min_capacity) {
+		size <<= 1;
+	}
+	mask = size - 1;
+	buf.resize(size);
+}
+
+bool KeyBuffer::push(uint16_t key) {
+	uint32_t h = head.load(std::memory_order_relaxed);
+	if (h - tail.load(std::memory_order_acquire) > mask) {
+		return false;
+	}
+	buf[h & mask] = key;
+	head.store(h + 1, std::memory_order_release);
+	signal();
+	return true;
+}
+
+bool KeyBuffer::pop(uint16_t& key) {
+	uint32_t t = tail.load(std::memory_order_relaxed);
+	if (t == head.load(std::memory_order_acquire)) {
+		return false;
+	}
+	key = buf[t & mask];
+	tail.store(t + 1, std::memory_order_release);
+	return true;
+}
+
+bool KeyBuffer::empty() const {
+	return tail.load(std::memory_order_relaxed) == head.load(std::memory_order_acquire);
+}
+
+uint16_t KeyBuffer::pop_wait() {
+	uint16_t key;
+	while (!pop(key)) {
+		// Check the closed flag before retrying so that keys pushed just before close are not lost
+		if (closed() && empty()) {
+			return (uint16_t)EOF;
+		}
+		wait_ready();
+	}
+	return key;
+}
+
+void KeyBuffer::wait_ready() {
+	std::unique_lock<std::mutex> guard(lock);
+	arrived.wait(guard, [this] { return ready(); });
+}
+
+void KeyBuffer::signal() {
+	// Taking the lock orders the push before a consumer that is about to sleep checks ready()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+	}
+	arrived.notify_all();
+}
+
+void KeyBuffer::close() {
+	is_closed.store(true, std::memory_order_release);
+	signal();
+}
+
+bool KeyBuffer::closed() const {
+	return is_closed.load(std::memory_order_acquire);
+}
+
+namespace {
+	KeyBuffer console_keys;
+
+	void reader_loop() {
+		for (;;) {
+			int c = read_console_key();
+			if (c == EOF) {
+				console_keys.close();
+				return;
+			}
+			// If the VM is not consuming input, wait for room rather than dropping keys
+			while (!console_keys.push((uint16_t)c)) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+	}
+}
+
+void Keyboard::start() {
+	// The reader blocks in read_console_key() for the lifetime of the process, so it is never joined
+	std::thread(reader_loop).detach();
+}
+
+KeyBuffer& Keyboard::console() {
+	return console_keys;
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include "input.h"
+
+/*
+Keyboard input for the VM.
+
+A background thread blocks on the console and pushes every key it reads into a
+single-producer / single-consumer ring buffer. The VM side (KBSR polling and the
+GETC / IN traps) only ever looks at the ring buffer, so checking for a key costs
+two atomic loads instead of a wait on the console handle. Only a consumer that
+has nothing else to do sleeps on the condition variable, which the producer
+signals after every push.
+*/
+
+class KeyBuffer : public InputSource {
+public:
+	// The capacity is rounded up to a power of two
+	explicit KeyBuffer(uint32_t min_capacity = 256);
+
+	// Producer side (reader thread). Returns false if the buffer is full.
+	bool push(uint16_t key);
+
+	// Consumer side (VM thread). Returns false if no key is available.
+	bool pop(uint16_t& key);
+	bool empty() const;
+
+	// Block until a key is available and return it, (uint16_t)EOF once the buffer is closed and drained
+	uint16_t pop_wait();
+
+	// Mark the end of input, called by the producer
+	void close();
+	bool closed() const;
+
+	// InputSource, consumer side
+	bool poll(uint16_t& key) override { return pop(key); }
+	uint16_t wait() override { return pop_wait(); }
+	bool ready() const override { return !empty() || closed(); }
+	void wait_ready() override;
+
+private:
+	std::atomic<uint32_t> head{ 0 }; // Next slot the producer writes
+	std::atomic<uint32_t> tail{ 0 }; // Next slot the consumer reads
+	std::atomic<bool> is_closed{ false };
+	uint32_t mask;
+	std::vector<uint16_t> buf;
+	std::mutex lock; // Only for sleeping on arrived
+	std::condition_variable arrived;
+
+	void signal();
+};
+
+namespace Keyboard {
+	// Start the background reader thread (call after disable_input_buffering)
+	void start();
+
+	// The buffer filled from the console by the reader thread
+	KeyBuffer& console();
+}
@@ -0,0 +1,220 @@
+#include "lc3vm_api.h"
+#include "LC3VM.h"
+#include "ops.h"
+
+#include <string.h>
+#include <string>
+#include <unordered_map>
+
+using namespace LC3VM;
+
+namespace {
+	// Keys from the host's callback, one looked at ahead so ready() can answer without losing it
+	class CallbackInput : public InputSource {
+	public:
+		CallbackInput() : input(nullptr), user(nullptr), ahead(-1) {}
+
+		bool poll(uint16_t& key) override {
+			if (!ready()) {
+				return false;
+			}
+			key = (uint16_t)ahead;
+			ahead = -1;
+			return true;
+		}
+
+		// Only called by the machine once ready() said there is a key, run_for() never blocks
+		uint16_t wait() override {
+			uint16_t key = 0;
+			poll(key);
+			return key;
+		}
+
+		bool ready() const override {
+			if (ahead < 0 && input) {
+				ahead = input(user);
+			}
+			return ahead >= 0;
+		}
+
+		lc3vm_input_fn input;
+		void* user;
+
+	private:
+		mutable int ahead;
+	};
+
+	struct HostDevice {
+		lc3vm_device_read_fn read;
+		lc3vm_device_write_fn write;
+		void* user;
+		DeviceRegister replaced; // Mapped before the host took over, put back by lc3vm_unmap_device()
+		bool had_device;
+	};
+
+	const Engine ENGINES[] = { DEFAULT_ENGINE, ENGINE_SWITCH, ENGINE_THREADED, ENGINE_PREDECODED, ENGINE_JIT, ENGINE_AOT };
+}
+
+// The handle is the machine itself, so the device hooks find the host callbacks from it
+struct lc3vm : public Machine {
+	CallbackInput input;
+	lc3vm_output_fn output_fn;
+	void* output_user;
+	std::unordered_map<uint16_t, HostDevice> devices;
+	Metrics counters; // Always attached, so any host can read them
+
+	lc3vm() : output_fn(nullptr), output_user(nullptr) {
+		keyboard = &input;
+		output.set_sink(nullptr, false);
+		attach_metrics(&counters);
+	}
+
+	static uint16_t device_read(Machine& vm, uint16_t address) {
+		const HostDevice& d = static_cast<lc3vm&>(vm).devices[address];
+		return d.read ? d.read(d.user, address) : vm.memory[address];
+	}
+
+	static void device_write(Machine& vm, uint16_t address, uint16_t val) {
+		const HostDevice& d = static_cast<lc3vm&>(vm).devices[address];
+		if (d.write) {
+			d.write(d.user, address, val);
+		}
+		else {
+			vm.ram_write(address, val);
+		}
+	}
+};
+
+int lc3vm_api_version(void) {
+	return LC3VM_API_VERSION;
+}
+
+lc3vm* lc3vm_create(lc3vm_engine engine) {
+	if ((unsigned)engine >= sizeof(ENGINES) / sizeof(ENGINES[0])) {
+		return nullptr;
+	}
+	lc3vm* vm = new lc3vm();
+	vm->engine = ENGINES[engine];
+	return vm;
+}
+
+void lc3vm_destroy(lc3vm* vm) {
+	delete vm;
+}
+
+int lc3vm_load_image(lc3vm* vm, const uint8_t* data, size_t size) {
+	return vm->read_image_data(data, size);
+}
+
+void lc3vm_reset(lc3vm* vm) {
+	vm->reset();
+}
+
+lc3vm_status lc3vm_run(lc3vm* vm, uint64_t budget, uint64_t* executed) {
+	uint64_t start = vm->instructions;
+	StopReason reason = vm->running ? vm->run_for(budget) : STOP_HALTED;
+	vm->output.flush();
+	std::string out = vm->output.take_captured();
+	if (!out.empty() && vm->output_fn) {
+		vm->output_fn(vm->output_user, out.data(), out.size());
+	}
+	if (executed) {
+		*executed = vm->instructions - start;
+	}
+	switch (reason) {
+	case STOP_HALTED:
+		return LC3VM_HALTED;
+	case STOP_INPUT:
+		return LC3VM_WAITING_INPUT;
+	default:
+		return LC3VM_BUDGET;
+	}
+}
+
+uint64_t lc3vm_instructions(const lc3vm* vm) {
+	return vm->instructions;
+}
+
+void lc3vm_get_metrics(const lc3vm* vm, lc3vm_metrics* metrics) {
+	MetricsSnapshot m;
+	m.add(vm->counters);
+	metrics->instructions = m.instructions;
+	metrics->run_ns = m.run_ns;
+	metrics->input_wait_ns = m.input_wait_ns;
+	metrics->idle_instructions = m.idle_instructions;
+	metrics->output_bytes = m.output_bytes;
+	memcpy(metrics->traps, m.traps, sizeof(metrics->traps));
+}
+
+size_t lc3vm_format_metrics(const lc3vm* vm, const char* labels, char* buffer, size_t size) {
+	MetricsSnapshot m;
+	m.add(vm->counters);
+	std::string text = format_prometheus(m, labels ? labels : "");
+	if (size) {
+		size_t n = text.size() < size - 1 ? text.size() : size - 1;
+		memcpy(buffer, text.data(), n);
+		buffer[n] = 0;
+	}
+	return text.size();
+}
+
+uint16_t lc3vm_read_memory(const lc3vm* vm, uint16_t address) {
+	return vm->memory[address];
+}
+
+void lc3vm_write_memory(lc3vm* vm, uint16_t address, uint16_t value) {
+	vm->ram_write(address, value);
+}
+
+uint16_t lc3vm_get_register(const lc3vm* vm, lc3vm_register r) {
+	return (unsigned)r < R_COUNT ? vm->reg[r] : 0;
+}
+
+void lc3vm_set_register(lc3vm* vm, lc3vm_register r, uint16_t value) {
+	if ((unsigned)r < R_COUNT) {
+		vm->reg[r] = value;
+	}
+}
+
+void lc3vm_set_input(lc3vm* vm, lc3vm_input_fn input, void* user) {
+	vm->input.input = input;
+	vm->input.user = user;
+}
+
+void lc3vm_set_output(lc3vm* vm, lc3vm_output_fn output, void* user) {
+	vm->output_fn = output;
+	vm->output_user = user;
+}
+
+void lc3vm_map_device(lc3vm* vm, uint16_t address, lc3vm_device_read_fn read, lc3vm_device_write_fn write, void* user) {
+	auto existing = vm->devices.find(address);
+	HostDevice d;
+	if (existing != vm->devices.end()) {
+		d = existing->second;
+	}
+	else {
+		const DeviceRegister* replaced = vm->io.find(address);
+		d.had_device = replaced != nullptr;
+		d.replaced = replaced ? *replaced : DeviceRegister{ nullptr, nullptr };
+	}
+	d.read = read;
+	d.write = write;
+	d.user = user;
+	vm->devices[address] = d;
+	DeviceRegister hooks = { lc3vm::device_read, lc3vm::device_write };
+	vm->map_device(address, hooks);
+}
+
+void lc3vm_unmap_device(lc3vm* vm, uint16_t address) {
+	auto d = vm->devices.find(address);
+	if (d == vm->devices.end()) {
+		return;
+	}
+	if (d->second.had_device) {
+		vm->map_device(address, d->second.replaced);
+	}
+	else {
+		vm->unmap_device(address);
+	}
+	vm->devices.erase(d);
+}
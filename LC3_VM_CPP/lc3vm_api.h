@@ -0,0 +1,154 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+The embedding API.
+
+A plain C interface to the VM for programs that host it in-process, built into
+both the static and the shared lc3vm library. Only these functions are
+exported from the shared library; C++ programs that want the Machine class
+itself (LC3VM.h) link the static library instead. The interface only ever
+grows: LC3VM_API_VERSION goes up when something is added, and nothing is
+changed or removed.
+
+A machine never touches the console. Keys come from the input callback,
+output goes to the output callback after every lc3vm_run(), and any memory
+mapped register can be handed to the host with lc3vm_map_device(). A machine
+may be used from any thread, but from one thread at a time. The callbacks run
+on the thread that called lc3vm_run().
+
+	lc3vm* vm = lc3vm_create(LC3VM_ENGINE_DEFAULT);
+	lc3vm_load_image(vm, obj, obj_size);
+	lc3vm_reset(vm);
+	while (lc3vm_run(vm, 1000000, NULL) == LC3VM_BUDGET) {}
+	lc3vm_destroy(vm);
+*/
+
+#define LC3VM_API_VERSION 3
+
+#if defined(_WIN32)
+#if defined(LC3VM_BUILDING)
+#define LC3VM_API __declspec(dllexport)
+#elif defined(LC3VM_SHARED)
+#define LC3VM_API __declspec(dllimport)
+#else
+#define LC3VM_API
+#endif
+#else
+#define LC3VM_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct lc3vm lc3vm;
+
+typedef enum lc3vm_engine {
+	LC3VM_ENGINE_DEFAULT = 0, // The fastest interpreter for the compiler the library was built with
+	LC3VM_ENGINE_SWITCH,
+	LC3VM_ENGINE_THREADED,
+	LC3VM_ENGINE_PREDECODED,
+	LC3VM_ENGINE_JIT,
+	LC3VM_ENGINE_AOT, // Since version 2: translations linked into the program (aot.h), interpreted where there are none
+} lc3vm_engine;
+
+typedef enum lc3vm_status {
+	LC3VM_HALTED = 0, // The program executed HALT, or was never started with lc3vm_reset()
+	LC3VM_BUDGET, // The instruction budget ran out
+	LC3VM_WAITING_INPUT, // The program needs a key the input callback does not have yet, run again once it does
+} lc3vm_status;
+
+// Registers for lc3vm_get_register() and lc3vm_set_register()
+typedef enum lc3vm_register {
+	LC3VM_R0 = 0,
+	LC3VM_R1,
+	LC3VM_R2,
+	LC3VM_R3,
+	LC3VM_R4,
+	LC3VM_R5,
+	LC3VM_R6,
+	LC3VM_R7,
+	LC3VM_PC,
+	LC3VM_COND, // 1 positive, 2 zero, 4 negative
+} lc3vm_register;
+
+/*
+Since version 3: what a machine has done since it was created. The counts are
+added up at the end of every slice lc3vm_run() executes, not per instruction.
+*/
+typedef struct lc3vm_metrics {
+	uint64_t instructions; // Retired, as lc3vm_instructions()
+	uint64_t run_ns; // Wall time spent inside lc3vm_run()
+	uint64_t input_wait_ns; // Blocked on a key in GETC or IN, or asleep in an idle KBSR polling loop
+	uint64_t idle_instructions; // Of instructions, those retired by recognising an idle polling loop without executing it
+	uint64_t output_bytes; // Written by the program, handed to the output callback or discarded
+	uint64_t traps[256]; // TRAP instructions executed, by vector
+} lc3vm_metrics;
+
+// The next key, or -1 if there is none right now. Asked again whenever the program looks for a key.
+typedef int (*lc3vm_input_fn)(void* user);
+
+// Output the program wrote, size bytes at data
+typedef void (*lc3vm_output_fn)(void* user, const char* data, size_t size);
+
+// A load from or store to a device register mapped with lc3vm_map_device()
+typedef uint16_t(*lc3vm_device_read_fn)(void* user, uint16_t address);
+typedef void (*lc3vm_device_write_fn)(void* user, uint16_t address, uint16_t value);
+
+// LC3VM_API_VERSION of the library, which may be newer than the header a program was built with
+LC3VM_API int lc3vm_api_version(void);
+
+// A machine with clear memory, stopped. NULL if the engine is unknown.
+LC3VM_API lc3vm* lc3vm_create(lc3vm_engine engine);
+LC3VM_API void lc3vm_destroy(lc3vm* vm);
+
+// Copy the contents of an .obj file (big-endian origin, then big-endian words) into memory. 0 if there is no origin.
+LC3VM_API int lc3vm_load_image(lc3vm* vm, const uint8_t* data, size_t size);
+
+// Set up the registers to start the loaded program at x3000
+LC3VM_API void lc3vm_reset(lc3vm* vm);
+
+// Execute at most budget instructions. The number executed goes to *executed unless it is NULL.
+LC3VM_API lc3vm_status lc3vm_run(lc3vm* vm, uint64_t budget, uint64_t* executed);
+
+// Instructions executed since the machine was created
+LC3VM_API uint64_t lc3vm_instructions(const lc3vm* vm);
+
+/*
+Memory as the program sees it, without going through device registers. Writes
+drop whatever the engines cached for the word, so code may be patched.
+*/
+LC3VM_API uint16_t lc3vm_read_memory(const lc3vm* vm, uint16_t address);
+LC3VM_API void lc3vm_write_memory(lc3vm* vm, uint16_t address, uint16_t value);
+
+LC3VM_API uint16_t lc3vm_get_register(const lc3vm* vm, lc3vm_register r);
+LC3VM_API void lc3vm_set_register(lc3vm* vm, lc3vm_register r, uint16_t value);
+
+/*
+Since version 3. Unlike everything else these may be called from any thread,
+also while another thread is running the machine.
+lc3vm_format_metrics() writes the counters in the Prometheus text format, with
+labels (such as `vm="12"`, or NULL) on every sample. It returns the length of
+the text, of which at most size - 1 bytes and a terminating zero are written
+to buffer, like snprintf().
+*/
+LC3VM_API void lc3vm_get_metrics(const lc3vm* vm, lc3vm_metrics* metrics);
+LC3VM_API size_t lc3vm_format_metrics(const lc3vm* vm, const char* labels, char* buffer, size_t size);
+
+// NULL for no keys or to discard the output, which is the default
+LC3VM_API void lc3vm_set_input(lc3vm* vm, lc3vm_input_fn input, void* user);
+LC3VM_API void lc3vm_set_output(lc3vm* vm, lc3vm_output_fn output, void* user);
+
+/*
+Hand the memory mapped register at address to the host. Loads call read and
+stores call write, either may be NULL to treat the word as plain memory. A
+device at KBSR, KBDR or the PSR replaces the built-in one until it is unmapped.
+*/
+LC3VM_API void lc3vm_map_device(lc3vm* vm, uint16_t address, lc3vm_device_read_fn read, lc3vm_device_write_fn write, void* user);
+LC3VM_API void lc3vm_unmap_device(lc3vm* vm, uint16_t address);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,37 +1,609 @@
+#ifdef _MSC_VER
 #pragma warning(disable:4996)
+#endif
 #include <iostream>
 #include <stdio.h>
 #include <stdint.h>
 #include <signal.h>
-
-#include <Windows.h>
-#include <conio.h>
+#include <string.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
 
 #include "utils.h"
 #include "LC3VM.h"
+#include "keyboard.h"
+#include "batch.h"
+#include "difftest.h"
+#include "gdbstub.h"
+
+static bool read_file(const std::string& path, std::string& contents) {
+	std::ifstream file(path, std::ios::binary);
+	if (!file) { return false; }
+	std::ostringstream ss;
+	ss << file.rdbuf();
+	contents = ss.str();
+	return true;
+}
+
+/*
+--native ADDR:NAME and --native-trap VECTOR:NAME, with addresses written
+x3100, 0x3100 or in decimal. Returns false if the spec is malformed.
+*/
+static bool parse_native(const char* spec, uint32_t limit, uint16_t& where, LC3VM::Intrinsic& native) {
+	std::string s = spec;
+	size_t colon = s.find(':');
+	if (colon == std::string::npos || colon == 0) {
+		return false;
+	}
+	std::string number = s.substr(0, colon);
+	int base = 0;
+	if (number[0] == 'x' || number[0] == 'X') {
+		number = number.substr(1);
+		base = 16;
+	}
+	char* end;
+	unsigned long value = strtoul(number.c_str(), &end, base);
+	if (number.empty() || *end || value >= limit) {
+		return false;
+	}
+	where = (uint16_t)value;
+	return LC3VM::Intrinsics::builtin(s.substr(colon + 1), native);
+}
+
+/*
+Manifests of --batch and --difftest. Each non-empty line is one job:
+	image-file1 [image-file2 ...] [< input-file]
+Lines starting with # are ignored.
+*/
+static bool read_manifest(const char* manifest, std::vector<LC3VM::BatchJob>& jobs) {
+	std::ifstream file(manifest);
+	if (!file) {
+		printf("failed to open manifest: %s\n", manifest);
+		return false;
+	}
+
+	std::string line;
+	while (std::getline(file, line)) {
+		std::istringstream words(line);
+		std::string word;
+		LC3VM::BatchJob job;
+		while (words >> word) {
+			if (word[0] == '#' && job.images.empty()) { break; }
+			if (word == "<") {
+				std::string input_path;
+				words >> input_path;
+				if (!read_file(input_path, job.input)) {
+					printf("failed to read input: %s\n", input_path.c_str());
+					return false;
+				}
+				break;
+			}
+			job.images.push_back(word);
+		}
+		if (!job.images.empty()) {
+			jobs.push_back(job);
+		}
+	}
+
+	return true;
+}
+
+/*
+Batch mode: lc3 --batch manifest [--threads N] [--slice N] [--max-instructions N] [--engine NAME] [--metrics-port N] [--metrics-out PATH]
+--metrics-port serves the counters of all jobs at http://127.0.0.1:N/metrics
+while the batch runs, --metrics-out writes them to a file once it is done.
+*/
+static int run_batch_mode(int argc, const char* argv[]) {
+	LC3VM::BatchOptions options;
+	const char* manifest = nullptr;
+	long metrics_port = -1;
+	const char* metrics_out = nullptr;
+	for (int j = 2; j < argc; j++) {
+		std::string arg = argv[j];
+		if (arg == "--metrics-port" && j + 1 < argc) {
+			metrics_port = strtol(argv[++j], nullptr, 10);
+			if (metrics_port < 0 || metrics_port > 65535) {
+				printf("invalid metrics port: %s\n", argv[j]);
+				return 2;
+			}
+		}
+		else if (arg == "--metrics-out" && j + 1 < argc) {
+			metrics_out = argv[++j];
+		}
+		else if (arg == "--threads" && j + 1 < argc) {
+			options.threads = (unsigned)strtoul(argv[++j], nullptr, 10);
+		}
+		else if (arg == "--slice" && j + 1 < argc) {
+			options.slice = (uint32_t)strtoul(argv[++j], nullptr, 10);
+		}
+		else if (arg == "--max-instructions" && j + 1 < argc) {
+			options.max_instructions = strtoull(argv[++j], nullptr, 10);
+		}
+		else if (arg == "--engine" && j + 1 < argc) {
+			if (!LC3VM::engine_from_name(argv[++j], options.engine)) {
+				printf("unknown engine: %s\n", argv[j]);
+				return 2;
+			}
+		}
+		else {
+			manifest = argv[j];
+		}
+	}
+	if (!manifest || options.slice == 0) {
+		printf("lc3 --batch [manifest] [--threads N] [--slice N] [--max-instructions N] [--engine NAME] [--metrics-port N] [--metrics-out PATH]\n");
+		return 2;
+	}
+
+	std::vector<LC3VM::BatchJob> jobs;
+	if (!read_manifest(manifest, jobs)) {
+		return 1;
+	}
+
+	LC3VM::MetricsShards metrics;
+	std::unique_ptr<LC3VM::MetricsServer> server;
+	if (metrics_port >= 0 || metrics_out) {
+		options.metrics = &metrics;
+	}
+	if (metrics_port >= 0) {
+		server.reset(new LC3VM::MetricsServer([&metrics] { return LC3VM::format_prometheus(metrics.total()); }));
+		if (!server->start((uint16_t)metrics_port)) {
+			printf("failed to listen on port %ld\n", metrics_port);
+			return 1;
+		}
+		fprintf(stderr, "metrics: http://127.0.0.1:%d/metrics\n", server->port());
+	}
+
+	LC3VM::run_batch(jobs, options);
+
+	if (server) {
+		server->stop();
+	}
+	if (metrics_out) {
+		std::string text = LC3VM::format_prometheus(metrics.total());
+		FILE* out = fopen(metrics_out, "wb");
+		if (!out || fwrite(text.data(), 1, text.size(), out) != text.size()) {
+			printf("failed to write metrics: %s\n", metrics_out);
+		}
+		if (out) {
+			fclose(out);
+		}
+	}
+
+	int failed = 0;
+	for (size_t i = 0; i < jobs.size(); i++) {
+		const LC3VM::BatchJob& job = jobs[i];
+		printf("[job %zu] %s status=%s instructions=%llu\n", i, job.images[0].c_str(),
+			LC3VM::batch_status_name(job.status), (unsigned long long)job.instructions);
+		fwrite(job.output.data(), 1, job.output.size(), stdout);
+		if (!job.output.empty() && job.output.back() != '\n') {
+			printf("\n");
+		}
+		if (job.status != LC3VM::BATCH_HALTED) {
+			failed++;
+		}
+	}
+	return failed ? 1 : 0;
+}
+
+/*
+Differential testing: lc3 --difftest manifest [--engines NAME,NAME...] [--check-every N] [--max-instructions N]
+Every job runs on all the engines (or those listed) at once and is checked every
+N instructions; the first instruction after which they differ is reported.
+Running into the budget counts as agreement, so programs that never halt can be
+part of the manifest.
+*/
+static int run_difftest_mode(int argc, const char* argv[]) {
+	LC3VM::DiffOptions options;
+	const char* manifest = nullptr;
+	for (int j = 2; j < argc; j++) {
+		std::string arg = argv[j];
+		if (arg == "--engines" && j + 1 < argc) {
+			std::istringstream names(argv[++j]);
+			std::string name;
+			while (std::getline(names, name, ',')) {
+				LC3VM::Engine engine;
+				if (!LC3VM::engine_from_name(name.c_str(), engine)) {
+					printf("unknown engine: %s\n", name.c_str());
+					return 2;
+				}
+				options.engines.push_back(engine);
+			}
+		}
+		else if (arg == "--check-every" && j + 1 < argc) {
+			options.interval = (uint32_t)strtoul(argv[++j], nullptr, 10);
+		}
+		else if (arg == "--max-instructions" && j + 1 < argc) {
+			options.max_instructions = strtoull(argv[++j], nullptr, 10);
+		}
+		else {
+			manifest = argv[j];
+		}
+	}
+	if (!manifest || options.interval == 0 || options.engines.size() == 1) {
+		printf("lc3 --difftest [manifest] [--engines NAME,NAME...] [--check-every N] [--max-instructions N]\n");
+		return 2;
+	}
+
+	std::vector<LC3VM::BatchJob> jobs;
+	if (!read_manifest(manifest, jobs)) {
+		return 1;
+	}
+
+	int failed = 0;
+	for (size_t i = 0; i < jobs.size(); i++) {
+		const LC3VM::BatchJob& job = jobs[i];
+		LC3VM::DiffResult result = LC3VM::diff_engines(job.images, job.input, options);
+		printf("[job %zu] %s status=%s instructions=%llu checks=%llu\n", i, job.images[0].c_str(),
+			LC3VM::diff_status_name(result.status), (unsigned long long)result.instructions, (unsigned long long)result.checks);
+		if (result.status == LC3VM::DIFF_DIVERGED) {
+			printf("  first difference after instruction %llu: x%04X x%04X\n",
+				(unsigned long long)result.instructions + 1, result.pc, result.instr);
+			for (const std::string& difference : result.differences) {
+				printf("  %s\n", difference.c_str());
+			}
+		}
+		if (result.status == LC3VM::DIFF_DIVERGED || result.status == LC3VM::DIFF_LOAD_FAILED) {
+			failed++;
+		}
+		fflush(stdout);
+	}
+	return failed ? 1 : 0;
+}
+
+/*
+Trace decoding: lc3 --trace-dump trace [--at N]
+Prints every step of a trace written with --trace, or with --at only the
+registers as they were after step N.
+*/
+static int run_trace_dump(int argc, const char* argv[]) {
+	const char* path = nullptr;
+	uint64_t at = 0;
+	bool seek = false;
+	for (int j = 2; j < argc; j++) {
+		std::string arg = argv[j];
+		if (arg == "--at" && j + 1 < argc) {
+			at = strtoull(argv[++j], nullptr, 10);
+			seek = true;
+		}
+		else {
+			path = argv[j];
+		}
+	}
+	if (!path) {
+		printf("lc3 --trace-dump [trace] [--at N]\n");
+		return 2;
+	}
+	FILE* file = fopen(path, "rb");
+	LC3VM::TraceReader trace;
+	if (!file || !trace.open(file)) {
+		printf("failed to read trace: %s\n", path);
+		return 1;
+	}
+
+	int status = 0;
+	const LC3VM::Machine& vm = trace.machine();
+	if (seek) {
+		if (!trace.seek(at)) {
+			printf("trace ends after step %llu\n", (unsigned long long)trace.step());
+			status = 1;
+		}
+		printf("after step %llu:", (unsigned long long)trace.step());
+		for (int r = 0; r < 8; r++) {
+			printf(" R%d=x%04X", r, vm.reg[r]);
+		}
+		printf(" PC=x%04X COND=%s\n", vm.reg[LC3VM::R_PC], vm.reg[LC3VM::R_COND] == LC3VM::FL_NEG ? "n" : vm.reg[LC3VM::R_COND] == LC3VM::FL_ZRO ? "z" : "p");
+	}
+	else {
+		LC3VM::TraceStep step;
+		while (trace.next(step)) {
+			printf("%llu x%04X x%04X", (unsigned long long)trace.step(), step.pc, step.instr);
+			for (int r = 0; r < 8; r++) {
+				if (step.changed & (1 << r)) {
+					printf(" R%d=x%04X", r, vm.reg[r]);
+				}
+			}
+			for (const auto& store : step.stores) {
+				printf(" [x%04X]=x%04X", store.first, store.second);
+			}
+			if (step.cond_changed) {
+				printf(" COND=%s", vm.reg[LC3VM::R_COND] == LC3VM::FL_NEG ? "n" : vm.reg[LC3VM::R_COND] == LC3VM::FL_ZRO ? "z" : "p");
+			}
+			printf("\n");
+		}
+		if (!trace.complete()) {
+			printf("trace is incomplete or damaged after step %llu\n", (unsigned long long)trace.step());
+			status = 1;
+		}
+		else if (trace.final_steps() != trace.step() || memcmp(trace.final_registers().data(), vm.reg, sizeof(vm.reg)) != 0) {
+			printf("decoded state does not match the final state of the trace\n");
+			status = 1;
+		}
+	}
+	fclose(file);
+	return status;
+}
+
+/*
+Translation: lc3 --aot image [-o source] [--name NAME]
+Writes C++ for ENGINE_AOT (aot.h) to source, or to standard output. The name
+the translation is registered under defaults to the image path.
+*/
+static int run_aot_translate(int argc, const char* argv[]) {
+	const char* path = nullptr;
+	const char* out_path = nullptr;
+	const char* name = nullptr;
+	for (int j = 2; j < argc; j++) {
+		std::string arg = argv[j];
+		if (arg == "-o" && j + 1 < argc) {
+			out_path = argv[++j];
+		}
+		else if (arg == "--name" && j + 1 < argc) {
+			name = argv[++j];
+		}
+		else {
+			path = argv[j];
+		}
+	}
+	if (!path) {
+		printf("lc3 --aot [image] [-o source] [--name NAME]\n");
+		return 2;
+	}
+	std::shared_ptr<const LC3VM::Image> image = LC3VM::Image::load(path);
+	if (!image) {
+		printf("failed to load image: %s\n", path);
+		return 1;
+	}
+	std::string source, error;
+	if (!LC3VM::translate_image(*image, name ? name : path, source, error)) {
+		printf("failed to translate %s: %s\n", path, error.c_str());
+		return 1;
+	}
+	FILE* out = out_path ? fopen(out_path, "wb") : stdout;
+	if (!out) {
+		printf("failed to open output: %s\n", out_path);
+		return 1;
+	}
+	bool written = fwrite(source.data(), 1, source.size(), out) == source.size();
+	if (out_path) {
+		written = fclose(out) == 0 && written;
+	}
+	return written ? 0 : 1;
+}
 
 int main(int argc, const char* argv[]) {
 	// Load arguments
 	if (argc < 2) {
-		printf("lc3 [image-file1] ...\n");
+		printf("lc3 [--engine switch|threaded|predecoded|jit|aot] [--output PATH|-] [--flush-ms N] [--headless] [--profile] [--profile-out PATH]\n          [--input FILE] [--record LOG] [--replay LOG]\n          [--native ADDR:NAME] [--native-trap VECTOR:NAME] [--verify-native] [--trace PATH] [--gdb PORT] [image-file1] ...\n");
+		printf("lc3 --batch [manifest] [--threads N] [--slice N] [--max-instructions N] [--engine NAME] [--metrics-port N] [--metrics-out PATH]\n");
+		printf("lc3 --difftest [manifest] [--engines NAME,NAME...] [--check-every N] [--max-instructions N]\n");
+		printf("lc3 --trace-dump [trace] [--at N]\n");
+		printf("lc3 --aot [image] [-o source] [--name NAME]\n");
 		exit(2);
 	}
 
+	// Batch mode runs headless, so none of the console setup below applies
+	if (std::string(argv[1]) == "--batch") {
+		return run_batch_mode(argc, argv);
+	}
+	if (std::string(argv[1]) == "--difftest") {
+		return run_difftest_mode(argc, argv);
+	}
+	if (std::string(argv[1]) == "--trace-dump") {
+		return run_trace_dump(argc, argv);
+	}
+	if (std::string(argv[1]) == "--aot") {
+		return run_aot_translate(argc, argv);
+	}
+
+	// The machine holds 128 KiB of memory, so keep it off the stack
+	std::unique_ptr<LC3VM::Machine> vm(new LC3VM::Machine());
+	FILE* output_file = nullptr;
+	ConsoleBackend console = default_console_backend();
+	const char* profile_path = "lc3-profile.folded";
+	std::unique_ptr<InputSource> input; // Replaces the console when set
+	std::unique_ptr<InputSource> recorder;
+	FILE* record_log = nullptr;
+	FILE* trace_file = nullptr;
+	LC3VM::Intrinsics natives;
+	bool use_natives = false;
+	long gdb_port = -1;
+
 	for (int j = 1; j < argc; j++) {
-		if (!LC3VM::read_image(argv[j])) {
+		if (std::string(argv[j]) == "--engine" && j + 1 < argc) {
+			if (!LC3VM::engine_from_name(argv[++j], vm->engine)) {
+				printf("unknown engine: %s\n", argv[j]);
+				exit(2);
+			}
+			continue;
+		}
+		// Raw output: written to a file or pipe in large chunks, never flushed for the console
+		if (std::string(argv[j]) == "--output" && j + 1 < argc) {
+			const char* path = argv[++j];
+			output_file = std::string(path) == "-" ? stdout : fopen(path, "wb");
+			if (!output_file) {
+				printf("failed to open output: %s\n", path);
+				exit(1);
+			}
+			vm->output.set_sink(output_file, false);
+			continue;
+		}
+		// Count instructions by opcode, address and call stack, reported when the program ends
+		if (std::string(argv[j]) == "--profile") {
+			vm->profiler.reset(new LC3VM::Profiler());
+			continue;
+		}
+		if (std::string(argv[j]) == "--profile-out" && j + 1 < argc) {
+			profile_path = argv[++j];
+			continue;
+		}
+		// Keys from a file instead of the console, all available at once
+		if (std::string(argv[j]) == "--input" && j + 1 < argc) {
+			BufferInput* keys = new BufferInput();
+			input.reset(keys);
+			if (!keys->load_file(argv[++j])) {
+				printf("failed to read input: %s\n", argv[j]);
+				exit(1);
+			}
+			continue;
+		}
+		// Keys recorded with --record, delivered at the same instruction counts
+		if (std::string(argv[j]) == "--replay" && j + 1 < argc) {
+			ReplayInput* log = new ReplayInput();
+			input.reset(log);
+			if (!log->load_file(argv[++j])) {
+				printf("failed to read replay log: %s\n", argv[j]);
+				exit(1);
+			}
+			continue;
+		}
+		if (std::string(argv[j]) == "--record" && j + 1 < argc) {
+			record_log = fopen(argv[++j], "w");
+			if (!record_log) {
+				printf("failed to open replay log: %s\n", argv[j]);
+				exit(1);
+			}
+			continue;
+		}
+		// Run a stock native routine in place of the subroutine at an address or for a spare trap vector
+		if ((std::string(argv[j]) == "--native" || std::string(argv[j]) == "--native-trap") && j + 1 < argc) {
+			bool trap = std::string(argv[j]) == "--native-trap";
+			uint16_t where;
+			LC3VM::Intrinsic native;
+			if (!parse_native(argv[++j], trap ? 256 : LC3VM::MEMORY_MAX, where, native)) {
+				printf("bad native routine: %s (routines are %s)\n", argv[j], LC3VM::Intrinsics::builtin_names());
+				exit(2);
+			}
+			if (trap) {
+				natives.add_trap((uint8_t)where, native);
+			}
+			else {
+				natives.add(where, native);
+			}
+			use_natives = true;
+			continue;
+		}
+		// Record every instruction to a file, read back with --trace-dump
+		if (std::string(argv[j]) == "--trace" && j + 1 < argc) {
+			trace_file = fopen(argv[++j], "wb");
+			if (!trace_file) {
+				printf("failed to open trace: %s\n", argv[j]);
+				exit(1);
+			}
+			vm->tracer.reset(new LC3VM::Tracer(trace_file));
+			continue;
+		}
+		// Wait for GDB to connect over TCP before the first instruction
+		if (std::string(argv[j]) == "--gdb" && j + 1 < argc) {
+			char* end;
+			gdb_port = strtol(argv[++j], &end, 10);
+			if (*end || gdb_port < 0 || gdb_port > 65535) {
+				printf("bad gdb port: %s\n", argv[j]);
+				exit(2);
+			}
+			continue;
+		}
+		// Check every native call against interpreting the routine
+		if (std::string(argv[j]) == "--verify-native") {
+			natives.verify = true;
+			continue;
+		}
+		// Read keys from stdin as it is, even when it is a terminal
+		if (std::string(argv[j]) == "--headless") {
+			console = CONSOLE_HEADLESS;
+			continue;
+		}
+		if (std::string(argv[j]) == "--flush-ms" && j + 1 < argc) {
+			vm->output.set_flush_interval((uint32_t)strtoul(argv[++j], nullptr, 10));
+			continue;
+		}
+		if (!vm->read_image(argv[j])) {
 			printf("failed to load image: %s\n", argv[j]);
 			exit(1);
 		}
 	}
 
 	// Setup - this is a small detail to properly handle input to the terminal
+	stop_on_interrupt(&vm->stop_requested);
 	signal(SIGINT, handle_interrupt);
-	disable_input_buffering();
+	if (input) {
+		// Scripted input never touches the console
+		vm->keyboard = input.get();
+	}
+	else {
+		set_console_backend(console);
+		disable_input_buffering();
+		Keyboard::start();
+	}
+	if (use_natives) {
+		vm->attach_intrinsics(&natives);
+	}
+	if (record_log) {
+		recorder.reset(new RecordingInput(*vm->keyboard, record_log));
+		vm->keyboard = recorder.get();
+	}
 
-	LC3VM::run(); 
+	if (gdb_port >= 0) {
+		vm->reset();
+		bool detached;
+		{
+			LC3VM::Debugger debugger(*vm);
+			LC3VM::GdbStub stub(*vm, debugger);
+			if (!stub.serve((uint16_t)gdb_port, stderr)) {
+				fprintf(stderr, "gdb: failed to listen on port %ld\n", gdb_port);
+				restore_input_buffering();
+				return 1;
+			}
+			detached = stub.detached();
+		}
+		// Detaching lets the program run on without the debugger
+		if (detached) {
+			vm->run_to_halt();
+		}
+		vm->output.flush();
+	}
+	else {
+		vm->run();
+	}
 
 	// Small detail - reset terminal settings at end of program
 	restore_input_buffering();
+	if (interrupt_requested()) {
+		printf("\n");
+	}
+
+	if (vm->profiler) {
+		vm->profiler->report(stderr);
+		FILE* folded = fopen(profile_path, "w");
+		if (folded) {
+			vm->profiler->write_folded(folded);
+			fclose(folded);
+			fprintf(stderr, "\ncall stacks written to %s\n", profile_path);
+		}
+		else {
+			fprintf(stderr, "\nfailed to write %s\n", profile_path);
+		}
+	}
+
+	if (record_log) {
+		fclose(record_log);
+	}
+
+	if (trace_file) {
+		vm->tracer.reset();
+		fclose(trace_file);
+	}
+
+	if (use_natives && natives.verify) {
+		fprintf(stderr, "native calls: %llu, mismatches: %llu\n", (unsigned long long)natives.calls.load(), (unsigned long long)natives.mismatches.load());
+	}
+
+	if (output_file && output_file != stdout) {
+		vm->output.set_sink(stdout, true);
+		fclose(output_file);
+	}
 
-	return 0;
+	return interrupt_requested() ? -2 : 0;
 }
\ No newline at end of file
@@ -0,0 +1,266 @@
+#include "metrics.h"
+#include "LC3VM.h"
+
+#include <string.h>
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef int socklen_t;
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+using namespace LC3VM;
+
+namespace {
+	const intptr_t NO_SOCKET = -1;
+	const size_t MAX_REQUEST = 4096; // Bytes read of a request, only its first line matters
+	const long POLL_MS = 100; // How long stop() may wait for the server thread
+
+	// A scraper that hangs up early must not kill the process with SIGPIPE
+#if defined(MSG_NOSIGNAL)
+	const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+	const int SEND_FLAGS = 0;
+#endif
+
+	void close_socket(intptr_t s) {
+#if defined(_WIN32)
+		closesocket((SOCKET)s);
+#else
+		close((int)s);
+#endif
+	}
+
+	// Wait up to POLL_MS for s to become readable
+	bool readable(intptr_t s) {
+		fd_set set;
+		FD_ZERO(&set);
+		FD_SET(s, &set);
+		timeval timeout = { 0, POLL_MS * 1000 };
+		return select((int)s + 1, &set, nullptr, nullptr, &timeout) > 0;
+	}
+
+	void family(std::string& out, const char* name, const char* type, const char* help) {
+		out += std::string("# HELP ") + name + " " + help + "\n";
+		out += std::string("# TYPE ") + name + " " + type + "\n";
+	}
+
+	void sample(std::string& out, const char* name, const std::string& labels, double value) {
+		char number[32];
+		snprintf(number, sizeof(number), "%.17g", value);
+		out += name;
+		if (!labels.empty()) {
+			out += "{" + labels + "}";
+		}
+		out += std::string(" ") + number + "\n";
+	}
+
+	void sample(std::string& out, const char* name, const std::string& labels, uint64_t value) {
+		out += name;
+		if (!labels.empty()) {
+			out += "{" + labels + "}";
+		}
+		out += " " + std::to_string(value) + "\n";
+	}
+}
+
+void MetricsSnapshot::add(const Metrics& metrics) {
+	instructions += metrics.instructions.load(std::memory_order_relaxed);
+	slices += metrics.slices.load(std::memory_order_relaxed);
+	run_ns += metrics.run_ns.load(std::memory_order_relaxed);
+	input_wait_ns += metrics.input_wait_ns.load(std::memory_order_relaxed);
+	idle_instructions += metrics.idle_instructions.load(std::memory_order_relaxed);
+	output_bytes += metrics.output_bytes.load(std::memory_order_relaxed);
+	for (int v = 0; v < TRAP_VECTORS; v++) {
+		traps[v] += metrics.traps[v].load(std::memory_order_relaxed);
+	}
+}
+
+std::string LC3VM::format_prometheus(const MetricsSnapshot& metrics, const std::string& labels) {
+	std::string out;
+	family(out, "lc3vm_instructions_total", "counter", "Instructions retired.");
+	sample(out, "lc3vm_instructions_total", labels, metrics.instructions);
+	family(out, "lc3vm_idle_instructions_total", "counter", "Instructions of idle keyboard loops retired without executing them.");
+	sample(out, "lc3vm_idle_instructions_total", labels, metrics.idle_instructions);
+	family(out, "lc3vm_slices_total", "counter", "Slices run.");
+	sample(out, "lc3vm_slices_total", labels, metrics.slices);
+	family(out, "lc3vm_run_seconds_total", "counter", "Wall time spent running slices.");
+	sample(out, "lc3vm_run_seconds_total", labels, metrics.run_ns / 1e9);
+	family(out, "lc3vm_mips", "gauge", "Millions of instructions retired per second of running.");
+	sample(out, "lc3vm_mips", labels, metrics.mips());
+	family(out, "lc3vm_input_wait_seconds_total", "counter", "Time blocked on a key in GETC, IN or an idle KBSR loop.");
+	sample(out, "lc3vm_input_wait_seconds_total", labels, metrics.input_wait_ns / 1e9);
+	family(out, "lc3vm_output_bytes_total", "counter", "Bytes of console output written.");
+	sample(out, "lc3vm_output_bytes_total", labels, metrics.output_bytes);
+
+	family(out, "lc3vm_traps_total", "counter", "TRAP instructions executed, by vector.");
+	for (int v = 0; v < TRAP_VECTORS; v++) {
+		if (metrics.traps[v]) {
+			char vector[32];
+			snprintf(vector, sizeof(vector), "vector=\"x%02X\"", v);
+			sample(out, "lc3vm_traps_total", labels.empty() ? vector : labels + "," + vector, metrics.traps[v]);
+		}
+	}
+	return out;
+}
+
+Metrics& MetricsShards::add_shard() {
+	std::lock_guard<std::mutex> guard(lock);
+	shards.emplace_back();
+	return shards.back();
+}
+
+MetricsSnapshot MetricsShards::total() const {
+	MetricsSnapshot sum;
+	std::lock_guard<std::mutex> guard(lock);
+	for (const Metrics& shard : shards) {
+		sum.add(shard);
+	}
+	return sum;
+}
+
+MetricsServer::MetricsServer(std::function<std::string()> body)
+	: body(body), listener(NO_SOCKET), bound_port(0), stopping(false) {}
+
+MetricsServer::~MetricsServer() {
+	stop();
+}
+
+bool MetricsServer::start(uint16_t port) {
+#if defined(_WIN32)
+	WSADATA wsa;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+		return false;
+	}
+#endif
+	listener = (intptr_t)socket(AF_INET, SOCK_STREAM, 0);
+	if (listener == NO_SOCKET) {
+		return false;
+	}
+	int yes = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t length = sizeof(address);
+	if (bind(listener, (const sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 8) != 0
+		|| getsockname(listener, (sockaddr*)&address, &length) != 0) {
+		close_socket(listener);
+		listener = NO_SOCKET;
+		return false;
+	}
+	bound_port = ntohs(address.sin_port);
+	stopping = false;
+	thread = std::thread(&MetricsServer::serve, this);
+	return true;
+}
+
+void MetricsServer::stop() {
+	if (!thread.joinable()) {
+		return;
+	}
+	stopping = true;
+	thread.join();
+	close_socket(listener);
+	listener = NO_SOCKET;
+}
+
+void MetricsServer::serve() {
+	while (!stopping) {
+		if (!readable(listener)) {
+			continue;
+		}
+		intptr_t connection = (intptr_t)accept(listener, nullptr, nullptr);
+		if (connection != NO_SOCKET) {
+			answer(connection);
+			close_socket(connection);
+		}
+	}
+}
+
+void MetricsServer::answer(intptr_t connection) {
+	// Scrapers send the whole request at once, the first line is enough to answer it
+	std::string request;
+	char chunk[512];
+	while (request.find("\r\n") == std::string::npos && request.size() < MAX_REQUEST && readable(connection)) {
+		int n = recv(connection, chunk, sizeof(chunk), 0);
+		if (n <= 0) {
+			break;
+		}
+		request.append(chunk, (size_t)n);
+	}
+
+	std::string response;
+	if (request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 14, "GET /metrics?") == 0) {
+		std::string text = body();
+		response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+			+ std::to_string(text.size()) + "\r\nConnection: close\r\n\r\n" + text;
+	}
+	else {
+		response = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+	}
+	size_t sent = 0;
+	while (sent < response.size()) {
+		int n = send(connection, response.data() + sent, (int)(response.size() - sent), SEND_FLAGS);
+		if (n <= 0) {
+			break;
+		}
+		sent += (size_t)n;
+	}
+}
+
+void Machine::attach_metrics(Metrics* target) {
+	// Output written while nothing was counting is not counted later
+	if (!metrics) {
+		slice_metrics.output_written = output.written();
+	}
+	metrics = target;
+}
+
+void Machine::publish_metrics(uint32_t executed, uint32_t idle, std::chrono::nanoseconds elapsed) {
+	Metrics& m = *metrics;
+	m.instructions.fetch_add(executed, std::memory_order_relaxed);
+	m.slices.fetch_add(1, std::memory_order_relaxed);
+	m.run_ns.fetch_add((uint64_t)elapsed.count(), std::memory_order_relaxed);
+	if (idle) {
+		m.idle_instructions.fetch_add(idle, std::memory_order_relaxed);
+	}
+
+	uint64_t written = output.written();
+	if (written != slice_metrics.output_written) {
+		m.output_bytes.fetch_add(written - slice_metrics.output_written, std::memory_order_relaxed);
+		slice_metrics.output_written = written;
+	}
+	if (slice_metrics.input_wait_ns) {
+		m.input_wait_ns.fetch_add(slice_metrics.input_wait_ns, std::memory_order_relaxed);
+		slice_metrics.input_wait_ns = 0;
+	}
+	if (slice_metrics.trap_count) {
+		for (int v = 0; v < TRAP_VECTORS; v++) {
+			if (slice_metrics.traps[v]) {
+				m.traps[v].fetch_add(slice_metrics.traps[v], std::memory_order_relaxed);
+				slice_metrics.traps[v] = 0;
+			}
+		}
+		slice_metrics.trap_count = 0;
+	}
+}
+
+uint16_t Machine::wait_for_key() {
+	if (!metrics || keyboard->ready()) {
+		return keyboard->wait();
+	}
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	uint16_t key = keyboard->wait();
+	std::chrono::nanoseconds waited = std::chrono::steady_clock::now() - start;
+	slice_metrics.input_wait_ns += (uint64_t)waited.count();
+	return key;
+}
@@ -0,0 +1,111 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/*
+Runtime counters of machines in production.
+
+A machine with Metrics attached (Machine::attach_metrics) counts into plain
+integers of its own while it runs and adds them to the attached Metrics
+once per run_slice(), with relaxed atomic adds, so nothing is shared per
+instruction and the counters can be read from any thread at any time. Every
+slice also reads the clock twice. Without Metrics attached none of this
+happens.
+
+Several machines may share one Metrics; hosts running machines on a pool of
+threads give every thread a shard of its own (MetricsShards) and add the
+shards up when they are read. format_prometheus() writes counters in the
+Prometheus text exposition format, and MetricsServer serves that over HTTP.
+*/
+
+namespace LC3VM {
+	const int TRAP_VECTORS = 256;
+
+	// Counters shared between the machines counting into them and the threads reading them
+	struct Metrics {
+		std::atomic<uint64_t> instructions{ 0 }; // Retired, the iterations idle loops skipped included
+		std::atomic<uint64_t> slices{ 0 };
+		std::atomic<uint64_t> run_ns{ 0 }; // Wall time inside run_slice()
+		std::atomic<uint64_t> input_wait_ns{ 0 }; // Blocked in GETC/IN, or asleep in an idle KBSR loop until a key came
+		std::atomic<uint64_t> idle_instructions{ 0 }; // Of instructions, those idle loops retired without executing
+		std::atomic<uint64_t> output_bytes{ 0 };
+		std::atomic<uint64_t> traps[TRAP_VECTORS] = {}; // TRAPs executed per vector
+	};
+
+	// What a machine counted during the current slice, only touched by the thread running it
+	struct SliceMetrics {
+		uint32_t traps[TRAP_VECTORS] = {};
+		uint32_t trap_count = 0; // Sum of traps, nothing to add while it is 0
+		uint64_t input_wait_ns = 0;
+		uint64_t output_written = 0; // OutputBuffer::written() when the counts were last added
+	};
+
+	// A copy of Metrics at one point, or the sum of several
+	struct MetricsSnapshot {
+		uint64_t instructions = 0;
+		uint64_t slices = 0;
+		uint64_t run_ns = 0;
+		uint64_t input_wait_ns = 0;
+		uint64_t idle_instructions = 0;
+		uint64_t output_bytes = 0;
+		uint64_t traps[TRAP_VECTORS] = {};
+
+		void add(const Metrics& metrics);
+
+		// Average speed while running, 0 before anything ran
+		double mips() const { return run_ns ? instructions * 1e3 / run_ns : 0; }
+	};
+
+	/*
+	The counters in the Prometheus text format, one family per counter with
+	HELP and TYPE lines and traps labelled by vector. labels (such as
+	`job="a"`) is added to every sample.
+	*/
+	std::string format_prometheus(const MetricsSnapshot& metrics, const std::string& labels = "");
+
+	// One Metrics per thread, read as their sum
+	class MetricsShards {
+	public:
+		// A new shard, valid as long as this object
+		Metrics& add_shard();
+
+		MetricsSnapshot total() const;
+
+	private:
+		mutable std::mutex lock;
+		std::deque<Metrics> shards; // Never moves a shard once added
+	};
+
+	/*
+	Serves GET /metrics on 127.0.0.1:port from a thread of its own, every
+	request gets a fresh body from the callback. Anything else is answered
+	with 404.
+	*/
+	class MetricsServer {
+	public:
+		explicit MetricsServer(std::function<std::string()> body);
+		~MetricsServer();
+
+		// Start listening, port 0 picks a free one. False if the port could not be opened.
+		bool start(uint16_t port);
+		void stop();
+
+		uint16_t port() const { return bound_port; }
+
+	private:
+		std::function<std::string()> body;
+		intptr_t listener;
+		uint16_t bound_port;
+		std::atomic<bool> stopping;
+		std::thread thread;
+
+		void serve();
+		void answer(intptr_t connection);
+	};
+}
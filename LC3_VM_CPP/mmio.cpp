@@ -0,0 +1,134 @@
+#include "mmio.h"
+#include "LC3VM.h"
+#include "ops.h"
+
+#include <string.h>
+
+using namespace LC3VM;
+
+IoMap::IoMap() {
+	memset(page, 0, sizeof(page));
+	memset(count, 0, sizeof(count));
+}
+
+void IoMap::map(uint16_t address, DeviceRegister reg) {
+	uint8_t p = address >> 8;
+	if (!slots[p]) {
+		slots[p].reset(new Slot[256]());
+	}
+	Slot& slot = slots[p][address & 0xFF];
+	if (!slot.mapped) {
+		slot.mapped = true;
+		count[p]++;
+	}
+	slot.reg = reg;
+	page[p] = 1;
+}
+
+void IoMap::unmap(uint16_t address) {
+	uint8_t p = address >> 8;
+	if (!slots[p] || !slots[p][address & 0xFF].mapped) {
+		return;
+	}
+	slots[p][address & 0xFF].mapped = false;
+	if (--count[p] == 0) {
+		page[p] = 0;
+		slots[p].reset();
+	}
+}
+
+const DeviceRegister* IoMap::find(uint16_t address) const {
+	const Slot* s = slots[address >> 8].get();
+	if (!s || !s[address & 0xFF].mapped) {
+		return nullptr;
+	}
+	return &s[address & 0xFF].reg;
+}
+
+uint16_t Machine::io_read(uint16_t address) {
+	const DeviceRegister* r = io.find(address);
+	if (r && r->read) {
+		return r->read(*this, address);
+	}
+	return memory[address];
+}
+
+void Machine::io_write(uint16_t address, uint16_t val) {
+	const DeviceRegister* r = io.find(address);
+	if (r && r->write) {
+		r->write(*this, address, val);
+		return;
+	}
+	ram_write(address, val);
+}
+
+void Machine::map_device(uint16_t address, DeviceRegister reg) {
+	io.map(address, reg);
+	// Compiled code decided statically which accesses are I/O
+	if (jit) {
+		jit->flush();
+	}
+}
+
+void Machine::unmap_device(uint16_t address) {
+	io.unmap(address);
+	if (jit) {
+		jit->flush();
+	}
+}
+
+void LC3VM::latch_key(Machine& vm) {
+	uint16_t key;
+	if (!(vm.memory[MR_KBSR] & KBSR_READY) && vm.keyboard->poll(key)) {
+		vm.memory[MR_KBDR] = key;
+		vm.memory[MR_KBSR] |= KBSR_READY;
+		if (vm.memory[MR_KBSR] & KBSR_IE) {
+			vm.interrupt_pending = 1;
+		}
+	}
+}
+
+namespace {
+	// Reading KBSR polls the keyboard unless a key is latched already
+	uint16_t read_kbsr(Machine& vm, uint16_t address) {
+		vm.output.before_input();
+		latch_key(vm);
+		return vm.memory[MR_KBSR];
+	}
+
+	// Only the interrupt enable bit is writable
+	void write_kbsr(Machine& vm, uint16_t address, uint16_t val) {
+		vm.memory[MR_KBSR] = (uint16_t)((vm.memory[MR_KBSR] & KBSR_READY) | (val & KBSR_IE));
+		vm.interrupt_pending = 1;
+	}
+
+	// Reading the key releases the latch
+	uint16_t read_kbdr(Machine& vm, uint16_t address) {
+		vm.memory[MR_KBSR] &= (uint16_t)~KBSR_READY;
+		return vm.memory[MR_KBDR];
+	}
+
+	uint16_t read_psr(Machine& vm, uint16_t address) {
+		return vm.get_psr();
+	}
+
+	// Ignored in user mode, lowering the priority may let a waiting interrupt in
+	void write_psr(Machine& vm, uint16_t address, uint16_t val) {
+		if (!(vm.psr & PSR_USER)) {
+			vm.set_psr(val);
+			vm.interrupt_pending = 1;
+		}
+	}
+}
+
+void LC3VM::map_keyboard(Machine& vm) {
+	DeviceRegister kbsr = { read_kbsr, write_kbsr };
+	DeviceRegister kbdr = { read_kbdr, nullptr };
+	vm.map_device(MR_KBSR, kbsr);
+	vm.map_device(MR_KBDR, kbdr);
+}
+
+void LC3VM::map_psr(Machine& vm) {
+	DeviceRegister psr = { read_psr, write_psr };
+	vm.map_device(MR_PSR, psr);
+}
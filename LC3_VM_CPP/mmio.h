@@ -0,0 +1,64 @@
+#pragma once
+#include <stdint.h>
+#include <memory>
+
+/*
+Memory mapped I/O.
+
+Memory is split into 256 pages of 256 words. A page that holds at least one
+device register is an I/O page, and only accesses to I/O pages leave the fast
+path in mem_read/mem_write. Inside an I/O page, each mapped address has a pair
+of read/write hooks; unmapped addresses and null hooks behave like plain RAM.
+The device registers keep their current value in memory[], so the machine's
+memory array is all the state a device exposes to the program.
+
+Instruction fetch reads memory[] directly and never goes through the hooks.
+*/
+
+namespace LC3VM {
+	class Machine;
+
+	const uint16_t MMIO_BASE = 0xFE00; // Start of the address range reserved for devices
+
+	// Hooks for one memory mapped register
+	struct DeviceRegister {
+		uint16_t (*read)(Machine& vm, uint16_t address); // nullptr reads memory[address]
+		void (*write)(Machine& vm, uint16_t address, uint16_t val); // nullptr is a plain RAM write
+	};
+
+	class IoMap {
+	public:
+		IoMap();
+
+		// Route accesses to address through the hooks of reg
+		void map(uint16_t address, DeviceRegister reg);
+		void unmap(uint16_t address);
+
+		bool is_io(uint16_t address) const { return page[address >> 8] != 0; }
+
+		// The hooks mapped at address, nullptr if there are none
+		const DeviceRegister* find(uint16_t address) const;
+
+		// One byte per page, non-zero for I/O pages
+		const uint8_t* pages() const { return page; }
+
+	private:
+		struct Slot {
+			DeviceRegister reg;
+			bool mapped;
+		};
+
+		uint8_t page[256]; // 1 for I/O pages, read by compiled code so kept as bytes
+		uint16_t count[256]; // Mapped registers in each page
+		std::unique_ptr<Slot[]> slots[256]; // Allocated for I/O pages only
+	};
+
+	// Map the keyboard status and data registers (KBSR/KBDR) of vm
+	void map_keyboard(Machine& vm);
+
+	// Move a waiting key into KBDR unless one is latched already, raising the keyboard interrupt if it is enabled
+	void latch_key(Machine& vm);
+
+	// Map the processor status register (PSR) of vm
+	void map_psr(Machine& vm);
+}
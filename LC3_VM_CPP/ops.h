@@ -0,0 +1,381 @@
+#pragma once
+
+#include "LC3VM.h"
+
+/*
+Definitions of the memory accessors and opcode handlers.
+They live in a header so that every dispatch engine can inline them into its
+loop instead of paying a call per instruction.
+*/
+
+namespace LC3VM {
+
+inline void Machine::ram_write(uint16_t address, uint16_t val) {
+	memory[address] = val;
+	dirty_pages[address / PAGE_WORDS] = 1;
+	if (decoded) {
+		decoded[address].handler = H_UNDECODED;
+		if (jit && jit->coverage()[address]) {
+			jit->invalidate(address);
+		}
+		if (aot && aot->covers(address)) {
+			aot->invalidate(address);
+		}
+	}
+}
+
+inline void Machine::mem_write(uint16_t address, uint16_t val) {
+	if (tracer) {
+		tracer->store(address, val);
+	}
+	// Memory mapped registers are looked up in the I/O page table, everything else is RAM
+	if (io.is_io(address)) {
+		io_write(address, val);
+		return;
+	}
+	ram_write(address, val);
+}
+
+inline uint16_t Machine::mem_read(uint16_t address) {
+	if (io.is_io(address)) {
+		return io_read(address);
+	}
+	return memory[address];
+}
+
+inline uint16_t sign_extend(uint16_t x, int bit_count) {
+	if ((x >> (bit_count - 1)) & 1) {
+		x |= (0xFFFF << bit_count);
+	}
+	return x;
+}
+
+inline uint16_t flags_of(uint16_t value) {
+	if (value == 0) {
+		return FL_ZRO;
+	}
+	else if (value >> 15) {	// A 1 in the leftmost bit indicates that it is negative
+		return FL_NEG;
+	}
+	else {
+		return FL_POS;
+	}
+}
+
+inline void Machine::update_flags(uint16_t r) {
+	// Only remember the result, flags_of() turns it into N/Z/P when a BR or store_flags() asks
+	flag_value = reg[r];
+}
+
+inline void Machine::load_flags() {
+	switch (reg[R_COND]) {
+	case FL_NEG: flag_value = 0x8000; break;
+	case FL_POS: flag_value = 1; break;
+	default: flag_value = 0; break;
+	}
+}
+
+inline void Machine::store_flags() {
+	reg[R_COND] = flags_of(flag_value);
+}
+
+inline uint16_t Machine::get_psr() const {
+	return psr | flags_of(flag_value);
+}
+
+inline void Machine::set_psr(uint16_t value) {
+	psr = value & (PSR_USER | PSR_PRIORITY);
+	reg[R_COND] = value & FL_NEG ? FL_NEG : value & FL_ZRO ? FL_ZRO : FL_POS;
+	load_flags();
+}
+
+inline void Machine::check_interrupts() {
+	if (interrupt_pending) {
+		service_interrupts();
+	}
+}
+
+template <bool Imm> inline void Machine::op_add(uint16_t instr) {
+	uint16_t r0 = (instr >> 9) & 0x7;					
+	uint16_t r1 = (instr >> 6) & 0x7;				
+	if (Imm) {
+		uint16_t imm5 = sign_extend(instr & 0x1F, 5);
+		reg[r0] = reg[r1] + imm5;							
+	}
+	else {
+		uint16_t r2 = instr & 0x7;
+		reg[r0] = reg[r1] + reg[r2];					
+	}
+	update_flags(r0);										
+}
+
+inline void Machine::op_add(uint16_t instr) {
+	uint16_t imm_flag = (instr >> 5) & 0x1;			
+	if (imm_flag) {
+		op_add<true>(instr);
+	}
+	else {
+		op_add<false>(instr);
+	}
+}
+
+template <bool Imm> inline void Machine::op_and(uint16_t instr) {
+	/*
+	The binary encoding of AND is basically exactly the same as ADD
+	The implementation here is therefore essentially the same as the above, but now replace + by bitwise AND
+	*/
+	uint16_t r0 = (instr >> 9) & 0x7;					
+	uint16_t r1 = (instr >> 6) & 0x7;						
+	if (Imm) {
+		uint16_t imm5 = sign_extend(instr & 0x1F, 5);
+		reg[r0] = reg[r1] & imm5;							
+	}
+	else {
+		uint16_t r2 = instr & 0x7;
+		reg[r0] = reg[r1] & reg[r2];					
+	}
+	update_flags(r0);
+}
+
+inline void Machine::op_and(uint16_t instr) {
+	uint16_t imm_flag = (instr >> 5) & 0x1;				
+	if (imm_flag) {
+		op_and<true>(instr);
+	}
+	else {
+		op_and<false>(instr);
+	}
+}
+
+inline void Machine::op_not(uint16_t instr) {
+	/*
+	The encoding of NOT is
+	15 12  11   9 8  6 5 4    0
+	1001      DR   SR  1  1111
+	Unlike ADD and AND this only has one source operand.
+	*/
+	uint16_t r0 = (instr >> 9) & 0x7;					
+	uint16_t r1 = (instr >> 6) & 0x7;						
+	reg[r0] = ~reg[r1];
+	update_flags(r0);
+}
+
+inline void Machine::take_branch(uint16_t instr) {
+	uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);		
+	reg[R_PC] += pc_offset;					
+	// One or two words back, this may be a loop waiting for a key
+	if ((uint16_t)(pc_offset + 2) < 2) {
+		check_idle(instr);
+	}
+}
+
+template <uint16_t NZP> inline void Machine::op_br(uint16_t instr) {
+	// BRnzp needs no look at the flags and BR with none of n, z and p set never branches
+	if (NZP == 0x7 || (NZP & flags_of(flag_value))) {
+		take_branch(instr);
+	}
+	check_interrupts();
+}
+
+inline void Machine::op_br(uint16_t instr) {
+	/*
+	The encoding of BR is
+	15  12  11  10   9    8           0
+	0000     n   z   p      PCoffset9
+	n, z and p stand for each condition code (negative, zero, positive).
+	PCoffset9 is telling us to add to the program counter.
+	Branch instructions specify condition codes.
+	If specified condition codes are set, the branch is taken, by setting the PC to address specified in instruction.
+	Ekse, the next instruction is executed (+1 from current PC)
+	*/
+	uint16_t cond_flag = (instr >> 9) & 0x7;			
+	if (cond_flag & flags_of(flag_value)) {						
+		take_branch(instr);
+	}
+	check_interrupts();
+}
+
+inline void Machine::op_jmp(uint16_t instr) {
+	/*
+	The encoding of JMP is
+	15 12 11  9  8   6   5    0
+	1100   000   BaseR   000000
+
+	JMP is an unconditional branch ('jump')
+	It sets PC = BaseR
+	*/
+	uint16_t BaseR = (instr >> 6) & 0x7;				
+	reg[R_PC] = reg[BaseR];
+	check_interrupts();
+}
+
+template <bool Offset> inline void Machine::op_jsr(uint16_t instr) {
+	reg[R_R7] = reg[R_PC];							
+	if (Offset) {									
+		uint16_t pc_offset = sign_extend(instr & 0x7FF, 11);
+		reg[R_PC] += pc_offset;
+	}
+	else {
+		uint16_t BaseR = (instr >> 6) & 0x7;
+		reg[R_PC] = reg[BaseR];
+	}
+	if (intrinsics) {
+		const Intrinsic* native = intrinsics->at(reg[R_PC]);
+		if (native) {
+			call_native(*native, reg[R_PC]);
+		}
+	}
+	check_interrupts();
+}
+
+inline void Machine::op_jsr(uint16_t instr) {
+	/*
+	The encoding of JSR is
+	15 12 11 10           0
+	0100   1    PCoffset11
+	The encoding of JSRR is
+	15 12 11 10  9 8    6   5      0
+	0100   0   00   BaseR    000000
+
+	JSR is jump to subroutine.
+	The bit 11 in the instruction tells is a flag to execute JSR or JSRR.
+	*/
+	uint16_t flag = (instr >> 11) & 1;				
+	if (flag == 1) {									
+		op_jsr<true>(instr);
+	}
+	else {
+		op_jsr<false>(instr);
+	}
+}
+
+inline void Machine::op_ld(uint16_t instr) {
+	/*
+	The encoding of LD is
+	15 12 11 9  8         0
+	0010   DR    PCoffset9
+
+	LD is a load instruction.
+	*/
+	uint16_t dr = (instr >> 9) & 0x7;				
+	uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);		
+	reg[dr] = mem_read(reg[R_PC] + pc_offset);
+	update_flags(dr);
+}
+
+inline void Machine::op_ldi(uint16_t instr) {
+	/*
+	The encoding of LDI is
+	15 12  11 9  8         0
+	1010    DR    PCoffset9
+
+	The operation is similar to LD, but instead it addresses memory using an address stored somewhere in memory
+	LDI does the operation DR = mem[mem[PC^+ + SEXT(PCoffset9)]]
+	as opposed to LD which was DR = mem[PC^+ + SEXT(PCoffset9)]
+	*/
+	uint16_t r0 = (instr >> 9) & 0x7;						
+	uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);	
+	reg[r0] = mem_read(mem_read(reg[R_PC] + pc_offset));	
+	update_flags(r0);
+}
+
+inline void Machine::op_ldr(uint16_t instr) {
+	/*
+	The encoding of LDR is
+	15 12 11 9  8   6   5     0
+	0110   DR   BaseR   offset6
+
+	LDR stands for Load Base + offset.
+	This differs from the previous LD-type instructions by doing
+	DR = mem[BaseR + SEXT(offset6)]
+	*/
+	uint16_t dr = (instr >> 9) & 0x7;			
+	uint16_t r1 = (instr >> 6) & 0x7;					
+	uint16_t pc_offset = sign_extend(instr & 0x3F, 6);	
+	reg[dr] = mem_read(reg[r1] + pc_offset);
+	update_flags(dr);
+}
+
+inline void Machine::op_lea(uint16_t instr) {
+	/*
+	The encoding of LEA is
+	15 12  11 9   8         0
+	1110    DR     PCoffset9
+
+	LEA is load effective address.
+	*/
+	uint16_t dr = (instr >> 9) & 0x7;					
+	uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);	
+	reg[dr] = reg[R_PC] + pc_offset;
+	update_flags(dr);
+}
+
+inline void Machine::op_st(uint16_t instr) {
+	/*
+	The encoding of ST is
+	15  12  11 9  8         0
+	0011    SR     PCoffset9
+
+	ST is store.
+	*/
+	uint16_t sr = (instr >> 9) & 0x7;				
+	uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);		
+	mem_write(reg[R_PC] + pc_offset, reg[sr]);
+}
+
+inline void Machine::op_sti(uint16_t instr) {
+	/*
+	The encoding of STI is
+	15  12  11 9  8         0
+	0011    SR     PCoffset9
+
+	STI is store indirect, similar to the load case.
+	*/
+	uint16_t sr = (instr >> 9) & 0x7;				
+	uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);	
+	mem_write(mem_read(reg[R_PC] + pc_offset), reg[sr]);
+}
+
+inline void Machine::op_str(uint16_t instr) {
+	/*
+	The encoding of STR is
+	15 12 11 9 8    6   5      0
+	0111   SR   BaseR   offset6
+
+	STR is store base + offset, similar to the load case.
+	*/
+	uint16_t sr = (instr >> 9) & 0x7;			
+	uint16_t baser = (instr >> 6) & 0x7;				
+	uint16_t pc_offset = sign_extend(instr & 0x3F, 6);	
+	mem_write(reg[baser] + pc_offset, reg[sr]);
+}
+
+inline void Machine::op_res(uint16_t instr) {
+	// The reserved opcode raises the illegal opcode exception
+	enter_interrupt(INT_ILLEGAL_OPCODE, (psr & PSR_PRIORITY) >> PSR_PRIORITY_SHIFT);
+}
+
+inline void Machine::op_rti(uint16_t instr) {
+	/*
+	RTI returns from an interrupt or exception handler: PC and PSR are popped off
+	the supervisor stack, and R6 goes back to the user stack if the PSR popped
+	is in user mode. In user mode it raises the privilege mode exception instead.
+	*/
+	if (psr & PSR_USER) {
+		enter_interrupt(INT_PRIVILEGE, (psr & PSR_PRIORITY) >> PSR_PRIORITY_SHIFT);
+		return;
+	}
+	reg[R_PC] = mem_read(reg[R_R6]);
+	uint16_t popped = mem_read(reg[R_R6] + 1);
+	reg[R_R6] += 2;
+	set_psr(popped);
+	if (psr & PSR_USER) {
+		saved_ssp = reg[R_R6];
+		reg[R_R6] = saved_usp;
+	}
+	// The priority may have dropped below a device that is still waiting
+	interrupt_pending = 1;
+	check_interrupts();
+}
+
+}
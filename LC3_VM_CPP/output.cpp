@@ -0,0 +1,67 @@
+#include "output.h"
+
+#include <string.h>
+
+OutputBuffer::OutputBuffer(FILE* sink, size_t capacity)
+	: sink(sink), interactive(true), buf(capacity ? capacity : 1), used(0), flushed(0),
+	interval(50), last_flush(std::chrono::steady_clock::now()) {}
+
+OutputBuffer::~OutputBuffer() {
+	flush();
+}
+
+void OutputBuffer::set_sink(FILE* file, bool is_interactive) {
+	flush();
+	sink = file;
+	interactive = is_interactive;
+}
+
+void OutputBuffer::set_flush_interval(uint32_t milliseconds) {
+	interval = std::chrono::milliseconds(milliseconds);
+}
+
+char* OutputBuffer::reserve(size_t n) {
+	if (buf.size() - used < n) {
+		flush();
+		if (buf.size() < n) {
+			buf.resize(n);
+		}
+	}
+	return buf.data() + used;
+}
+
+void OutputBuffer::write(const char* data, size_t n) {
+	memcpy(reserve(n), data, n);
+	commit(n);
+}
+
+void OutputBuffer::flush() {
+	if (used) {
+		if (sink) {
+			fwrite(buf.data(), 1, used, sink);
+			fflush(sink);
+		}
+		else {
+			capture.append(buf.data(), used);
+		}
+		flushed += used;
+		used = 0;
+	}
+	last_flush = std::chrono::steady_clock::now();
+}
+
+void OutputBuffer::tick() {
+	if (!used || !interactive || interval.count() == 0) {
+		return;
+	}
+	if (std::chrono::steady_clock::now() - last_flush >= interval) {
+		flush();
+	}
+}
+
+std::string OutputBuffer::take_captured() {
+	flush();
+	std::string result;
+	result.swap(capture);
+	return result;
+}
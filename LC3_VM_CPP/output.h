@@ -0,0 +1,79 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <chrono>
+
+/*
+Console output of the VM.
+
+The output traps append to a buffer owned by the machine instead of writing to
+the console one character at a time. The buffer is handed to the sink in one
+write when it fills up, when the program is about to wait for a key (GETC, IN,
+KBSR polling), on HALT, and in interactive mode once the flush interval has
+passed since the last flush (checked between run slices by Machine::run).
+
+Without a sink the output is collected in memory instead, see captured().
+*/
+
+class OutputBuffer {
+public:
+	explicit OutputBuffer(FILE* sink = stdout, size_t capacity = 4096);
+	~OutputBuffer();
+
+	OutputBuffer(const OutputBuffer&) = delete;
+	OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+	/*
+	Where flushed output goes. nullptr keeps all output in memory.
+	Interactive sinks are a terminal someone is watching: they are flushed before
+	every input wait and on the timer. Non-interactive sinks (files and pipes) are
+	only written when the buffer is full and at the end of the program.
+	*/
+	void set_sink(FILE* file, bool interactive);
+	void set_flush_interval(uint32_t milliseconds); // 0 disables the timer
+
+	void put(char c) {
+		if (used == buf.size()) {
+			flush();
+		}
+		buf[used++] = c;
+	}
+
+	// Room for n more characters, fill some of them and commit() the number written
+	char* reserve(size_t n);
+	void commit(size_t n) { used += n; }
+
+	void write(const char* data, size_t n);
+
+	// Write the buffer to the sink
+	void flush();
+
+	// The program is about to wait for or poll input
+	void before_input() {
+		if (interactive && used) {
+			flush();
+		}
+	}
+
+	// Flush if the interval has passed since the last flush
+	void tick();
+
+	// Bytes put into the buffer since it was created, flushed or not
+	uint64_t written() const { return flushed + used; }
+
+	// Output collected without a sink, take_captured() also clears it
+	const std::string& captured() const { return capture; }
+	std::string take_captured();
+
+private:
+	FILE* sink;
+	bool interactive;
+	std::vector<char> buf;
+	size_t used;
+	uint64_t flushed; // Bytes that left buf
+	std::string capture;
+	std::chrono::milliseconds interval;
+	std::chrono::steady_clock::time_point last_flush;
+};
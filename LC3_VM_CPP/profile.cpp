@@ -0,0 +1,131 @@
+#include "profile.h"
+#include "LC3VM.h"
+
+#include <algorithm>
+#include <string>
+
+using namespace LC3VM;
+
+namespace {
+	const uint16_t MAX_DEPTH = 256; // Deeper recursion is counted in the deepest frame
+
+	const char* const OPCODE_NAMES[16] = {
+		"BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+		"RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP",
+	};
+
+	const char* trap_name(int vector) {
+		switch (vector) {
+		case TRAP_GETC: return "GETC";
+		case TRAP_OUT: return "OUT";
+		case TRAP_PUTS: return "PUTS";
+		case TRAP_IN: return "IN";
+		case TRAP_PUTSP: return "PUTSP";
+		case TRAP_HALT: return "HALT";
+		default: return "?";
+		}
+	}
+
+	double percent(uint64_t part, uint64_t total) {
+		return total ? 100.0 * (double)part / (double)total : 0.0;
+	}
+}
+
+Profiler::Profiler() : opcodes(), trap_counts(), trap_ns(), pcs(MEMORY_MAX), current(0), overflow(0) {
+	Frame root = { 0, 0, 0 };
+	frames.push_back(root);
+	stack_counts.push_back(0);
+}
+
+void Profiler::call(uint16_t target) {
+	if (overflow || frames[current].depth >= MAX_DEPTH) {
+		overflow++;
+		return;
+	}
+	uint64_t key = ((uint64_t)current << 16) | target;
+	auto found = children.find(key);
+	if (found != children.end()) {
+		current = found->second;
+		return;
+	}
+	Frame frame = { current, target, (uint16_t)(frames[current].depth + 1) };
+	uint32_t index = (uint32_t)frames.size();
+	frames.push_back(frame);
+	stack_counts.push_back(0);
+	children[key] = index;
+	current = index;
+}
+
+void Profiler::ret() {
+	if (overflow) {
+		overflow--;
+		return;
+	}
+	// A RET without a matching call (or a JMP R7 used as a jump) stays at the root
+	current = frames[current].parent;
+}
+
+uint64_t Profiler::instructions() const {
+	uint64_t total = 0;
+	for (uint64_t n : opcodes) {
+		total += n;
+	}
+	return total;
+}
+
+void Profiler::report(FILE* out, size_t top_pcs) const {
+	uint64_t total = instructions();
+	fprintf(out, "instructions: %llu\n", (unsigned long long)total);
+
+	fprintf(out, "\nopcode        count       %%\n");
+	int order[16];
+	for (int i = 0; i < 16; i++) {
+		order[i] = i;
+	}
+	std::sort(order, order + 16, [&](int a, int b) { return opcodes[a] > opcodes[b]; });
+	for (int i : order) {
+		if (opcodes[i]) {
+			fprintf(out, "%-6s %12llu  %6.2f\n", OPCODE_NAMES[i], (unsigned long long)opcodes[i], percent(opcodes[i], total));
+		}
+	}
+
+	std::vector<uint16_t> hot;
+	for (uint32_t pc = 0; pc < (uint32_t)MEMORY_MAX; pc++) {
+		if (pcs[pc]) {
+			hot.push_back((uint16_t)pc);
+		}
+	}
+	size_t shown = std::min(top_pcs, hot.size());
+	std::partial_sort(hot.begin(), hot.begin() + shown, hot.end(), [&](uint16_t a, uint16_t b) { return pcs[a] > pcs[b]; });
+	fprintf(out, "\naddress       count       %%\n");
+	for (size_t i = 0; i < shown; i++) {
+		fprintf(out, "x%04X  %12llu  %6.2f\n", hot[i], (unsigned long long)pcs[hot[i]], percent(pcs[hot[i]], total));
+	}
+
+	fprintf(out, "\ntrap          count     total ms    avg us\n");
+	for (int v = 0; v < 256; v++) {
+		if (trap_counts[v]) {
+			fprintf(out, "x%02X %-6s %8llu %12.3f %9.3f\n", v, trap_name(v), (unsigned long long)trap_counts[v],
+				(double)trap_ns[v] / 1e6, (double)trap_ns[v] / 1e3 / (double)trap_counts[v]);
+		}
+	}
+}
+
+void Profiler::write_folded(FILE* out) const {
+	char name[8];
+	for (size_t f = 0; f < frames.size(); f++) {
+		if (!stack_counts[f]) {
+			continue;
+		}
+		std::vector<uint16_t> entries;
+		for (uint32_t i = (uint32_t)f; i != 0; i = frames[i].parent) {
+			entries.push_back(frames[i].entry);
+		}
+		std::string line = "lc3";
+		for (size_t i = entries.size(); i-- > 0;) {
+			snprintf(name, sizeof(name), ";x%04X", entries[i]);
+			line += name;
+		}
+		fprintf(out, "%s %llu\n", line.c_str(), (unsigned long long)stack_counts[f]);
+	}
+}
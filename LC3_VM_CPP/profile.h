@@ -0,0 +1,69 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+/*
+Instruction-level profiler.
+
+While a Profiler is attached to a machine (Machine::profiler), run_slice()
+executes through the profiling instantiation of the switch core whatever the
+selected engine, and counts every instruction by opcode, by address and by the
+subroutine call stack it ran under, plus executions and wall time per trap
+vector. Without a profiler the normal cores run and nothing is counted.
+
+Call stacks are followed through JSR/JSRR and RET (JMP R7), which is how LC-3
+code calls subroutines by convention, and are written in the folded format
+that flamegraph.pl and similar tools read.
+*/
+
+namespace LC3VM {
+	class Profiler {
+	public:
+		Profiler();
+
+		// Called by the profiling core for every instruction before it executes
+		void instruction(uint16_t pc, uint16_t instr) {
+			opcodes[instr >> 12]++;
+			pcs[pc]++;
+			stack_counts[current]++;
+		}
+
+		// After a JSR/JSRR to target, and after a RET
+		void call(uint16_t target);
+		void ret();
+
+		// A trap that took the given time, waiting for input included
+		void trap(uint8_t vector, uint64_t nanoseconds) {
+			trap_counts[vector]++;
+			trap_ns[vector] += nanoseconds;
+		}
+
+		uint64_t instructions() const;
+
+		// Hot spots sorted by count: opcodes, the top addresses and the traps
+		void report(FILE* out, size_t top_pcs = 20) const;
+
+		// One line per call stack, "lc3;x3120;x3400 count"
+		void write_folded(FILE* out) const;
+
+	private:
+		struct Frame {
+			uint32_t parent; // Index into frames, the root is its own parent
+			uint16_t entry; // Address the subroutine was entered at
+			uint16_t depth;
+		};
+
+		uint64_t opcodes[16];
+		uint64_t trap_counts[256];
+		uint64_t trap_ns[256];
+		std::vector<uint64_t> pcs; // Indexed by address
+
+		std::vector<Frame> frames; // Every call stack seen, as a tree
+		std::vector<uint64_t> stack_counts; // Instructions run in each frame
+		std::unordered_map<uint64_t, uint32_t> children; // (frame << 16 | entry) to frame
+		uint32_t current;
+		uint32_t overflow; // Calls made past the maximum depth, not tracked as frames
+	};
+}
@@ -0,0 +1,223 @@
+#include "session.h"
+
+using namespace LC3VM;
+
+SessionInput::SessionInput() : available(0), closed(false) {}
+
+void SessionInput::push(const std::string& keys) {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		for (char c : keys) {
+			this->keys.push_back((uint8_t)c);
+		}
+		available.store(this->keys.size());
+	}
+	arrived.notify_all();
+}
+
+void SessionInput::close() {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		closed.store(true);
+	}
+	arrived.notify_all();
+}
+
+bool SessionInput::poll(uint16_t& key) {
+	// Programs polling KBSR mostly find nothing, keep that off the lock
+	if (available.load() == 0) {
+		return false;
+	}
+	std::lock_guard<std::mutex> guard(lock);
+	if (keys.empty()) {
+		return false;
+	}
+	key = keys.front();
+	keys.pop_front();
+	available.store(keys.size());
+	return true;
+}
+
+uint16_t SessionInput::wait() {
+	// The host only lets a machine read once ready(), this waits for callers that do not suspend
+	std::unique_lock<std::mutex> guard(lock);
+	arrived.wait(guard, [this] { return !keys.empty() || closed.load(); });
+	if (keys.empty()) {
+		return (uint16_t)EOF;
+	}
+	uint16_t key = keys.front();
+	keys.pop_front();
+	available.store(keys.size());
+	return key;
+}
+
+bool SessionInput::ready() const {
+	return available.load() != 0 || closed.load();
+}
+
+SessionHost::SessionHost(const SessionHostOptions& options)
+	: options(options), next_id(1), running(0), parked(0), stopping(false) {
+	unsigned threads = options.threads ? options.threads : std::thread::hardware_concurrency();
+	if (threads == 0) {
+		threads = 1;
+	}
+	for (unsigned i = 0; i < threads; i++) {
+		workers.emplace_back(&SessionHost::worker, this);
+	}
+}
+
+SessionHost::~SessionHost() {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	work.notify_all();
+	for (std::thread& t : workers) {
+		t.join();
+	}
+}
+
+SessionId SessionHost::open(std::unique_ptr<Machine> vm) {
+	std::shared_ptr<Session> session(new Session());
+	session->vm = std::move(vm);
+	session->vm->keyboard = &session->input;
+	session->vm->output.set_sink(nullptr, false); // Collected per slice and handed to on_output
+	session->state = STATE_READY;
+	session->closed = false;
+
+	std::lock_guard<std::mutex> guard(lock);
+	session->id = next_id++;
+	open_sessions[session->id] = session;
+	run_queue.push_back(session);
+	work.notify_one();
+	return session->id;
+}
+
+bool SessionHost::feed(SessionId id, const std::string& keys) {
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = open_sessions.find(id);
+	if (it == open_sessions.end()) {
+		return false;
+	}
+	it->second->input.push(keys);
+	wake(it->second);
+	return true;
+}
+
+bool SessionHost::end_input(SessionId id) {
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = open_sessions.find(id);
+	if (it == open_sessions.end()) {
+		return false;
+	}
+	it->second->input.close();
+	wake(it->second);
+	return true;
+}
+
+void SessionHost::close(SessionId id) {
+	std::lock_guard<std::mutex> guard(lock);
+	auto it = open_sessions.find(id);
+	if (it == open_sessions.end()) {
+		return;
+	}
+	std::shared_ptr<Session> session = it->second;
+	open_sessions.erase(it);
+	session->closed = true;
+	if (session->state == STATE_WAITING) {
+		parked--;
+	}
+	else if (session->state == STATE_READY) {
+		for (auto q = run_queue.begin(); q != run_queue.end(); ++q) {
+			if (*q == session) {
+				run_queue.erase(q);
+				break;
+			}
+		}
+	}
+	// A running session is dropped by its worker at the end of the slice
+	if (run_queue.empty() && running == 0) {
+		idle.notify_all();
+	}
+}
+
+void SessionHost::drain() {
+	std::unique_lock<std::mutex> guard(lock);
+	idle.wait(guard, [this] { return run_queue.empty() && running == 0; });
+}
+
+size_t SessionHost::sessions() const {
+	std::lock_guard<std::mutex> guard(lock);
+	return open_sessions.size();
+}
+
+size_t SessionHost::waiting() const {
+	std::lock_guard<std::mutex> guard(lock);
+	return parked;
+}
+
+void SessionHost::wake(const std::shared_ptr<Session>& session) {
+	if (session->state != STATE_WAITING) {
+		return;
+	}
+	parked--;
+	if (session->vm->metrics) {
+		std::chrono::nanoseconds waited = std::chrono::steady_clock::now() - session->parked_since;
+		session->vm->metrics->input_wait_ns.fetch_add((uint64_t)waited.count(), std::memory_order_relaxed);
+	}
+	session->state = STATE_READY;
+	run_queue.push_back(session);
+	work.notify_one();
+}
+
+void SessionHost::worker() {
+	Metrics* shard = options.metrics ? &options.metrics->add_shard() : nullptr;
+	std::unique_lock<std::mutex> guard(lock);
+	for (;;) {
+		work.wait(guard, [this] { return stopping || !run_queue.empty(); });
+		if (stopping) {
+			return;
+		}
+		std::shared_ptr<Session> session = std::move(run_queue.front());
+		run_queue.pop_front();
+		session->state = STATE_RUNNING;
+		running++;
+		guard.unlock();
+
+		if (session->vm->metrics != shard) {
+			session->vm->attach_metrics(shard);
+		}
+		StopReason reason = session->vm->run_for(options.slice);
+		std::string out = session->vm->output.take_captured();
+		if (!out.empty() && options.on_output) {
+			options.on_output(session->id, out);
+		}
+		if (reason == STOP_HALTED && options.on_halt) {
+			options.on_halt(session->id);
+		}
+
+		guard.lock();
+		running--;
+		if (session->closed) {
+			// Already gone from open_sessions
+		}
+		else if (reason == STOP_HALTED) {
+			open_sessions.erase(session->id);
+		}
+		// feed() takes the lock too, so input that arrived during the slice is seen here
+		else if (reason == STOP_INPUT && !session->input.ready()) {
+			session->state = STATE_WAITING;
+			parked++;
+			if (shard) {
+				session->parked_since = std::chrono::steady_clock::now();
+			}
+		}
+		else {
+			session->state = STATE_READY;
+			run_queue.push_back(session);
+		}
+		if (run_queue.empty() && running == 0) {
+			idle.notify_all();
+		}
+	}
+}
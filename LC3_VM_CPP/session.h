@@ -0,0 +1,127 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "LC3VM.h"
+
+/*
+Hosting many interactive machines on a few threads.
+
+Every session is a Machine whose keyboard is fed by feed() from any thread,
+typically a network event loop. Sessions run in slices on a small pool of
+worker threads through Machine::run_for(). A GETC or IN that finds no key ready
+suspends the machine (STOP_INPUT) instead of blocking, and the session is parked
+off the run queue, holding no thread, until feed() or end_input() gives it
+something to read. It then resumes at the trap that suspended it.
+
+Idle keyboard loops (a KBSR polling loop that finds no key, or a branch to
+itself waiting for the keyboard interrupt) are detected too: run_for() retires
+the rest of the slice and returns STOP_INPUT, so those sessions are parked in
+the same way as sessions blocked in GETC. A program that polls KBSR while doing
+other work is not idle and keeps running in slices.
+*/
+
+namespace LC3VM {
+	typedef uint64_t SessionId;
+
+	// Keys pushed by any thread, read by the session's machine
+	class SessionInput : public InputSource {
+	public:
+		SessionInput();
+
+		void push(const std::string& keys);
+		void close();
+
+		bool poll(uint16_t& key) override;
+		uint16_t wait() override;
+		bool ready() const override;
+
+	private:
+		mutable std::mutex lock;
+		std::condition_variable arrived;
+		std::deque<uint16_t> keys;
+		std::atomic<size_t> available; // keys.size(), read without the lock by empty polls
+		std::atomic<bool> closed;
+	};
+
+	struct SessionHostOptions {
+		unsigned threads = 0; // 0 means one per hardware thread
+		uint32_t slice = 100000; // Instructions a session runs before the next one gets a turn
+		MetricsShards* metrics = nullptr; // Every worker adds a shard and counts into it, time parked on input included
+
+		// Called on a worker thread, never for one session on two threads at once
+		std::function<void(SessionId, const std::string&)> on_output; // Output of the last slice
+		std::function<void(SessionId)> on_halt; // The program halted, the session is gone
+	};
+
+	class SessionHost {
+	public:
+		explicit SessionHost(const SessionHostOptions& options = SessionHostOptions());
+
+		// Stops the workers, open sessions are dropped
+		~SessionHost();
+
+		SessionHost(const SessionHost&) = delete;
+		SessionHost& operator=(const SessionHost&) = delete;
+
+		// Start a session on a loaded and reset machine. Its keyboard and output are taken over by the host.
+		SessionId open(std::unique_ptr<Machine> vm);
+
+		// Keys for the session, resuming it if it is waiting for input. False if there is no such session.
+		bool feed(SessionId id, const std::string& keys);
+
+		// No more keys will come, reads past the last key return EOF
+		bool end_input(SessionId id);
+
+		// Drop the session whatever it is doing
+		void close(SessionId id);
+
+		// Block until every session has halted or is waiting for input
+		void drain();
+
+		size_t sessions() const;
+		size_t waiting() const; // Sessions parked on input
+
+	private:
+		enum State {
+			STATE_READY, // On the run queue
+			STATE_RUNNING, // Owned by a worker
+			STATE_WAITING, // Parked until input arrives
+		};
+
+		struct Session {
+			SessionId id;
+			std::unique_ptr<Machine> vm;
+			SessionInput input;
+			State state;
+			bool closed;
+			std::chrono::steady_clock::time_point parked_since; // Kept with options.metrics only
+		};
+
+		SessionHostOptions options;
+		mutable std::mutex lock;
+		std::condition_variable work; // Signalled when the run queue gets a session
+		std::condition_variable idle; // Signalled when no session is runnable
+		std::unordered_map<SessionId, std::shared_ptr<Session>> open_sessions;
+		std::deque<std::shared_ptr<Session>> run_queue;
+		SessionId next_id;
+		size_t running; // Sessions owned by a worker
+		size_t parked;
+		bool stopping;
+		std::vector<std::thread> workers;
+
+		void worker();
+
+		// Put a waiting session back on the run queue, called with lock held
+		void wake(const std::shared_ptr<Session>& session);
+	};
+}
@@ -0,0 +1,247 @@
+#include "snapshot.h"
+
+#include <string.h>
+
+using namespace LC3VM;
+
+/*
+Serialized layout, all fields little-endian:
+	"LC3S"			magic
+	u8				version (3)
+	u8				flags, bit 0 set for a delta
+	u8				running
+	u8				reserved (0)
+	u16[R_COUNT]	registers
+	u16				PSR without the condition codes
+	u16				saved supervisor stack pointer
+	u16				saved user stack pointer
+	u64				instructions retired
+	u64				memory digest
+	u64				base digest (0 for full snapshots)
+	u16				page count
+	then per page:
+		u8			page index
+		u16[256]	words
+*/
+
+namespace {
+	const uint8_t MAGIC[4] = { 'L', 'C', '3', 'S' };
+	const uint8_t VERSION = 3;
+
+	// FNV-1a over the memory words
+	uint64_t digest_of(const uint16_t* memory) {
+		uint64_t h = 14695981039346656037ull;
+		for (int i = 0; i < MEMORY_MAX; i++) {
+			h = (h ^ memory[i]) * 1099511628211ull;
+		}
+		return h;
+	}
+
+	void put16(std::vector<uint8_t>& out, uint16_t v) {
+		out.push_back((uint8_t)v);
+		out.push_back((uint8_t)(v >> 8));
+	}
+
+	void put64(std::vector<uint8_t>& out, uint64_t v) {
+		for (int i = 0; i < 8; i++) {
+			out.push_back((uint8_t)(v >> (8 * i)));
+		}
+	}
+
+	uint16_t get16(const uint8_t* p) {
+		return (uint16_t)(p[0] | (p[1] << 8));
+	}
+
+	uint64_t get64(const uint8_t* p) {
+		uint64_t v = 0;
+		for (int i = 0; i < 8; i++) {
+			v |= (uint64_t)p[i] << (8 * i);
+		}
+		return v;
+	}
+}
+
+Snapshot::Snapshot() : delta(false), running(0), reg(), psr(0), saved_ssp(0), saved_usp(0), instructions(0), memory_digest(0), base_digest(0) {}
+
+Snapshot Snapshot::capture(const Machine& vm) {
+	Snapshot s;
+	s.running = vm.running ? 1 : 0;
+	memcpy(s.reg, vm.reg, sizeof(s.reg));
+	s.psr = vm.psr;
+	s.saved_ssp = vm.saved_ssp;
+	s.saved_usp = vm.saved_usp;
+	s.instructions = vm.instructions;
+	s.memory_digest = digest_of(vm.memory);
+	for (int p = 0; p < PAGE_COUNT; p++) {
+		const uint16_t* words = vm.memory + p * PAGE_WORDS;
+		if (!page_is_zero(words)) {
+			s.pages.emplace_back();
+			s.pages.back().index = (uint8_t)p;
+			memcpy(s.pages.back().words, words, sizeof(Page::words));
+		}
+	}
+	return s;
+}
+
+Snapshot Snapshot::capture(const Machine& vm, const Snapshot& base) {
+	if (base.delta) {
+		return capture(vm);
+	}
+	// Pages missing from a full snapshot are zero
+	const Page* base_pages[PAGE_COUNT] = {};
+	for (const Page& page : base.pages) {
+		base_pages[page.index] = &page;
+	}
+
+	Snapshot s;
+	s.delta = true;
+	s.running = vm.running ? 1 : 0;
+	memcpy(s.reg, vm.reg, sizeof(s.reg));
+	s.psr = vm.psr;
+	s.saved_ssp = vm.saved_ssp;
+	s.saved_usp = vm.saved_usp;
+	s.instructions = vm.instructions;
+	s.memory_digest = digest_of(vm.memory);
+	s.base_digest = base.memory_digest;
+	for (int p = 0; p < PAGE_COUNT; p++) {
+		const uint16_t* words = vm.memory + p * PAGE_WORDS;
+		bool same = base_pages[p] ? memcmp(words, base_pages[p]->words, sizeof(Page::words)) == 0 : page_is_zero(words);
+		if (!same) {
+			s.pages.emplace_back();
+			s.pages.back().index = (uint8_t)p;
+			memcpy(s.pages.back().words, words, sizeof(Page::words));
+		}
+	}
+	return s;
+}
+
+void Snapshot::collect_pages(const uint16_t* contents[PAGE_COUNT]) const {
+	for (const Page& page : pages) {
+		contents[page.index] = page.words;
+	}
+}
+
+void Snapshot::write_pages(Machine& vm, const uint16_t* const contents[PAGE_COUNT]) {
+	for (int p = 0; p < PAGE_COUNT; p++) {
+		uint16_t* words = vm.memory + p * PAGE_WORDS;
+		if (contents[p] ? memcmp(words, contents[p], PAGE_WORDS * sizeof(uint16_t)) == 0 : page_is_zero(words)) {
+			continue;
+		}
+		if (contents[p]) {
+			memcpy(words, contents[p], PAGE_WORDS * sizeof(uint16_t));
+		}
+		else {
+			memset(words, 0, PAGE_WORDS * sizeof(uint16_t));
+		}
+		// Only these pages differ from what was shared, so forking from vm afterwards costs just them
+		vm.dirty_pages[p] = 1;
+		// Also drops the compiled blocks covering the page
+		if (vm.decoded) {
+			vm.decode_range((uint16_t)(p * PAGE_WORDS), PAGE_WORDS);
+		}
+	}
+}
+
+void Snapshot::apply_state(Machine& vm) const {
+	memcpy(vm.reg, reg, sizeof(reg));
+	vm.running = running;
+	vm.psr = psr;
+	vm.saved_ssp = saved_ssp;
+	vm.saved_usp = saved_usp;
+	// The clock of replayed input and of run_for()/run_until() carries on from the capture
+	vm.instructions = instructions;
+	// Whatever was waiting is looked at again
+	vm.interrupt_pending = 1;
+}
+
+bool Snapshot::restore(Machine& vm) const {
+	if (delta) {
+		return false;
+	}
+	const uint16_t* contents[PAGE_COUNT] = {};
+	collect_pages(contents);
+	write_pages(vm, contents);
+	apply_state(vm);
+	return true;
+}
+
+bool Snapshot::restore(Machine& vm, const Snapshot& base) const {
+	if (!delta) {
+		return restore(vm);
+	}
+	if (base.delta || base.memory_digest != base_digest) {
+		return false;
+	}
+	const uint16_t* contents[PAGE_COUNT] = {};
+	base.collect_pages(contents);
+	collect_pages(contents);
+	write_pages(vm, contents);
+	apply_state(vm);
+	return true;
+}
+
+std::vector<uint8_t> Snapshot::serialize() const {
+	std::vector<uint8_t> out;
+	out.reserve(4 + 4 + 2 * R_COUNT + 6 + 24 + 2 + pages.size() * (1 + 2 * PAGE_WORDS));
+	out.insert(out.end(), MAGIC, MAGIC + 4);
+	out.push_back(VERSION);
+	out.push_back(delta ? 1 : 0);
+	out.push_back(running);
+	out.push_back(0);
+	for (int r = 0; r < R_COUNT; r++) {
+		put16(out, reg[r]);
+	}
+	put16(out, psr);
+	put16(out, saved_ssp);
+	put16(out, saved_usp);
+	put64(out, instructions);
+	put64(out, memory_digest);
+	put64(out, base_digest);
+	put16(out, (uint16_t)pages.size());
+	for (const Page& page : pages) {
+		out.push_back(page.index);
+		for (int i = 0; i < PAGE_WORDS; i++) {
+			put16(out, page.words[i]);
+		}
+	}
+	return out;
+}
+
+bool Snapshot::deserialize(const uint8_t* data, size_t size, Snapshot& snapshot) {
+	const size_t header = 4 + 4 + 2 * R_COUNT + 6 + 24 + 2;
+	if (size < header || memcmp(data, MAGIC, 4) != 0 || data[4] != VERSION) {
+		return false;
+	}
+	Snapshot s;
+	s.delta = (data[5] & 1) != 0;
+	s.running = data[6];
+	const uint8_t* p = data + 8;
+	for (int r = 0; r < R_COUNT; r++, p += 2) {
+		s.reg[r] = get16(p);
+	}
+	s.psr = get16(p);
+	s.saved_ssp = get16(p + 2);
+	s.saved_usp = get16(p + 4);
+	p += 6;
+	s.instructions = get64(p);
+	s.memory_digest = get64(p + 8);
+	s.base_digest = get64(p + 16);
+	size_t count = get16(p + 24);
+	p += 26;
+	if (count > (size_t)PAGE_COUNT || size - header != count * (1 + 2 * PAGE_WORDS)) {
+		return false;
+	}
+	s.pages.resize(count);
+	for (size_t n = 0; n < count; n++) {
+		Page& page = s.pages[n];
+		page.index = *p++;
+		if (n > 0 && page.index <= s.pages[n - 1].index) {
+			return false;
+		}
+		for (int i = 0; i < PAGE_WORDS; i++, p += 2) {
+			page.words[i] = get16(p);
+		}
+	}
+	snapshot = std::move(s);
+	return true;
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "LC3VM.h"
+
+/*
+Snapshots of the architectural state of a machine: memory, registers, the
+processor status with the saved stack pointer, the running flag and the
+number of instructions retired, which is the clock replayed input is timed
+by. Device registers keep their state in memory (see mmio.h), so they are
+covered by the memory pages.
+
+Memory is stored as 256-word pages relative to a base. A full snapshot is
+relative to all-zero memory and only holds the pages that are not zero; a delta
+snapshot is relative to another snapshot and only holds the pages that differ
+from it. Every snapshot records a digest of the memory it describes, and a
+delta records the digest of its base, so restoring a delta on top of the wrong
+base is refused.
+
+Restoring only rewrites the pages whose contents differ from what the machine
+already holds, and only those are marked dirty and decoded again, so a machine
+that is restored and then forked (see fork.h) shares every other page.
+
+Pending keyboard input and buffered output are not machine state and are not
+part of a snapshot, flush the output before capturing if it matters.
+*/
+
+namespace LC3VM {
+	class Snapshot {
+	public:
+		Snapshot();
+
+		// Full snapshot of vm
+		static Snapshot capture(const Machine& vm);
+
+		// Only the pages of vm that differ from base, which must be a full snapshot (a delta base gives a full snapshot)
+		static Snapshot capture(const Machine& vm, const Snapshot& base);
+
+		// Restore a full snapshot. Returns false for a delta.
+		bool restore(Machine& vm) const;
+
+		// Restore a delta on top of the full snapshot it was taken against. Returns false if base is not its base.
+		bool restore(Machine& vm, const Snapshot& base) const;
+
+		bool is_delta() const { return delta; }
+		size_t page_count() const { return pages.size(); }
+		uint64_t digest() const { return memory_digest; }
+
+		// Compact binary form, see snapshot.cpp for the layout
+		std::vector<uint8_t> serialize() const;
+		static bool deserialize(const uint8_t* data, size_t size, Snapshot& snapshot);
+
+	private:
+		struct Page {
+			uint8_t index;
+			uint16_t words[PAGE_WORDS];
+		};
+
+		bool delta;
+		uint8_t running;
+		uint16_t reg[R_COUNT];
+		uint16_t psr; // Without the condition codes, which are in reg[R_COND]
+		uint16_t saved_ssp;
+		uint16_t saved_usp;
+		uint64_t instructions; // Machine::instructions
+		uint64_t memory_digest; // Of the whole memory this snapshot describes
+		uint64_t base_digest; // Of the base memory, deltas only
+		std::vector<Page> pages; // Sorted by index
+
+		// Point contents[index] at the words of every page held here
+		void collect_pages(const uint16_t* contents[PAGE_COUNT]) const;
+
+		// Make the memory of vm hold contents (nullptr for a zero page), rewriting and marking dirty only the pages that differ
+		static void write_pages(Machine& vm, const uint16_t* const contents[PAGE_COUNT]);
+
+		void apply_state(Machine& vm) const;
+	};
+}
@@ -0,0 +1,133 @@
+#include "LC3VM.h"
+#include "ops.h"
+
+using namespace LC3VM;
+
+/*
+Direct-threaded interpreter core.
+
+Instead of returning to one central switch, every handler fetches the next
+instruction and jumps straight to its handler. Each handler ends in its own
+indirect jump, so the branch predictor learns per-opcode successor patterns,
+and the opcode bodies from ops.h are inlined into the loop.
+
+GCC and Clang support this directly with computed goto (labels as values).
+Other compilers (MSVC) get a call-threaded version over a table of member
+function pointers, which still avoids the switch's bounds check and jump table.
+*/
+
+/*
+The dispatch tables are indexed by more than the opcode: bits 11-9 and bit 5
+of the instruction come along, so the mode bits of ADD, AND, BR and JSR pick
+a handler specialised on them (ops.h) and are never tested at run time.
+
+	index  7    4  3      1  0
+	       opcode  bits 11-9  bit 5
+*/
+#define DISPATCH_INDEX(instr) ((((instr) >> 8) & 0xFE) | (((instr) >> 5) & 0x1))
+
+// Table rows of 16 for one opcode, in index order
+#define ROW(h) h, h, h, h, h, h, h, h, h, h, h, h, h, h, h, h
+#define ROW_IMM(reg, imm) reg, imm, reg, imm, reg, imm, reg, imm, reg, imm, reg, imm, reg, imm, reg, imm
+#define ROW_BR(h) h(0), h(0), h(1), h(1), h(2), h(2), h(3), h(3), h(4), h(4), h(5), h(5), h(6), h(6), h(7), h(7)
+#define ROW_JSR(jsrr, jsr) jsrr, jsrr, jsrr, jsrr, jsrr, jsrr, jsrr, jsrr, jsr, jsr, jsr, jsr, jsr, jsr, jsr, jsr
+
+#if defined(__GNUC__)
+
+uint32_t Machine::run_threaded(uint32_t count) {
+	// One row per opcode, the order must match the OP_ enum
+#define BR_LABEL(nzp) &&do_br##nzp
+	static void* const labels[256] = {
+		ROW_BR(BR_LABEL), ROW_IMM(&&do_add, &&do_add_imm), ROW(&&do_ld), ROW(&&do_st),
+		ROW_JSR(&&do_jsrr, &&do_jsr), ROW_IMM(&&do_and, &&do_and_imm), ROW(&&do_ldr), ROW(&&do_str),
+		ROW(&&do_rti), ROW(&&do_not), ROW(&&do_ldi), ROW(&&do_sti),
+		ROW(&&do_jmp), ROW(&&do_res), ROW(&&do_lea), ROW(&&do_trap),
+	};
+#undef BR_LABEL
+
+	uint32_t executed = 0;
+	uint16_t instr;
+
+	if (!running) {
+		return 0;
+	}
+	load_flags();
+
+	// Only TRAP and a BR that finds an idle loop can stop the machine, so the running flag is checked there alone
+#define DISPATCH() \
+	do { \
+		if (executed == count) { goto done; } \
+		executed++; \
+		instr = memory[reg[R_PC]++]; \
+		goto *labels[DISPATCH_INDEX(instr)]; \
+	} while (0)
+
+	DISPATCH();
+
+	// BR000 never branches and BRnzp always does, neither tests the flags
+#define BR_HANDLER(nzp) \
+do_br##nzp: \
+	op_br<nzp>(instr); \
+	if (!running) { goto done; } \
+	DISPATCH();
+	BR_HANDLER(0) BR_HANDLER(1) BR_HANDLER(2) BR_HANDLER(3)
+	BR_HANDLER(4) BR_HANDLER(5) BR_HANDLER(6) BR_HANDLER(7)
+#undef BR_HANDLER
+do_add: op_add<false>(instr); DISPATCH();
+do_add_imm: op_add<true>(instr); DISPATCH();
+do_ld: op_ld(instr); DISPATCH();
+do_st: op_st(instr); DISPATCH();
+do_jsr: op_jsr<true>(instr); DISPATCH();
+do_jsrr: op_jsr<false>(instr); DISPATCH();
+do_and: op_and<false>(instr); DISPATCH();
+do_and_imm: op_and<true>(instr); DISPATCH();
+do_ldr: op_ldr(instr); DISPATCH();
+do_str: op_str(instr); DISPATCH();
+do_rti: op_rti(instr); DISPATCH();
+do_not: op_not(instr); DISPATCH();
+do_ldi: op_ldi(instr); DISPATCH();
+do_sti: op_sti(instr); DISPATCH();
+do_jmp: op_jmp(instr); DISPATCH();
+do_res: op_res(instr); DISPATCH();
+do_lea: op_lea(instr); DISPATCH();
+do_trap:
+	op_trap(instr);
+	if (!running) { goto done; }
+	DISPATCH();
+
+#undef DISPATCH
+
+done:
+	store_flags();
+	return executed;
+}
+
+#else
+
+namespace {
+	typedef void (Machine::*Handler)(uint16_t instr);
+
+	// One row per opcode, the order must match the OP_ enum
+#define BR_HANDLER(nzp) &Machine::op_br<nzp>
+	const Handler handlers[256] = {
+		ROW_BR(BR_HANDLER), ROW_IMM(&Machine::op_add<false>, &Machine::op_add<true>), ROW(&Machine::op_ld), ROW(&Machine::op_st),
+		ROW_JSR(&Machine::op_jsr<false>, &Machine::op_jsr<true>), ROW_IMM(&Machine::op_and<false>, &Machine::op_and<true>), ROW(&Machine::op_ldr), ROW(&Machine::op_str),
+		ROW(&Machine::op_rti), ROW(&Machine::op_not), ROW(&Machine::op_ldi), ROW(&Machine::op_sti),
+		ROW(&Machine::op_jmp), ROW(&Machine::op_res), ROW(&Machine::op_lea), ROW(&Machine::op_trap),
+	};
+#undef BR_HANDLER
+}
+
+uint32_t Machine::run_threaded(uint32_t count) {
+	uint32_t executed = 0;
+	load_flags();
+	while (running && executed < count) {
+		uint16_t instr = memory[reg[R_PC]++];
+		(this->*handlers[DISPATCH_INDEX(instr)])(instr);
+		executed++;
+	}
+	store_flags();
+	return executed;
+}
+
+#endif
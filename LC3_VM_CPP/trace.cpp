@@ -0,0 +1,380 @@
+#include "trace.h"
+#include "LC3VM.h"
+#include "snapshot.h"
+
+#include <string.h>
+
+using namespace LC3VM;
+
+namespace {
+	const uint8_t MAGIC[4] = { 'L', 'C', '3', 'T' };
+	const uint8_t VERSION = 1;
+	const size_t MAX_VARINT = 5;
+	const size_t MAX_RECORD = 1 + MAX_VARINT + 2 + 1 + 8 * MAX_VARINT + MAX_VARINT; // Without the stores themselves
+
+	// Signed 16-bit differences to small unsigned numbers, -1 is 1, 1 is 2
+	uint16_t zigzag(uint16_t difference) {
+		return (uint16_t)((difference << 1) ^ ((int16_t)difference >> 15));
+	}
+
+	uint16_t unzigzag(uint32_t v) {
+		return (uint16_t)((v >> 1) ^ (0u - (v & 1)));
+	}
+
+	uint8_t* put_varint(uint8_t* p, uint32_t v) {
+		while (v >= 0x80) {
+			*p++ = (uint8_t)(v | 0x80);
+			v >>= 7;
+		}
+		*p++ = (uint8_t)v;
+		return p;
+	}
+
+	void put32(uint8_t* p, uint32_t v) {
+		for (int i = 0; i < 4; i++) {
+			p[i] = (uint8_t)(v >> (8 * i));
+		}
+	}
+
+	uint32_t get32(const uint8_t* p) {
+		return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+	}
+
+	uint8_t cond_code(uint16_t cond) {
+		return cond == FL_POS ? 0 : cond == FL_ZRO ? 1 : 2;
+	}
+
+	const uint16_t COND_OF_CODE[4] = { FL_POS, FL_ZRO, FL_NEG, FL_NEG };
+}
+
+Tracer::Tracer(FILE* out)
+	: out(out), total(0), pending(false), stopping(false), began(false), ended(false), reg(), cond(0), last_store(0) {}
+
+Tracer::~Tracer() {
+	if (began && !ended) {
+		// No final state without the machine, the decoder reports the trace as incomplete
+		if (filling.records) {
+			hand_off();
+		}
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		changed.notify_all();
+		writer.join();
+		fflush(out);
+	}
+}
+
+void Tracer::begin(const Machine& vm) {
+	std::vector<uint8_t> state = Snapshot::capture(vm).serialize();
+	uint8_t header[12] = { MAGIC[0], MAGIC[1], MAGIC[2], MAGIC[3], VERSION, 0, 0, 0 };
+	put32(header + 8, (uint32_t)state.size());
+	fwrite(header, 1, sizeof(header), out);
+	fwrite(state.data(), 1, state.size(), out);
+
+	memcpy(reg, vm.reg, sizeof(reg));
+	cond = vm.reg[R_COND];
+	last_store = 0;
+	last_instr.assign(MEMORY_MAX, 0);
+	filling.raw.resize(BLOCK_RECORDS);
+	filling.records = 0;
+	writing.raw.resize(BLOCK_RECORDS);
+	writing.records = 0;
+	began = true;
+	writer = std::thread(&Tracer::write_loop, this);
+}
+
+void Tracer::hand_off() {
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		changed.wait(guard, [this] { return !pending; });
+		std::swap(filling, writing);
+		pending = true;
+	}
+	changed.notify_all();
+	filling.records = 0;
+	filling.registers.clear();
+	filling.stores.clear();
+}
+
+void Tracer::write_loop() {
+	std::unique_lock<std::mutex> guard(lock);
+	for (;;) {
+		changed.wait(guard, [this] { return pending || stopping; });
+		if (!pending) {
+			return;
+		}
+		guard.unlock();
+		encode(writing);
+		uint8_t header[8];
+		put32(header, writing.records);
+		put32(header + 4, (uint32_t)encoded.size());
+		fwrite(header, 1, sizeof(header), out);
+		fwrite(encoded.data(), 1, encoded.size(), out);
+		guard.lock();
+		pending = false;
+		changed.notify_all();
+	}
+}
+
+void Tracer::encode(const Block& block) {
+	encoded.resize(block.records * MAX_RECORD + block.stores.size() * 2 * MAX_VARINT);
+	uint8_t* p = encoded.data();
+	const Registers* registers = block.registers.data();
+	const Store* store = block.stores.data();
+
+	for (uint32_t i = 0; i < block.records; i++) {
+		const Raw& raw = block.raw[i];
+		uint8_t* tag = p++;
+		uint8_t t = 0;
+
+		uint16_t next = (uint16_t)(raw.pc + 1);
+		if (raw.next_pc != next) {
+			t |= TRACE_JUMP;
+			p = put_varint(p, zigzag((uint16_t)(raw.next_pc - next)));
+		}
+		if (raw.instr != last_instr[raw.pc]) {
+			t |= TRACE_INSTR;
+			*p++ = (uint8_t)raw.instr;
+			*p++ = (uint8_t)(raw.instr >> 8);
+			last_instr[raw.pc] = raw.instr;
+		}
+		if (raw.any_register) {
+			const uint16_t* now = (registers++)->reg;
+			unsigned mask = 0;
+			for (int r = 0; r < 8; r++) {
+				mask |= (unsigned)(now[r] != reg[r]) << r;
+			}
+			if (mask) {
+				t |= TRACE_REGS;
+				*p++ = (uint8_t)mask;
+				for (unsigned m = mask, r = 0; m; m >>= 1, r++) {
+					if (m & 1) {
+						p = put_varint(p, zigzag((uint16_t)(now[r] - reg[r])));
+					}
+				}
+				memcpy(reg, now, sizeof(reg));
+			}
+		}
+		else {
+			unsigned r = (raw.instr >> 9) & 0x7;
+			if (raw.value != reg[r]) {
+				t |= TRACE_REGS;
+				*p++ = (uint8_t)(1 << r);
+				p = put_varint(p, zigzag((uint16_t)(raw.value - reg[r])));
+				reg[r] = raw.value;
+			}
+		}
+		if (raw.stores) {
+			t |= TRACE_WRITES;
+			p = put_varint(p, raw.stores);
+			for (uint32_t n = 0; n < raw.stores; n++, store++) {
+				p = put_varint(p, zigzag((uint16_t)(store->address - last_store)));
+				p = put_varint(p, store->val);
+				last_store = store->address;
+			}
+		}
+		if (raw.cond != cond) {
+			t |= TRACE_COND | (uint8_t)(cond_code(raw.cond) << TRACE_COND_SHIFT);
+			cond = raw.cond;
+		}
+		*tag = t;
+	}
+	encoded.resize(p - encoded.data());
+}
+
+void Tracer::finish(const Machine& vm) {
+	if (ended) {
+		return;
+	}
+	if (!began) {
+		begin(vm);
+	}
+	if (filling.records) {
+		hand_off();
+	}
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	changed.notify_all();
+	writer.join();
+
+	uint8_t final_block[8 + 2 * R_COUNT + 8];
+	put32(final_block, 0);
+	put32(final_block + 4, 2 * R_COUNT + 8);
+	uint8_t* p = final_block + 8;
+	for (int r = 0; r < R_COUNT; r++) {
+		*p++ = (uint8_t)vm.reg[r];
+		*p++ = (uint8_t)(vm.reg[r] >> 8);
+	}
+	for (int i = 0; i < 8; i++) {
+		*p++ = (uint8_t)(total >> (8 * i));
+	}
+	fwrite(final_block, 1, sizeof(final_block), out);
+	fflush(out);
+	ended = true;
+}
+
+TraceReader::TraceReader() : in(nullptr), pos(0), left(0), last_store(0), done(0), finished(false), final_count(0) {}
+
+TraceReader::~TraceReader() {}
+
+bool TraceReader::open(FILE* file) {
+	in = file;
+	uint8_t header[12];
+	if (fread(header, 1, sizeof(header), in) != sizeof(header) || memcmp(header, MAGIC, 4) != 0 || header[4] != VERSION) {
+		return false;
+	}
+	std::vector<uint8_t> state(get32(header + 8));
+	Snapshot initial;
+	if (fread(state.data(), 1, state.size(), in) != state.size() || !Snapshot::deserialize(state.data(), state.size(), initial)) {
+		return false;
+	}
+	vm.reset(new Machine());
+	if (!initial.restore(*vm)) {
+		return false;
+	}
+	last_instr.assign(MEMORY_MAX, 0);
+	pos = 0;
+	left = 0;
+	last_store = 0;
+	done = 0;
+	finished = false;
+	return true;
+}
+
+bool TraceReader::read_block() {
+	uint8_t header[8];
+	if (fread(header, 1, sizeof(header), in) != sizeof(header)) {
+		return false;
+	}
+	uint32_t count = get32(header);
+	block.resize(get32(header + 4));
+	if (fread(block.data(), 1, block.size(), in) != block.size()) {
+		return false;
+	}
+	pos = 0;
+	if (count == 0) {
+		// The final state
+		if (block.size() != 2 * R_COUNT + 8) {
+			return false;
+		}
+		final_reg.resize(R_COUNT);
+		for (int r = 0; r < R_COUNT; r++) {
+			final_reg[r] = (uint16_t)(block[2 * r] | (block[2 * r + 1] << 8));
+		}
+		final_count = 0;
+		for (int i = 0; i < 8; i++) {
+			final_count |= (uint64_t)block[2 * R_COUNT + i] << (8 * i);
+		}
+		finished = true;
+		return false;
+	}
+	left = count;
+	return true;
+}
+
+bool TraceReader::get(size_t n, const uint8_t*& p) {
+	if (block.size() - pos < n) {
+		return false;
+	}
+	p = block.data() + pos;
+	pos += n;
+	return true;
+}
+
+bool TraceReader::varint(uint32_t& v) {
+	v = 0;
+	for (int shift = 0; shift < 35; shift += 7) {
+		const uint8_t* p;
+		if (!get(1, p)) {
+			return false;
+		}
+		v |= (uint32_t)(*p & 0x7F) << shift;
+		if (!(*p & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool TraceReader::next(TraceStep& step) {
+	if (!vm || finished || (left == 0 && !read_block())) {
+		return false;
+	}
+	const uint8_t* p;
+	if (!get(1, p)) {
+		return false;
+	}
+	uint8_t tag = *p;
+	uint32_t v;
+
+	step.pc = vm->reg[R_PC];
+	uint16_t after = (uint16_t)(step.pc + 1);
+	if (tag & TRACE_JUMP) {
+		if (!varint(v)) {
+			return false;
+		}
+		after += unzigzag(v);
+	}
+	if (tag & TRACE_INSTR) {
+		if (!get(2, p)) {
+			return false;
+		}
+		last_instr[step.pc] = (uint16_t)(p[0] | (p[1] << 8));
+	}
+	step.instr = last_instr[step.pc];
+	vm->reg[R_PC] = after;
+
+	step.changed = 0;
+	if (tag & TRACE_REGS) {
+		if (!get(1, p)) {
+			return false;
+		}
+		step.changed = *p;
+		for (int r = 0; r < 8; r++) {
+			if (step.changed & (1 << r)) {
+				if (!varint(v)) {
+					return false;
+				}
+				vm->reg[r] += unzigzag(v);
+			}
+		}
+	}
+	step.stores.clear();
+	if (tag & TRACE_WRITES) {
+		uint32_t count;
+		if (!varint(count)) {
+			return false;
+		}
+		for (uint32_t i = 0; i < count; i++) {
+			uint32_t value;
+			if (!varint(v) || !varint(value)) {
+				return false;
+			}
+			last_store += unzigzag(v);
+			vm->memory[last_store] = (uint16_t)value;
+			step.stores.push_back(std::make_pair(last_store, (uint16_t)value));
+		}
+	}
+	step.cond_changed = (tag & TRACE_COND) != 0;
+	if (step.cond_changed) {
+		vm->reg[R_COND] = COND_OF_CODE[(tag >> TRACE_COND_SHIFT) & 3];
+	}
+
+	left--;
+	done++;
+	return true;
+}
+
+bool TraceReader::seek(uint64_t n) {
+	TraceStep step;
+	while (done < n) {
+		if (!next(step)) {
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,216 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/*
+Execution traces.
+
+While a Tracer is attached to a machine (Machine::tracer), run_slice() executes
+through the tracing instantiation of the switch core. For every instruction it
+records the PC, the instruction word, the registers and condition codes that
+changed and the words stored through mem_write. run() starts the trace and
+finishes it when the program halts.
+
+The machine thread only fills in a fixed size raw record per instruction: the
+PC, instruction word and condition codes, and the register in bits 9-11, the
+only one most instructions can write. Instructions that may write any register
+(JSR and JSRR, which can run native routines, TRAP and RTI) also copy all of
+them. Full blocks are handed to a writer thread, which
+encodes and writes them while the machine fills the other block, so the
+program only waits when the writer falls a whole block behind. Encoded records
+are small because everything is a delta against what the decoder already
+knows: the PC after the instruction only when it is not the next address, the
+instruction word only when it differs from the last one executed at that
+address, changed registers as zigzag varint differences.
+
+Stream layout, integers little-endian:
+	"LC3T" u8 version (1) u8[3] reserved
+	u32 size, then the serialized Snapshot of the machine when the trace began
+	blocks of u32 record count, u32 byte count, then the records
+	a final block with record count 0 holding u16[R_COUNT] final registers and u64 steps
+
+Record: u8 tag, then the fields its bits announce, in this order:
+	TRACE_JUMP		varint zigzag(pc after the instruction - (pc + 1))
+	TRACE_INSTR		u16 instruction word
+	TRACE_REGS		u8 mask of R0-R7, then varint zigzag(new - old) per register
+	TRACE_WRITES	varint count, then per store varint zigzag(address - previous address), varint value
+	TRACE_COND		condition codes in the two bits above it (0 P, 1 Z, 2 N), no field
+
+Device registers update memory without mem_write, so words latched by the
+keyboard are not in the trace: what the program read shows up in its registers.
+*/
+
+namespace LC3VM {
+	class Machine;
+
+	enum {
+		TRACE_JUMP = 1 << 0,
+		TRACE_INSTR = 1 << 1,
+		TRACE_REGS = 1 << 2,
+		TRACE_WRITES = 1 << 3,
+		TRACE_COND = 1 << 4,
+		TRACE_COND_SHIFT = 5,
+	};
+
+	class Tracer {
+	public:
+		// The trace goes to out, which the caller closes after finish()
+		explicit Tracer(FILE* out);
+		~Tracer();
+
+		Tracer(const Tracer&) = delete;
+		Tracer& operator=(const Tracer&) = delete;
+
+		// Header and initial state, starts the writer thread
+		void begin(const Machine& vm);
+		bool started() const { return began; }
+
+		// Called by the tracing core around every instruction, and by mem_write for every store
+		void before(uint16_t pc, uint16_t instr) {
+			Raw& raw = filling.raw[filling.records];
+			raw.pc = pc;
+			raw.instr = instr;
+			raw.stores = 0;
+		}
+		void store(uint16_t address, uint16_t val) {
+			filling.stores.push_back(Store{ address, val });
+			filling.raw[filling.records].stores++;
+		}
+		void after(const uint16_t* reg, uint16_t cond, bool any_register) { // R0-R7 and R_PC
+			Raw& raw = filling.raw[filling.records];
+			raw.next_pc = reg[8]; // R_PC
+			raw.cond = cond;
+			raw.value = reg[(raw.instr >> 9) & 0x7];
+			raw.any_register = any_register;
+			if (any_register) {
+				filling.registers.emplace_back();
+				memcpy(filling.registers.back().reg, reg, sizeof(Registers::reg));
+			}
+			total++;
+			if (++filling.records == BLOCK_RECORDS) {
+				hand_off();
+			}
+		}
+
+		// Write out the last block and the final state of vm, and stop the writer
+		void finish(const Machine& vm);
+
+		uint64_t steps() const { return total; }
+
+	private:
+		static const uint32_t BLOCK_RECORDS = 1 << 14;
+
+		// One instruction as the machine saw it, encoded by the writer
+		struct Raw {
+			uint16_t pc;
+			uint16_t instr;
+			uint16_t next_pc;
+			uint16_t cond;
+			uint16_t value; // Register in bits 9-11 after the instruction
+			uint16_t any_register; // Took the next entry of the block's registers
+			uint32_t stores; // How many of the block's stores it made
+		};
+
+		struct Registers {
+			uint16_t reg[8];
+		};
+
+		struct Store {
+			uint16_t address;
+			uint16_t val;
+		};
+
+		struct Block {
+			std::vector<Raw> raw; // BLOCK_RECORDS entries, the first records of them in use
+			uint32_t records;
+			std::vector<Registers> registers;
+			std::vector<Store> stores;
+		};
+
+		FILE* out;
+		uint64_t total;
+
+		// Filled by the machine, the other one is owned by the writer thread while pending
+		Block filling;
+		Block writing;
+		bool pending;
+		bool stopping;
+		std::mutex lock;
+		std::condition_variable changed;
+		std::thread writer;
+		bool began;
+		bool ended;
+
+		// Writer thread: what the decoder knows so far, and the encoded block
+		uint16_t reg[8];
+		uint16_t cond;
+		uint16_t last_store;
+		std::vector<uint16_t> last_instr; // Indexed by address
+		std::vector<uint8_t> encoded;
+
+		void hand_off();
+		void write_loop();
+		void encode(const Block& block);
+	};
+
+	// One decoded record
+	struct TraceStep {
+		uint16_t pc;
+		uint16_t instr;
+		uint8_t changed; // Mask of R0-R7 the instruction wrote
+		bool cond_changed;
+		std::vector<std::pair<uint16_t, uint16_t>> stores; // Address, value
+	};
+
+	/*
+	Offline decoder. Rebuilds the machine state the trace began with and applies
+	the records one at a time, so after n calls to next() machine() holds the
+	registers and memory as they were after step n.
+	*/
+	class TraceReader {
+	public:
+		TraceReader();
+		~TraceReader();
+
+		// False if the header or initial state is malformed
+		bool open(FILE* in);
+
+		// Decode and apply the next record, false at the end of the trace or on a malformed block
+		bool next(TraceStep& step);
+
+		// Apply records up to and including step n (counting from 1), forward only
+		bool seek(uint64_t n);
+
+		const Machine& machine() const { return *vm; }
+		uint64_t step() const { return done; }
+
+		// Only known once next() has returned false at the end of a complete trace
+		bool complete() const { return finished; }
+		const std::vector<uint16_t>& final_registers() const { return final_reg; }
+		uint64_t final_steps() const { return final_count; }
+
+	private:
+		FILE* in;
+		std::unique_ptr<Machine> vm;
+		std::vector<uint16_t> last_instr;
+		std::vector<uint8_t> block;
+		size_t pos;
+		uint32_t left; // Records left in the current block
+		uint16_t last_store;
+		uint64_t done;
+		bool finished;
+		std::vector<uint16_t> final_reg;
+		uint64_t final_count;
+
+		bool read_block();
+		bool get(size_t n, const uint8_t*& p);
+		bool varint(uint32_t& v);
+	};
+}
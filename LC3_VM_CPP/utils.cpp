@@ -1,10 +1,50 @@
 #include "utils.h"
 
-// Provide definition of the extern global variables defined in header
-HANDLE hStdin = INVALID_HANDLE_VALUE;
-DWORD fdwMode, fdwOldMode; 
+#include <signal.h>
+#include <stdlib.h>
+
+#if defined(_WIN32)
+#include <Windows.h>
+#include <io.h> // _isatty
+#include "keyboard.h"
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
+
+namespace {
+	ConsoleBackend backend = CONSOLE_TERMINAL;
+	bool buffering_disabled = false; // Whether there are console settings to restore
+	volatile sig_atomic_t interrupt_count = 0; // Ctrl-C presses so far
+	std::atomic<bool>* volatile interrupt_flag = nullptr; // Lock free, so it may be set from the handler
+}
+
+void stop_on_interrupt(std::atomic<bool>* flag) {
+	interrupt_flag = flag;
+}
+
+void set_console_backend(ConsoleBackend b) {
+	backend = b;
+}
+
+#if defined(_WIN32)
+
+namespace {
+	HANDLE hStdin = INVALID_HANDLE_VALUE;
+	DWORD fdwMode, fdwOldMode;
+}
+
+ConsoleBackend default_console_backend() {
+	return _isatty(_fileno(stdin)) ? CONSOLE_TERMINAL : CONSOLE_HEADLESS;
+}
 
 void disable_input_buffering() {
+	if (backend == CONSOLE_HEADLESS) {
+		return;
+	}
 	hStdin = GetStdHandle(STD_INPUT_HANDLE);
 	GetConsoleMode(hStdin, &fdwOldMode); /* save old mode */
 	fdwMode = fdwOldMode
@@ -13,18 +53,115 @@ void disable_input_buffering() {
 								more characters are available */
 	SetConsoleMode(hStdin, fdwMode); /* set new mode */
 	FlushConsoleInputBuffer(hStdin); /* clear buffer */
+	buffering_disabled = true;
 }
 
 void restore_input_buffering() {
-	SetConsoleMode(hStdin, fdwOldMode);
+	if (buffering_disabled) {
+		SetConsoleMode(hStdin, fdwOldMode);
+		buffering_disabled = false;
+	}
 }
 
+int read_console_key() {
+	return getchar();
+}
+
+#else
+
+namespace {
+	struct termios original_tio;
+	// Written to by handle_interrupt() so that read_console_key() returns from poll()
+	volatile sig_atomic_t wake_pipe[2] = { -1, -1 };
+}
+
+ConsoleBackend default_console_backend() {
+	return isatty(STDIN_FILENO) ? CONSOLE_TERMINAL : CONSOLE_HEADLESS;
+}
+
+void disable_input_buffering() {
+	if (backend == CONSOLE_HEADLESS || tcgetattr(STDIN_FILENO, &original_tio) != 0) {
+		return;
+	}
+	struct termios new_tio = original_tio;
+	new_tio.c_lflag &= ~(ICANON | ECHO); /* no line editing, no echo */
+	new_tio.c_cc[VMIN] = 1;
+	new_tio.c_cc[VTIME] = 0;
+	tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+	tcflush(STDIN_FILENO, TCIFLUSH); /* clear buffer */
+	buffering_disabled = true;
+}
+
+void restore_input_buffering() {
+	if (buffering_disabled) {
+		tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+		buffering_disabled = false;
+	}
+}
+
+int read_console_key() {
+	// Only the reader thread gets here, and the pipe is made before the interrupt flag is checked
+	if (wake_pipe[0] < 0) {
+		int fds[2];
+		if (pipe(fds) == 0) {
+			fcntl(fds[1], F_SETFL, O_NONBLOCK);
+			wake_pipe[0] = fds[0];
+			wake_pipe[1] = fds[1];
+		}
+	}
+	// Wait in poll() rather than stdio so that nothing is read ahead of the key that was asked for
+	struct pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 }, { wake_pipe[0], POLLIN, 0 } };
+	for (;;) {
+		if (interrupt_requested()) {
+			return EOF;
+		}
+		int ready = poll(fds, wake_pipe[0] < 0 ? 1 : 2, -1);
+		if (ready < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ready < 0) {
+			return EOF;
+		}
+		if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+			continue;
+		}
+		unsigned char c;
+		ssize_t n = read(STDIN_FILENO, &c, 1);
+		if (n == 1) {
+			return c;
+		}
+		if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+			continue;
+		}
+		return EOF;
+	}
+}
+
+#endif
+
 void handle_interrupt(int signal) {
-	restore_input_buffering();
-	printf("\n");
-	exit(-2);
+	// A second Ctrl-C gives up on stopping cleanly, for a machine that is not running slices
+	if (interrupt_count++) {
+		restore_input_buffering();
+		_exit(-2);
+	}
+	if (interrupt_flag) {
+		interrupt_flag->store(true);
+	}
+#if defined(_WIN32)
+	// The CRT resets the handler before calling it, the second Ctrl-C must come back here
+	signal(SIGINT, handle_interrupt);
+	// Windows runs the handler on a thread of its own, so it may take locks. getchar() cannot be woken, GETC is.
+	Keyboard::console().close();
+#else
+	if (wake_pipe[1] >= 0) {
+		char c = 0;
+		ssize_t n = write(wake_pipe[1], &c, 1);
+		(void)n;
+	}
+#endif
 }
 
-uint16_t check_key() {
-	return WaitForSingleObject(hStdin, 1000) == WAIT_OBJECT_0 && _kbhit();
-}
\ No newline at end of file
+bool interrupt_requested() {
+	return interrupt_count != 0;
+}
@@ -1,15 +1,46 @@
 #pragma once
 #include <stdio.h>
 #include <stdint.h>
-/* windows only */
-#include <Windows.h>
-#include <conio.h>  // _kbhit
+#include <atomic>
 
+/*
+Console handling.
 
-extern HANDLE hStdin;
-extern DWORD fdwMode, fdwOldMode;
+The terminal backend puts the console into unbuffered, no-echo mode so that
+every key reaches the VM as soon as it is pressed: through the Win32 console
+API on Windows, through termios everywhere else. The headless backend leaves
+stdin alone and just reads it as a byte stream, for input redirected from a
+file or a pipe and for machines without a terminal at all.
+*/
+
+enum ConsoleBackend {
+	CONSOLE_TERMINAL = 0, // Raw key input from an interactive terminal
+	CONSOLE_HEADLESS, // stdin is read as it is, nothing is changed or restored
+};
+
+// CONSOLE_TERMINAL when stdin is an interactive terminal, CONSOLE_HEADLESS otherwise
+ConsoleBackend default_console_backend();
+
+// Pick the backend, must be called before disable_input_buffering
+void set_console_backend(ConsoleBackend backend);
 
 void disable_input_buffering();
 void restore_input_buffering();
-void handle_interrupt(int signal); 
-uint16_t check_key();
\ No newline at end of file
+
+/*
+SIGINT handler. It only records the interrupt, sets the flag given to
+stop_on_interrupt() and wakes the console reader, which reports the end of
+input from then on (a thread blocked reading the console on Windows is left
+behind and the console's KeyBuffer closed instead). With a machine's
+Machine::stop_requested as the flag, run_to_halt() returns after the slice it
+is in, so the output and the trace are flushed on the way out. A second
+interrupt exits at once.
+*/
+void handle_interrupt(int signal);
+bool interrupt_requested();
+
+// The flag handle_interrupt() sets, nullptr for none
+void stop_on_interrupt(std::atomic<bool>* flag);
+
+// Block until the next key on stdin, EOF at the end of input
+int read_console_key();
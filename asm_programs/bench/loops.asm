@@ -0,0 +1,23 @@
+;--------------------------------------------------------------------------
+; Benchmark kernel: nested counting loops
+; 2000 x 5000 iterations of an ADD/AND/BR inner loop
+;--------------------------------------------------------------------------
+
+.ORIG x3000
+      LD    R1, OUTER
+OUT_LOOP
+      LD    R2, INNER
+      AND   R3, R3, #0
+IN_LOOP
+      ADD   R3, R3, #3
+      AND   R4, R3, #7
+      ADD   R5, R5, R4
+      ADD   R2, R2, #-1
+      BRp   IN_LOOP
+      ADD   R1, R1, #-1
+      BRp   OUT_LOOP
+      HALT
+
+      OUTER .FILL #2000
+      INNER .FILL #5000
+.END
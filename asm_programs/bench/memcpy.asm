@@ -0,0 +1,29 @@
+;--------------------------------------------------------------------------
+; Benchmark kernel: block copy
+; Copies 4096 words from x4000 to x6000 with LDR/STR, 1000 times
+;--------------------------------------------------------------------------
+
+.ORIG x3000
+      LD    R4, PASSES
+PASS
+      LD    R0, SRC
+      LD    R1, DST
+      LD    R2, WORDS
+COPY
+      LDR   R3, R0, #0
+      STR   R3, R1, #0
+      LDR   R3, R0, #1
+      STR   R3, R1, #1
+      ADD   R0, R0, #2
+      ADD   R1, R1, #2
+      ADD   R2, R2, #-2
+      BRp   COPY
+      ADD   R4, R4, #-1
+      BRp   PASS
+      HALT
+
+      PASSES .FILL #1000
+      SRC    .FILL x4000
+      DST    .FILL x6000
+      WORDS  .FILL #4096
+.END
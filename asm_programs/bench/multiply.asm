@@ -0,0 +1,26 @@
+;--------------------------------------------------------------------------
+; Benchmark kernel: multiplication by repeated addition
+; Sums a * b for every a, b in 1..250, each product computed with b ADDs
+;--------------------------------------------------------------------------
+
+.ORIG x3000
+      AND   R5, R5, #0        ; running sum (mod 2^16)
+      LD    R1, LIMIT         ; a
+A_LOOP
+      LD    R2, LIMIT         ; b
+B_LOOP
+      AND   R0, R0, #0        ; r0 = a * b
+      ADD   R3, R2, #0
+MUL_LOOP
+      ADD   R0, R0, R1
+      ADD   R3, R3, #-1
+      BRp   MUL_LOOP
+      ADD   R5, R5, R0
+      ADD   R2, R2, #-1
+      BRp   B_LOOP
+      ADD   R1, R1, #-1
+      BRp   A_LOOP
+      HALT
+
+      LIMIT .FILL #250
+.END
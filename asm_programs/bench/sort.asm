@@ -0,0 +1,56 @@
+;--------------------------------------------------------------------------
+; Benchmark kernel: bubble sort
+; Fills 512 words at x4000 from a linear congruential generator and bubble
+; sorts them, 10 times over with a different seed each time
+;--------------------------------------------------------------------------
+
+.ORIG x3000
+      LD    R6, ROUNDS
+      AND   R5, R5, #0        ; LCG state, carried over between rounds
+ROUND
+      LD    R0, ARRAY
+      LD    R1, COUNT
+FILL
+      ADD   R2, R5, R5        ; r5 = 5 * r5 + 13849
+      ADD   R2, R2, R2
+      ADD   R5, R2, R5
+      LD    R2, INCREMENT
+      ADD   R5, R5, R2
+      LD    R2, MASK          ; keep values positive so subtraction compares them
+      AND   R2, R5, R2
+      STR   R2, R0, #0
+      ADD   R0, R0, #1
+      ADD   R1, R1, #-1
+      BRp   FILL
+
+      LD    R1, COUNT         ; passes left
+      ADD   R1, R1, #-1
+PASS_LOOP
+      LD    R0, ARRAY
+      ADD   R4, R1, #0        ; pairs to compare in this pass
+PAIR
+      LDR   R2, R0, #0
+      LDR   R3, R0, #1
+      NOT   R7, R3            ; r7 = r2 - r3
+      ADD   R7, R7, #1
+      ADD   R7, R2, R7
+      BRnz  IN_ORDER
+      STR   R3, R0, #0
+      STR   R2, R0, #1
+IN_ORDER
+      ADD   R0, R0, #1
+      ADD   R4, R4, #-1
+      BRp   PAIR
+      ADD   R1, R1, #-1
+      BRp   PASS_LOOP
+
+      ADD   R6, R6, #-1
+      BRp   ROUND
+      HALT
+
+      ROUNDS    .FILL #10
+      ARRAY     .FILL x4000
+      COUNT     .FILL #512
+      INCREMENT .FILL #13849
+      MASK      .FILL x3FFF
+.END
@@ -0,0 +1,42 @@
+# Differential test of every engine on every image in obj_files.
+#
+#   cmake -DLC3=build/lc3 [-DWORK_DIR=build] [-DMAX_INSTRUCTIONS=20000000] [-DCHECK_EVERY=100000] -P cmake/difftest.cmake
+#
+# Writes a manifest of obj_files/*.obj and obj_files/bench/*.obj, the games
+# reading a scripted cycle of moves, and runs it through lc3 --difftest. Fails
+# if any engine disagrees with the switch core. `cmake --build build --target
+# difftest` runs it on the lc3 of that build.
+
+cmake_minimum_required(VERSION 3.13)
+
+get_filename_component(SOURCE_DIR ${CMAKE_CURRENT_LIST_DIR}/.. ABSOLUTE)
+if(NOT LC3)
+	message(FATAL_ERROR "difftest: set LC3 to the lc3 executable")
+endif()
+if(NOT WORK_DIR)
+	set(WORK_DIR ${CMAKE_CURRENT_BINARY_DIR})
+endif()
+if(NOT MAX_INSTRUCTIONS)
+	set(MAX_INSTRUCTIONS 20000000)
+endif()
+if(NOT CHECK_EVERY)
+	set(CHECK_EVERY 100000)
+endif()
+
+set(keys "n")
+foreach(i RANGE 499)
+	string(APPEND keys "wasdwdsa")
+endforeach()
+file(WRITE ${WORK_DIR}/difftest-keys.txt "${keys}n")
+file(GLOB images ${SOURCE_DIR}/obj_files/*.obj ${SOURCE_DIR}/obj_files/bench/*.obj)
+set(manifest "")
+foreach(image ${images})
+	string(APPEND manifest "${image} < ${WORK_DIR}/difftest-keys.txt\n")
+endforeach()
+file(WRITE ${WORK_DIR}/difftest.txt "${manifest}")
+
+execute_process(COMMAND ${LC3} --difftest ${WORK_DIR}/difftest.txt --check-every ${CHECK_EVERY} --max-instructions ${MAX_INSTRUCTIONS}
+	RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+	message(FATAL_ERROR "difftest: the engines disagree (${result})")
+endif()
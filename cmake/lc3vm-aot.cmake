@@ -0,0 +1,22 @@
+# lc3vm_add_aot(target image.obj [NAME name])
+#
+# Translates image.obj to C++ with lc3 --aot at build time and compiles the
+# result into target, which must link lc3vm. The target then runs the image
+# natively when a machine uses ENGINE_AOT (aot.h). LC3VM_AOT_TRANSLATOR names
+# the lc3 executable or target that does the translation.
+function(lc3vm_add_aot target image)
+	cmake_parse_arguments(AOT "" "NAME" "" ${ARGN})
+	get_filename_component(image ${image} ABSOLUTE)
+	if(NOT AOT_NAME)
+		get_filename_component(AOT_NAME ${image} NAME_WE)
+	endif()
+	set(source ${CMAKE_CURRENT_BINARY_DIR}/aot/${target}/${AOT_NAME}.cpp)
+	add_custom_command(OUTPUT ${source}
+		COMMAND ${CMAKE_COMMAND} -E make_directory ${CMAKE_CURRENT_BINARY_DIR}/aot/${target}
+		COMMAND ${LC3VM_AOT_TRANSLATOR} --aot ${image} -o ${source} --name ${AOT_NAME}
+		DEPENDS ${LC3VM_AOT_TRANSLATOR} ${image}
+		COMMENT "Translating ${AOT_NAME} for ${target}"
+		VERBATIM
+	)
+	target_sources(${target} PRIVATE ${source})
+endfunction()
@@ -0,0 +1,126 @@
+# Profile guided build of lc3 and lc3bench, with the benchmark of the result.
+#
+#   cmake [-DBUILD_DIR=build-pgo] [-DRUNS=5] [-DGENERATOR=Ninja] [-DCXX=clang++] -P cmake/pgo.cmake
+#
+# 1. BUILD_DIR/baseline: a plain Release build to compare against.
+# 2. BUILD_DIR/pgo with LC3VM_PGO=GENERATE: instrumented binaries.
+# 3. Training: lc3bench once on every kernel and engine, then every image in
+#    obj_files through lc3 --batch on every engine with scripted keys.
+# 4. Clang's raw profiles are merged with llvm-profdata (LLVM_PROFDATA to
+#    override), GCC and MSVC read theirs as they are.
+# 5. BUILD_DIR/pgo again with LC3VM_PGO=USE: the optimised build.
+# 6. lc3bench of the baseline is saved and the optimised one compared to it,
+#    the table is kept in BUILD_DIR/pgo-report.txt.
+
+cmake_minimum_required(VERSION 3.13)
+
+get_filename_component(SOURCE_DIR ${CMAKE_CURRENT_LIST_DIR}/.. ABSOLUTE)
+if(NOT BUILD_DIR)
+	set(BUILD_DIR ${SOURCE_DIR}/build-pgo)
+endif()
+get_filename_component(BUILD_DIR ${BUILD_DIR} ABSOLUTE BASE_DIR ${CMAKE_CURRENT_BINARY_DIR})
+if(NOT RUNS)
+	set(RUNS 5)
+endif()
+
+set(PGO_BUILD ${BUILD_DIR}/pgo)
+set(PROFILE_DIR ${BUILD_DIR}/profile)
+set(OBJ_DIR ${SOURCE_DIR}/obj_files)
+
+set(CONFIGURE_ARGS -DCMAKE_BUILD_TYPE=Release -DLC3VM_BUILD_SHARED=OFF)
+if(GENERATOR)
+	list(APPEND CONFIGURE_ARGS -G ${GENERATOR})
+endif()
+if(CXX)
+	list(APPEND CONFIGURE_ARGS -DCMAKE_CXX_COMPILER=${CXX})
+endif()
+
+function(run_step)
+	execute_process(COMMAND ${ARGN} RESULT_VARIABLE result)
+	if(NOT result EQUAL 0)
+		string(REPLACE ";" " " command "${ARGN}")
+		message(FATAL_ERROR "pgo: failed (${result}): ${command}")
+	endif()
+endfunction()
+
+function(build dir)
+	run_step(${CMAKE_COMMAND} -S ${SOURCE_DIR} -B ${dir} ${CONFIGURE_ARGS} ${ARGN})
+	run_step(${CMAKE_COMMAND} --build ${dir} --config Release --target lc3 lc3bench)
+endfunction()
+
+# Single and multi-config generators put executables in different places
+function(find_executable out dir name)
+	foreach(candidate ${dir}/${name} ${dir}/${name}.exe ${dir}/Release/${name} ${dir}/Release/${name}.exe)
+		if(EXISTS ${candidate} AND NOT IS_DIRECTORY ${candidate})
+			set(${out} ${candidate} PARENT_SCOPE)
+			return()
+		endif()
+	endforeach()
+	message(FATAL_ERROR "pgo: no ${name} in ${dir}")
+endfunction()
+
+message(STATUS "pgo: baseline build")
+build(${BUILD_DIR}/baseline -DLC3VM_PGO=OFF)
+
+message(STATUS "pgo: instrumented build")
+file(REMOVE_RECURSE ${PROFILE_DIR})
+build(${PGO_BUILD} -DLC3VM_PGO=GENERATE -DLC3VM_PGO_DIR=${PROFILE_DIR})
+find_executable(lc3 ${PGO_BUILD} lc3)
+find_executable(lc3bench ${PGO_BUILD} lc3bench)
+# MSVC writes its counts next to the binaries, drop those of an earlier training
+get_filename_component(bin_dir ${lc3} DIRECTORY)
+file(GLOB stale ${bin_dir}/*.pgc)
+if(stale)
+	file(REMOVE ${stale})
+endif()
+
+message(STATUS "pgo: training")
+run_step(${lc3bench} --runs 1 --dir ${OBJ_DIR})
+# The games read keys, the same cycle of moves keeps them playing until the budget runs out
+set(keys "n")
+foreach(i RANGE 499)
+	string(APPEND keys "wasdwdsa")
+endforeach()
+file(WRITE ${BUILD_DIR}/training-keys.txt "${keys}n")
+file(GLOB images ${OBJ_DIR}/*.obj)
+set(manifest "")
+foreach(image ${images})
+	string(APPEND manifest "${image} < ${BUILD_DIR}/training-keys.txt\n")
+endforeach()
+file(WRITE ${BUILD_DIR}/training.txt "${manifest}")
+# Programs that never halt end on the budget, which lc3 reports as a failure
+foreach(engine switch threaded predecoded jit)
+	execute_process(COMMAND ${lc3} --batch ${BUILD_DIR}/training.txt --engine ${engine} --threads 1 --max-instructions 20000000
+		OUTPUT_QUIET RESULT_VARIABLE result)
+	if(NOT result MATCHES "^[0-9]+$")
+		message(FATAL_ERROR "pgo: training on ${engine} failed: ${result}")
+	endif()
+endforeach()
+
+file(GLOB raw ${PROFILE_DIR}/*.profraw)
+if(raw)
+	message(STATUS "pgo: merging clang profiles")
+	if(NOT LLVM_PROFDATA)
+		find_program(LLVM_PROFDATA NAMES llvm-profdata)
+	endif()
+	if(NOT LLVM_PROFDATA)
+		message(FATAL_ERROR "pgo: llvm-profdata not found, set LLVM_PROFDATA")
+	endif()
+	run_step(${LLVM_PROFDATA} merge -output=${PROFILE_DIR}/lc3vm.profdata ${raw})
+endif()
+
+message(STATUS "pgo: optimised build")
+build(${PGO_BUILD} -DLC3VM_PGO=USE -DLC3VM_PGO_DIR=${PROFILE_DIR})
+find_executable(lc3bench ${PGO_BUILD} lc3bench)
+find_executable(baseline_bench ${BUILD_DIR}/baseline lc3bench)
+
+message(STATUS "pgo: benchmark")
+run_step(${baseline_bench} --runs ${RUNS} --dir ${OBJ_DIR} --save ${BUILD_DIR}/baseline-times.txt OUTPUT_QUIET)
+execute_process(COMMAND ${lc3bench} --runs ${RUNS} --dir ${OBJ_DIR} --compare ${BUILD_DIR}/baseline-times.txt
+	OUTPUT_VARIABLE report RESULT_VARIABLE result)
+file(WRITE ${BUILD_DIR}/pgo-report.txt "${report}")
+message("${report}")
+if(NOT result EQUAL 0)
+	message(FATAL_ERROR "pgo: the optimised benchmark failed")
+endif()
+message(STATUS "pgo: lc3 and lc3bench built with the profile are in ${PGO_BUILD}")
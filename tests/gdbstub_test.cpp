@@ -0,0 +1,131 @@
+/*
+The GDB stub over a real connection: memory packets whose address and length
+reach past the end of memory are refused, whatever the 32-bit sum wraps to.
+*/
+
+#include "LC3VM.h"
+#include "gdbstub.h"
+#include "input.h"
+
+#include <stdio.h>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace LC3VM;
+
+namespace {
+	int failures = 0;
+
+	void check(bool ok, const char* what) {
+		if (!ok) {
+			fprintf(stderr, "FAIL: %s\n", what);
+			failures++;
+		}
+	}
+
+	// A port nothing listens on right now
+	uint16_t free_port() {
+		int s = socket(AF_INET, SOCK_STREAM, 0);
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t length = sizeof(address);
+		bind(s, (const sockaddr*)&address, sizeof(address));
+		getsockname(s, (sockaddr*)&address, &length);
+		close(s);
+		return ntohs(address.sin_port);
+	}
+
+	int connect_to(uint16_t port) {
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_port = htons(port);
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		// The stub starts listening on its own thread
+		for (int attempt = 0; attempt < 200; attempt++) {
+			int s = socket(AF_INET, SOCK_STREAM, 0);
+			if (connect(s, (const sockaddr*)&address, sizeof(address)) == 0) {
+				return s;
+			}
+			close(s);
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		return -1;
+	}
+
+	// Send packet and return the data of the reply
+	std::string exchange(int s, const std::string& packet) {
+		unsigned sum = 0;
+		for (char c : packet) {
+			sum += (uint8_t)c;
+		}
+		char checksum[4];
+		snprintf(checksum, sizeof(checksum), "%02x", sum & 0xFF);
+		std::string framed = "$" + packet + "#" + checksum;
+		send(s, framed.data(), framed.size(), 0);
+
+		std::string reply;
+		bool inside = false;
+		char c;
+		while (recv(s, &c, 1, 0) == 1) {
+			if (!inside) {
+				inside = c == '$';
+				continue;
+			}
+			if (c == '#') {
+				char tail[2];
+				recv(s, tail, 1, MSG_WAITALL);
+				recv(s, tail + 1, 1, MSG_WAITALL);
+				send(s, "+", 1, 0);
+				return reply;
+			}
+			reply += c;
+		}
+		return "(connection closed)";
+	}
+}
+
+int main() {
+	Machine vm;
+	BufferInput keys("");
+	vm.keyboard = &keys;
+	vm.output.set_sink(nullptr, false);
+	vm.memory[0xFFFE] = 0x1234;
+	vm.memory[0xFFFF] = 0xABCD;
+	vm.reset();
+
+	Debugger debugger(vm);
+	GdbStub stub(vm, debugger);
+	uint16_t port = free_port();
+	bool served = false;
+	std::thread server([&] { served = stub.serve(port, nullptr); });
+
+	int s = connect_to(port);
+	check(s >= 0, "connect to the stub");
+	if (s >= 0) {
+		check(exchange(s, "mfffe,2") == "1234abcd", "m reads the last words of memory");
+		check(exchange(s, "mffff,2") == "E01", "m past the end of memory is refused");
+		check(exchange(s, "mffffffff,1") == "E01", "m with an address that wraps is refused");
+		check(exchange(s, "m1,ffffffff") == "E01", "m with a length that wraps is refused");
+		check(exchange(s, "m10000,0") == "E01", "m at the end of memory is refused");
+		check(exchange(s, "Mffffffff,1:0000") == "E01", "M with an address that wraps is refused");
+		check(exchange(s, "M1,ffffffff:0000") == "E01", "M with a length that wraps is refused");
+		check(exchange(s, "Mffff,1:5555") == "OK" && vm.memory[0xFFFF] == 0x5555, "M writes the last word of memory");
+		send(s, "$k#6b", 5, 0);
+		close(s);
+	}
+	server.join();
+	check(served, "serve() accepted the connection");
+
+	if (failures) {
+		return 1;
+	}
+	printf("gdbstub: all checks passed\n");
+	return 0;
+}